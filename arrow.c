@@ -0,0 +1,766 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <sys/param.h>
+
+#include "arrow.h"
+
+#define reinterpret(type,value) *((type*)&value)
+
+// arrow type, message and unit codes from Schema.fbs and Message.fbs
+enum { T_INT = 2, T_FLOAT = 3, T_UTF8 = 5, T_DATE = 8, T_TIMESTAMP = 10, T_LARGE_UTF8 = 20 };
+enum { M_SCHEMA = 1, M_DICTIONARY = 2, M_RECORDS = 3 };
+enum { V4 = 3, V5 = 4 };
+enum { DOUBLE = 2, DAY = 0, MICROSECOND = 2 };
+
+// records are transposed to columns and back in blocks of rows that stay
+// in cache while each of their fields is visited
+#define ARROW_BLOCK 64
+
+static void put16(unsigned char *p, uint16_t v) { memcpy(p, &v, 2); }
+static void put32(unsigned char *p, uint32_t v) { memcpy(p, &v, 4); }
+static void put64(unsigned char *p, uint64_t v) { memcpy(p, &v, 8); }
+static uint16_t get16(const unsigned char *p) { uint16_t v; memcpy(&v, p, 2); return v; }
+static uint32_t get32(const unsigned char *p) { uint32_t v; memcpy(&v, p, 4); return v; }
+static uint64_t get64(const unsigned char *p) { uint64_t v; memcpy(&v, p, 8); return v; }
+
+// flatbuffer metadata is laid out front to back in a buffer sized for the
+// message: the root offset, then each table after its vtable, with offset
+// fields patched once the objects they point to have been placed
+typedef struct {
+    unsigned char *data;
+    size_t size;
+} fbb_t;
+
+static int fbb_init(fbb_t *b, size_t allocated) {
+    b->data = calloc(allocated, 1);
+    b->size = 4;
+    return b->data ? ODB_OK : ODB_ENOMEM;
+}
+
+static size_t fbb_reserve(fbb_t *b, size_t n, size_t align) {
+    size_t pos = (b->size + align - 1) & ~(align - 1);
+    b->size = pos + n;
+    return pos;
+}
+
+static void fbb_ref(fbb_t *b, size_t slot, size_t target) {
+    put32(b->data + slot, target - slot);
+}
+
+// a table of n fields of the given sizes, 0 for absent ones; the position
+// of each field goes to slots
+static size_t fbb_table(fbb_t *b, int n, const int *sizes, size_t *slots) {
+    size_t vt = fbb_reserve(b, 4 + 2*n, 2);
+    size_t t = fbb_reserve(b, 4, 4);
+    for (int i = 0; i < n; i++) {
+        slots[i] = sizes[i] ? fbb_reserve(b, sizes[i], sizes[i]) : 0;
+        put16(b->data + vt + 4 + 2*i, slots[i] ? slots[i] - t : 0);
+    }
+    put16(b->data + vt, 4 + 2*n);
+    put16(b->data + vt + 2, b->size - t);
+    put32(b->data + t, t - vt);
+    return t;
+}
+
+// the position of the length of a vector, whose elements follow it
+static size_t fbb_vector(fbb_t *b, size_t n, size_t elem, size_t align) {
+    size_t pos = ((b->size + 4 + align - 1) & ~(align - 1)) - 4;
+    b->size = pos + 4 + n*elem;
+    put32(b->data + pos, n);
+    return pos;
+}
+
+static size_t fbb_string(fbb_t *b, const char *str) {
+    size_t len = strlen(str);
+    size_t pos = fbb_vector(b, len + 1, 1, 4);
+    put32(b->data + pos, len);
+    memcpy(b->data + pos + 4, str, len);
+    return pos;
+}
+
+// the root Message table, returning the slot of its header offset
+static size_t fbb_message(fbb_t *b, int type, long long body_length) {
+    size_t s[4];
+    size_t t = fbb_table(b, 4, (int[]){2, 1, 4, 8}, s);
+    fbb_ref(b, 0, t);
+    put16(b->data + s[0], V5);
+    b->data[s[1]] = type;
+    put64(b->data + s[3], body_length);
+    return s[2];
+}
+
+static size_t fbb_int_type(fbb_t *b, int bits, int is_signed) {
+    size_t s[2];
+    size_t t = fbb_table(b, 2, (int[]){4, 1}, s);
+    put32(b->data + s[0], bits);
+    b->data[s[1]] = is_signed;
+    return t;
+}
+
+// body buffers are 8-byte aligned
+static long long body_length(const long long *lengths, int n) {
+    long long size = 0;
+    for (int i = 0; i < n; i++) size += (lengths[i] + 7) & ~7;
+    return size;
+}
+
+// a RecordBatch of columns arrays with the given null counts (or none), in
+// the given buffers
+static size_t fbb_records(fbb_t *b, long long rows, int columns, const long long *nulls,
+                          const long long *lengths, int n) {
+    size_t s[3];
+    size_t t = fbb_table(b, 3, (int[]){8, 4, 4}, s);
+    put64(b->data + s[0], rows);
+    size_t nodes = fbb_vector(b, columns, 16, 8);
+    fbb_ref(b, s[1], nodes);
+    for (int i = 0; i < columns; i++) {
+        put64(b->data + nodes + 4 + 16*i, rows);
+        put64(b->data + nodes + 12 + 16*i, nulls ? nulls[i] : 0);
+    }
+    size_t buffers = fbb_vector(b, n, 16, 8);
+    fbb_ref(b, s[2], buffers);
+    for (long long i = 0, offset = 0; i < n; offset += (lengths[i++] + 7) & ~7) {
+        put64(b->data + buffers + 4 + 16*i, offset);
+        put64(b->data + buffers + 12 + 16*i, lengths[i]);
+    }
+    return t;
+}
+
+// an encapsulated message: a continuation marker, the length of the
+// metadata padded to 8 bytes, the metadata, then the body buffers
+static int write_message(FILE *file, fbb_t *b, unsigned char **buffers, const long long *lengths, int n) {
+    static const unsigned char zeros[8];
+    uint32_t prefix[2] = { 0xFFFFFFFF, (b->size + 7) & ~7 };
+    int e = fwrite(prefix, 8, 1, file) != 1 ||
+            fwrite(b->data, 1, b->size, file) != b->size ||
+            fwrite(zeros, 1, prefix[1] - b->size, file) != prefix[1] - b->size;
+    for (int i = 0; i < n && !e; i++)
+        e = fwrite(buffers[i], 1, lengths[i], file) != lengths[i] ||
+            fwrite(zeros, 1, -lengths[i] & 7, file) != (-lengths[i] & 7);
+    free(b->data);
+    return e ? ODB_EIO : ODB_OK;
+}
+
+static int write_schema(arrow_writer_t *w) {
+    fbb_t b;
+    long long fc = w->header.field_count;
+    if (fbb_init(&b, 1024 + fc*(ODB_NAME_SIZE + 512))) return ODB_ENOMEM;
+    size_t s[6], u[3];
+    size_t header = fbb_message(&b, M_SCHEMA, 0);
+    size_t schema = fbb_table(&b, 2, (int[]){0, 4}, s);
+    fbb_ref(&b, header, schema);
+    size_t fields = fbb_vector(&b, fc, 4, 4);
+    fbb_ref(&b, s[1], fields);
+    for (long long i = 0; i < fc; i++) {
+        odb_type_t type = w->header.field_specs[i].type;
+        size_t f = fbb_table(&b, 6, (int[]){4, 1, 1, 4, type == ODB_STRING ? 4 : 0, 4}, s);
+        fbb_ref(&b, fields + 4 + 4*i, f);
+        fbb_ref(&b, s[0], fbb_string(&b, w->header.field_specs[i].name));
+        size_t t;
+        switch (type) {
+            case ODB_INTEGER:
+                b.data[s[2]] = T_INT;
+                t = fbb_int_type(&b, 64, 1);
+                break;
+            case ODB_FLOAT:
+                b.data[s[2]] = T_FLOAT;
+                t = fbb_table(&b, 1, (int[]){2}, u);
+                put16(b.data + u[0], DOUBLE);
+                break;
+            case ODB_STRING: {
+                // fields with the same sorted strings.idx share its dictionary
+                b.data[s[2]] = w->large[i] ? T_LARGE_UTF8 : T_UTF8;
+                t = fbb_table(&b, 0, NULL, u);
+                size_t d = fbb_table(&b, 3, (int[]){8, 4, 1}, u);
+                fbb_ref(&b, s[4], d);
+                put64(b.data + u[0], w->ids[i]);
+                fbb_ref(&b, u[1], fbb_int_type(&b, 32, 1));
+                b.data[u[2]] = 1;
+                break;
+            }
+            case ODB_TIMESTAMP:
+                b.data[s[1]] = 1;
+                b.data[s[2]] = T_TIMESTAMP;
+                t = fbb_table(&b, 1, (int[]){2}, u);
+                put16(b.data + u[0], MICROSECOND);
+                break;
+            case ODB_DATE:
+                b.data[s[1]] = 1;
+                b.data[s[2]] = T_DATE;
+                t = fbb_table(&b, 1, (int[]){2}, u);
+                put16(b.data + u[0], DAY);
+                break;
+            default:
+                free(b.data);
+                return ODB_EUNSUPPORTED;
+        }
+        fbb_ref(&b, s[3], t);
+        fbb_ref(&b, s[5], fbb_vector(&b, 0, 4, 4));
+    }
+    return write_message(w->file, &b, NULL, NULL, 0);
+}
+
+static int write_dictionary(arrow_writer_t *w, int f) {
+    const odb_strings_t *strings = w->strings[f];
+    int large = w->large[f], width = large ? 8 : 4;
+    unsigned char *offsets = malloc((strings->count + 1)*width), *data;
+    size_t size = 0;
+    for (off_t i = 0; i < strings->count; i++) size += strlen(odb_index_to_string(strings, i));
+    if (!offsets || !(data = malloc(size + 1))) {
+        free(offsets);
+        return ODB_ENOMEM;
+    }
+    size = 0;
+    for (off_t i = 0; i < strings->count; i++) {
+        const char *str = odb_index_to_string(strings, i);
+        size_t len = strlen(str);
+        large ? put64(offsets + 8*i, size) : put32(offsets + 4*i, size);
+        memcpy(data + size, str, len);
+        size += len;
+    }
+    large ? put64(offsets + 8*strings->count, size) : put32(offsets + 4*strings->count, size);
+
+    fbb_t b;
+    unsigned char *buffers[3] = { NULL, offsets, data };
+    long long lengths[3] = { 0, (strings->count + 1)*width, size };
+    int e = fbb_init(&b, 1024);
+    if (!e) {
+        size_t s[2];
+        size_t header = fbb_message(&b, M_DICTIONARY, body_length(lengths, 3));
+        size_t t = fbb_table(&b, 2, (int[]){8, 4}, s);
+        fbb_ref(&b, header, t);
+        put64(b.data + s[0], w->ids[f]);
+        fbb_ref(&b, s[1], fbb_records(&b, strings->count, 1, NULL, lengths, 3));
+        e = write_message(w->file, &b, buffers, lengths, 3);
+    }
+    free(offsets);
+    free(data);
+    return e;
+}
+
+static void free_writer(arrow_writer_t *w) {
+    free(w->records);
+    free(w->body);
+    free(w->ids);
+    free(w->large);
+    w->records = NULL;
+    w->body = NULL;
+    w->ids = w->large = NULL;
+}
+
+int arrow_writer_init(arrow_writer_t *w, FILE *file, const odb_header_t *h, const odb_strings_t *const *strings) {
+    long long fc = h->field_count;
+    memset(w, 0, sizeof(*w));
+    w->file = file;
+    w->header = *h;
+    w->strings = strings;
+    w->records = malloc(ARROW_BATCH*fc*sizeof(long long));
+    w->body = malloc(ARROW_BATCH*fc*sizeof(long long));
+    w->ids = calloc(fc, sizeof(int));
+    w->large = calloc(fc, sizeof(int));
+    if (!w->records || !w->body || !w->ids || !w->large) {
+        free_writer(w);
+        return ODB_ENOMEM;
+    }
+
+    // a dictionary is numbered by the first field using it, and one too big
+    // for 32-bit offsets uses large strings
+    for (long long f = 0; f < fc; f++) {
+        if (h->field_specs[f].type != ODB_STRING) continue;
+        for (w->ids[f] = 0; strings[w->ids[f]] != strings[f]; w->ids[f]++);
+        if (w->ids[f] < f) {
+            w->large[f] = w->large[w->ids[f]];
+            continue;
+        }
+        if (strings[f]->count > INT32_MAX) return ODB_EUNSUPPORTED;
+        size_t size = 0;
+        for (off_t i = 0; i < strings[f]->count; i++) size += strlen(odb_index_to_string(strings[f], i));
+        w->large[f] = size > INT32_MAX;
+    }
+    int e = write_schema(w);
+    for (long long f = 0; !e && f < fc; f++)
+        if (h->field_specs[f].type == ODB_STRING && w->ids[f] == f) e = write_dictionary(w, f);
+    return e;
+}
+
+static int width(odb_type_t type) {
+    return type == ODB_STRING || type == ODB_DATE ? 4 : 8;
+}
+
+// times that are NaN, infinite or out of range of their column are nulls,
+// and only time columns have validity bitmaps
+static int flush_records(arrow_writer_t *w) {
+    long long fc = w->header.field_count;
+    unsigned char **buffers = malloc(2*fc*sizeof(unsigned char*));
+    long long *lengths = malloc(2*fc*sizeof(long long));
+    long long *nulls = calloc(fc, sizeof(long long));
+    unsigned char *valid = malloc(fc*ARROW_BATCH/8);
+    if (!buffers || !lengths || !nulls || !valid) {
+        free(buffers);
+        free(lengths);
+        free(nulls);
+        free(valid);
+        return ODB_ENOMEM;
+    }
+    for (long long f = 0; f < fc; f++) {
+        buffers[2*f] = NULL;
+        buffers[2*f + 1] = w->body + f*ARROW_BATCH*sizeof(long long);
+        lengths[2*f] = 0;
+        lengths[2*f + 1] = w->n*width(w->header.field_specs[f].type);
+    }
+
+    int e = ODB_OK;
+    for (size_t i0 = 0; i0 < w->n && !e; i0 += ARROW_BLOCK) {
+        size_t m = MIN(ARROW_BLOCK, w->n - i0);
+        const long long *block = w->records + i0*fc;
+        for (long long f = 0; f < fc; f++) {
+            unsigned char *column = buffers[2*f + 1];
+            switch (w->header.field_specs[f].type) {
+                case ODB_INTEGER:
+                case ODB_FLOAT: {
+                    long long *v = (long long*) column + i0;
+                    for (size_t i = 0; i < m; i++) v[i] = block[i*fc + f];
+                    break;
+                }
+                case ODB_STRING: {
+                    int32_t *v = (int32_t*) column + i0;
+                    for (size_t i = 0; i < m; i++) {
+                        long long x = block[i*fc + f];
+                        if (x < 0 || x >= w->strings[f]->count) e = ODB_EFORMAT;
+                        v[i] = x;
+                    }
+                    break;
+                }
+                case ODB_TIMESTAMP:
+                case ODB_DATE: {
+                    int date = w->header.field_specs[f].type == ODB_DATE;
+                    unsigned long long bits = 0;
+                    for (size_t i = 0; i < m; i++) {
+                        double x = reinterpret(double, block[i*fc + f]);
+                        x = date ? floor(x/86400) : round(x*1e6);
+                        int ok = date ? fabs(x) <= INT32_MAX : fabs(x) < 0x1p63;
+                        if (date) ((int32_t*) column)[i0 + i] = ok ? x : 0;
+                        else ((long long*) column)[i0 + i] = ok ? x : 0;
+                        bits |= (unsigned long long) ok << i;
+                        nulls[f] += !ok;
+                    }
+                    memcpy(valid + f*ARROW_BATCH/8 + i0/8, &bits, (m + 7)/8);
+                    break;
+                }
+            }
+        }
+    }
+
+    for (long long f = 0; f < fc; f++) {
+        if (!nulls[f]) continue;
+        buffers[2*f] = valid + f*ARROW_BATCH/8;
+        lengths[2*f] = (w->n + 7)/8;
+    }
+
+    fbb_t b;
+    if (!e) e = fbb_init(&b, 1024 + fc*64);
+    if (!e) {
+        size_t header = fbb_message(&b, M_RECORDS, body_length(lengths, 2*fc));
+        fbb_ref(&b, header, fbb_records(&b, w->n, fc, nulls, lengths, 2*fc));
+        e = write_message(w->file, &b, buffers, lengths, 2*fc);
+    }
+    free(buffers);
+    free(nulls);
+    free(valid);
+    free(lengths);
+    w->n = 0;
+    return e;
+}
+
+int arrow_write_batch(arrow_writer_t *w, const long long *records, size_t n) {
+    long long fc = w->header.field_count;
+    while (n) {
+        size_t m = MIN(n, ARROW_BATCH - w->n);
+        memcpy(w->records + w->n*fc, records, m*fc*sizeof(long long));
+        w->n += m;
+        records += m*fc;
+        n -= m;
+        int e;
+        if (w->n == ARROW_BATCH && (e = flush_records(w))) return e;
+    }
+    return ODB_OK;
+}
+
+int arrow_writer_finish(arrow_writer_t *w) {
+    static const uint32_t end[2] = { 0xFFFFFFFF, 0 };
+    int e = w->n ? flush_records(w) : ODB_OK;
+    if (!e && fwrite(end, 8, 1, w->file) != 1) e = ODB_EIO;
+    free_writer(w);
+    return e;
+}
+
+// reading flatbuffers, where position 0 (the root offset) doubles as the
+// result of lookups that are absent or out of bounds
+
+typedef struct {
+    const unsigned char *data;
+    size_t size;
+} fb_t;
+
+static size_t fb_deref(const fb_t *m, size_t pos) {
+    if (!pos || pos + 4 > m->size) return 0;
+    size_t t = pos + get32(m->data + pos);
+    return t + 4 <= m->size ? t : 0;
+}
+
+static size_t fb_field(const fb_t *m, size_t t, int i, size_t size) {
+    if (!t) return 0;
+    long long vt = (long long) t - (int32_t) get32(m->data + t);
+    if (vt < 0 || vt + 4 > m->size) return 0;
+    size_t vsize = get16(m->data + vt);
+    if (4 + 2*i + 2 > vsize || vt + vsize > m->size) return 0;
+    size_t offset = get16(m->data + vt + 4 + 2*i);
+    return offset && t + offset + size <= m->size ? t + offset : 0;
+}
+
+static long long fb_int(const fb_t *m, size_t t, int i, int size, long long otherwise) {
+    size_t p = fb_field(m, t, i, size);
+    if (!p) return otherwise;
+    switch (size) {
+        case 1: return m->data[p];
+        case 2: return (int16_t) get16(m->data + p);
+        case 4: return (int32_t) get32(m->data + p);
+        default: return (int64_t) get64(m->data + p);
+    }
+}
+
+static size_t fb_table(const fb_t *m, size_t t, int i) {
+    return fb_deref(m, fb_field(m, t, i, 4));
+}
+
+// the position of the elements of a vector, and their count in n
+static size_t fb_vector(const fb_t *m, size_t t, int i, size_t elem, size_t *n) {
+    size_t v = fb_table(m, t, i);
+    *n = v ? get32(m->data + v) : 0;
+    if (!v || *n > (m->size - v - 4)/elem) {
+        *n = 0;
+        return 0;
+    }
+    return v + 4;
+}
+
+typedef struct {
+    int kind;
+    int width, is_signed;       // of values, or of the indexes of dictionary strings
+    int offsets;                // width of the offsets of strings
+    int dictionary;
+    double seconds, units;      // units of times in seconds
+    const unsigned char *values, *data;
+    const unsigned char *valid;  // the validity bitmap of times with nulls
+    long long data_size;
+} column_t;
+
+typedef struct {
+    long long id, n;
+    int offsets;
+    long long *words;
+} dictionary_t;
+
+static long long get_int(const unsigned char *p, int width, int is_signed) {
+    switch (width) {
+        case 1: return is_signed ? (long long) (int8_t) *p : *p;
+        case 2: return is_signed ? (long long) (int16_t) get16(p) : get16(p);
+        case 4: return is_signed ? (long long) (int32_t) get32(p) : get32(p);
+        default: return get64(p);
+    }
+}
+
+// read the next message into the reader's buffers; type 0 is the end
+static int read_message(arrow_reader_t *r, fb_t *m, int *type, size_t *header, long long *body) {
+    uint32_t length;
+    *type = 0;
+    if (fread(&length, 4, 1, r->file) != 1) return ferror(r->file) ? ODB_EIO : ODB_OK;
+    if (length != 0xFFFFFFFF) return ODB_EARROW;
+    if (fread(&length, 4, 1, r->file) != 1) return ferror(r->file) ? ODB_EIO : ODB_ETRUNC;
+    if (!length) return ODB_OK;
+    if (length > r->metadata_size) {
+        unsigned char *metadata = realloc(r->metadata, length);
+        if (!metadata) return ODB_ENOMEM;
+        r->metadata = metadata;
+        r->metadata_size = length;
+    }
+    if (fread(r->metadata, 1, length, r->file) != length)
+        return ferror(r->file) ? ODB_EIO : ODB_ETRUNC;
+    m->data = r->metadata;
+    m->size = length;
+    size_t t = length >= 4 ? get32(m->data) : 0;
+    if (!t || t + 4 > length || fb_int(m, t, 0, 2, 0) < V4) return ODB_EARROW;
+    *type = fb_int(m, t, 1, 1, 0);
+    *header = fb_table(m, t, 2);
+    *body = fb_int(m, t, 3, 8, 0);
+    if (!*type || !*header || *body < 0) return ODB_EARROW;
+    if (*body > r->body_size) {
+        unsigned char *data = realloc(r->body, *body);
+        if (!data) return ODB_ENOMEM;
+        r->body = data;
+        r->body_size = *body;
+    }
+    if (fread(r->body, 1, *body, r->file) != *body)
+        return ferror(r->file) ? ODB_EIO : ODB_ETRUNC;
+    return ODB_OK;
+}
+
+int arrow_reader_init(arrow_reader_t *r, FILE *file, arrow_intern_t intern, void *ctx) {
+    memset(r, 0, sizeof(*r));
+    r->file = file;
+    r->intern = intern;
+    r->ctx = ctx;
+
+    fb_t m;
+    int type;
+    size_t t, n;
+    long long body;
+    int e = read_message(r, &m, &type, &t, &body);
+    if (!e && type != M_SCHEMA) e = type ? ODB_EARROW : ODB_ETRUNC;
+    if (e) goto fail;
+    size_t fields = fb_vector(&m, t, 1, 4, &n);
+    e = ODB_EARROW;
+    if (!n) goto fail;
+    e = ODB_EUNSUPPORTED;
+    if (fb_int(&m, t, 0, 2, 0)) goto fail;
+
+    e = ODB_ENOMEM;
+    r->header.field_count = n;
+    r->header.field_specs = calloc(n, sizeof(odb_field_spec_t));
+    r->columns = calloc(n, sizeof(column_t));
+    r->dictionaries = calloc(n, sizeof(dictionary_t));
+    if (!r->header.field_specs || !r->columns || !r->dictionaries) goto fail;
+    for (size_t i = 0; i < n; i++) {
+        odb_field_spec_t *spec = r->header.field_specs + i;
+        column_t *c = (column_t*) r->columns + i;
+        size_t f = fb_deref(&m, fields + 4*i), len, children;
+        size_t name = fb_vector(&m, f, 0, 1, &len);
+        size_t type = fb_table(&m, f, 3), d = fb_table(&m, f, 4);
+        e = ODB_EARROW;
+        if (!f || !type) goto fail;
+        memcpy(spec->name, m.data + name, MIN(len, ODB_NAME_SIZE - 1));
+        e = ODB_EUNSUPPORTED;
+        fb_vector(&m, f, 5, 4, &children);
+        if (children) goto fail;
+        c->kind = fb_int(&m, f, 2, 1, 0);
+        c->dictionary = -1;
+        c->is_signed = 1;
+        switch (c->kind) {
+            case T_INT:
+                spec->type = ODB_INTEGER;
+                c->width = fb_int(&m, type, 0, 4, 0)/8;
+                c->is_signed = fb_int(&m, type, 1, 1, 0);
+                break;
+            case T_FLOAT: {
+                int precision = fb_int(&m, type, 0, 2, 0);
+                if (precision != 1 && precision != DOUBLE) goto fail;
+                spec->type = ODB_FLOAT;
+                c->width = precision == DOUBLE ? 8 : 4;
+                break;
+            }
+            case T_UTF8:
+            case T_LARGE_UTF8:
+                spec->type = ODB_STRING;
+                c->offsets = c->kind == T_UTF8 ? 4 : 8;
+                break;
+            case T_DATE: {
+                int unit = fb_int(&m, type, 0, 2, 1);
+                spec->type = ODB_DATE;
+                c->width = unit == DAY ? 4 : 8;
+                c->seconds = unit == DAY ? 86400 : 1;
+                c->units = unit == DAY ? 1 : 1e3;
+                break;
+            }
+            case T_TIMESTAMP: {
+                int unit = fb_int(&m, type, 0, 2, 0);
+                spec->type = ODB_TIMESTAMP;
+                c->width = 8;
+                c->seconds = 1;
+                c->units = pow(1e3, unit);
+                break;
+            }
+            default:
+                goto fail;
+        }
+        if (d) {
+            if (spec->type != ODB_STRING) goto fail;
+            size_t it = fb_table(&m, d, 1);
+            c->width = it ? fb_int(&m, it, 0, 4, 0)/8 : 4;
+            c->is_signed = it ? fb_int(&m, it, 1, 1, 0) : 1;
+            long long id = fb_int(&m, d, 0, 8, 0);
+            dictionary_t *dictionaries = r->dictionaries;
+            for (c->dictionary = 0; c->dictionary < r->dictionary_count; c->dictionary++)
+                if (dictionaries[c->dictionary].id == id) break;
+            if (c->dictionary == r->dictionary_count) {
+                dictionaries[r->dictionary_count].id = id;
+                dictionaries[r->dictionary_count++].offsets = c->offsets;
+            }
+            if (dictionaries[c->dictionary].offsets != c->offsets) goto fail;
+        }
+        if (c->width != 1 && c->width != 2 && c->width != 4 && c->width != 8 && !(c->offsets && !d))
+            goto fail;
+    }
+    return ODB_OK;
+fail:
+    arrow_reader_free(r);
+    return e;
+}
+
+void arrow_reader_free(arrow_reader_t *r) {
+    dictionary_t *dictionaries = r->dictionaries;
+    for (int i = 0; i < r->dictionary_count; i++) free(dictionaries[i].words);
+    free(r->dictionaries);
+    free(r->columns);
+    free(r->metadata);
+    free(r->body);
+    odb_free_header(&r->header);
+    r->dictionaries = r->columns = NULL;
+    r->metadata = r->body = NULL;
+}
+
+// the i-th buffer of a record batch if it holds at least min bytes
+static const unsigned char *body_buffer(arrow_reader_t *r, const fb_t *m, size_t buffers, size_t n,
+                                        size_t i, long long body, long long min, long long *size) {
+    if (i >= n) return NULL;
+    long long offset = get64(m->data + buffers + 16*i), length = get64(m->data + buffers + 16*i + 8);
+    if (offset < 0 || length < min || offset > body || length > body - offset) return NULL;
+    if (size) *size = length;
+    return r->body + offset;
+}
+
+static long long string_offset(const column_t *c, long long i) {
+    return get_int(c->values + i*c->offsets, c->offsets, 1);
+}
+
+static int read_dictionary(arrow_reader_t *r, const fb_t *m, size_t t, long long body) {
+    long long id = fb_int(m, t, 0, 8, 0);
+    size_t batch = fb_table(m, t, 1), nodes, buffers, nn, nb;
+    dictionary_t *d = r->dictionaries;
+    int i;
+    for (i = 0; i < r->dictionary_count && d[i].id != id; i++);
+    if (i == r->dictionary_count || !batch) return ODB_EARROW;
+    d += i;
+    if (fb_field(m, batch, 3, 4)) return ODB_EUNSUPPORTED;
+    nodes = fb_vector(m, batch, 1, 16, &nn);
+    buffers = fb_vector(m, batch, 2, 16, &nb);
+    if (!nn) return ODB_EARROW;
+    long long n = get64(m->data + nodes);
+    if (get64(m->data + nodes + 8)) return ODB_EUNSUPPORTED;
+    column_t c = { .offsets = d->offsets };
+    if (n < 0 || n > body || !(c.values = body_buffer(r, m, buffers, nb, 1, body, (n + 1)*c.offsets, NULL)) ||
+        !(c.data = body_buffer(r, m, buffers, nb, 2, body, 0, &c.data_size)))
+        return ODB_EARROW;
+
+    if (!fb_int(m, t, 2, 1, 0)) d->n = 0;
+    long long *words = realloc(d->words, (d->n + n)*sizeof(long long));
+    if (!words && n) return ODB_ENOMEM;
+    d->words = words;
+    for (long long j = 0; j < n; j++) {
+        long long from = string_offset(&c, j), to = string_offset(&c, j + 1);
+        if (from < 0 || from > to || to > c.data_size) return ODB_EARROW;
+        d->words[d->n++] = r->intern(r->ctx, (const char*) c.data + from, to - from);
+    }
+    return ODB_OK;
+}
+
+static int read_records(arrow_reader_t *r, const fb_t *m, size_t t, long long body) {
+    size_t nodes, buffers, nn, nb;
+    if (fb_field(m, t, 3, 4)) return ODB_EUNSUPPORTED;
+    long long rows = fb_int(m, t, 0, 8, 0);
+    nodes = fb_vector(m, t, 1, 16, &nn);
+    buffers = fb_vector(m, t, 2, 16, &nb);
+    if (rows < 0 || rows > body || nn < r->header.field_count) return ODB_EARROW;
+    size_t k = 0;
+    for (long long f = 0; f < r->header.field_count; f++) {
+        column_t *c = (column_t*) r->columns + f;
+        if (get64(m->data + nodes + 16*f) != rows) return ODB_EARROW;
+        // null times are read as NaN, like the writer writes them
+        c->valid = NULL;
+        if (get64(m->data + nodes + 16*f + 8)) {
+            if (c->kind != T_DATE && c->kind != T_TIMESTAMP) return ODB_EUNSUPPORTED;
+            if (!(c->valid = body_buffer(r, m, buffers, nb, k, body, (rows + 7)/8, NULL))) return ODB_EARROW;
+        }
+        k++;
+        if (c->offsets && c->dictionary < 0) {
+            c->values = body_buffer(r, m, buffers, nb, k++, body, (rows + 1)*c->offsets, NULL);
+            c->data = body_buffer(r, m, buffers, nb, k++, body, 0, &c->data_size);
+        } else {
+            c->values = body_buffer(r, m, buffers, nb, k++, body, rows*c->width, NULL);
+            c->data = c->values;
+        }
+        if (!c->values || !c->data) return ODB_EARROW;
+    }
+    r->rows = rows;
+    r->pos = 0;
+    return ODB_OK;
+}
+
+int arrow_read_batch(arrow_reader_t *r, long long *records, size_t max, size_t *n) {
+    *n = 0;
+    while (r->pos == r->rows) {
+        fb_t m;
+        int type;
+        size_t t;
+        long long body;
+        int e = read_message(r, &m, &type, &t, &body);
+        if (e || !type) return e;
+        e = type == M_DICTIONARY ? read_dictionary(r, &m, t, body) :
+            type == M_RECORDS    ? read_records(r, &m, t, body) : ODB_EARROW;
+        if (e) return e;
+    }
+
+    long long fc = r->header.field_count;
+    size_t rows = MIN(max, r->rows - r->pos);
+    for (size_t i0 = 0; i0 < rows; i0 += ARROW_BLOCK) {
+        size_t b = MIN(ARROW_BLOCK, rows - i0);
+        long long row = r->pos + i0, *block = records + i0*fc;
+        for (long long f = 0; f < fc; f++) {
+            column_t *c = (column_t*) r->columns + f;
+            const unsigned char *p = c->values + row*c->width;
+            switch (c->kind) {
+                case T_INT:
+                    for (size_t i = 0; i < b; i++, p += c->width)
+                        block[i*fc + f] = get_int(p, c->width, c->is_signed);
+                    break;
+                case T_FLOAT:
+                    for (size_t i = 0; i < b; i++, p += c->width) {
+                        float single;
+                        double v;
+                        if (c->width == 4) memcpy(&single, p, 4), v = single;
+                        else memcpy(&v, p, 8);
+                        block[i*fc + f] = reinterpret(long long, v);
+                    }
+                    break;
+                case T_DATE:
+                case T_TIMESTAMP:
+                    for (size_t i = 0; i < b; i++, p += c->width) {
+                        double v = get_int(p, c->width, 1)*c->seconds/c->units;
+                        if (c->valid && !(c->valid[(row + i) >> 3] >> ((row + i) & 7) & 1)) v = NAN;
+                        block[i*fc + f] = reinterpret(long long, v);
+                    }
+                    break;
+                default:
+                    if (c->dictionary >= 0) {
+                        dictionary_t *d = (dictionary_t*) r->dictionaries + c->dictionary;
+                        for (size_t i = 0; i < b; i++, p += c->width) {
+                            long long x = get_int(p, c->width, c->is_signed);
+                            if (x < 0 || x >= d->n) return ODB_EARROW;
+                            block[i*fc + f] = d->words[x];
+                        }
+                    } else {
+                        for (size_t i = 0; i < b; i++) {
+                            long long from = string_offset(c, row + i), to = string_offset(c, row + i + 1);
+                            if (from < 0 || from > to || to > c->data_size) return ODB_EARROW;
+                            block[i*fc + f] = r->intern(r->ctx, (const char*) c->data + from, to - from);
+                        }
+                    }
+            }
+        }
+    }
+    r->pos += rows;
+    *n = rows;
+    return ODB_OK;
+}
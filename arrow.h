@@ -0,0 +1,48 @@
+#ifndef ARROW_H
+#define ARROW_H
+
+#include "libodb.h"
+
+// Apache Arrow IPC streams of records: a column per field, strings as
+// indexes into a dictionary holding the strings.idx they refer to (one per
+// distinct dictionary of the fields), and timestamps and dates as arrow
+// temporal types
+
+#define ARROW_BATCH 65536
+
+typedef struct {
+    FILE *file;
+    odb_header_t header;
+    const odb_strings_t *const *strings;
+    int *ids, *large;
+    long long *records;
+    size_t n;
+    unsigned char *body;
+} arrow_writer_t;
+
+// strings holds the dictionary of each string field, and is only needed if
+// h has string fields
+int arrow_writer_init(arrow_writer_t *w, FILE *file, const odb_header_t *h, const odb_strings_t *const *strings);
+int arrow_write_batch(arrow_writer_t *w, const long long *records, size_t n);
+int arrow_writer_finish(arrow_writer_t *w);
+
+// string values are turned into the words of string fields by intern
+typedef long long (*arrow_intern_t)(void *ctx, const char *str, size_t len);
+
+typedef struct {
+    FILE *file;
+    odb_header_t header;
+    arrow_intern_t intern;
+    void *ctx;
+    void *columns, *dictionaries;
+    int dictionary_count;
+    unsigned char *metadata, *body;
+    size_t metadata_size, body_size;
+    long long rows, pos;
+} arrow_reader_t;
+
+int arrow_reader_init(arrow_reader_t *r, FILE *file, arrow_intern_t intern, void *ctx);
+int arrow_read_batch(arrow_reader_t *r, long long *records, size_t max, size_t *n);
+void arrow_reader_free(arrow_reader_t *r);
+
+#endif
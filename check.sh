@@ -0,0 +1,103 @@
+#!/bin/sh
+# round trips a small fixture through each codec and compares what comes back;
+# run by make check, or as ODB=<binary> sh check.sh
+set -e
+ODB=${ODB:-$(pwd)/odb}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir"
+
+failed=0
+check() {
+    if cmp -s "$2" "$3"; then
+        echo "ok   $1"
+    else
+        echo "FAIL $1"
+        diff "$2" "$3" || true
+        failed=1
+    fi
+}
+
+# gzip members with the extra field bgzip adds, one per line of the input
+bgzf() {
+    split -l 1 "$1" block.
+    for b in block.*; do
+        gzip -nc "$b" | tail -c +11 > "$b.z"
+        n=$(($(wc -c < "$b.z") + 17))
+        printf '\037\213\010\004\000\000\000\000\000\377\006\000BC\002\000'
+        printf "\\$(printf %o $((n & 255)))\\$(printf %o $((n >> 8)))"
+        cat "$b.z"
+        rm "$b" "$b.z"
+    done
+}
+
+F=-fa:string,b:string,x:int,z:float,t:timestamp,d:date
+printf 'foo\tbar baz\t1\t2.500000\t2020-01-02 03:04:05\t2020-01-02\n' > data.tsv
+printf 'three\tabacus\t-7\t-0.250000\t1999-12-31 23:59:59\t1999-12-31\n' >> data.tsv
+printf 'foo\tqux\t42\t1000000.000000\t1970-01-01 00:00:00\t1970-01-01\n' >> data.tsv
+printf 'plain,"with, comma",1\n"say ""hi""","two\nlines",2\nfoo,x,3\n' > data.csv
+C=-fa:string,b:string,x:int
+
+{ $ODB encode $F data.tsv -x -0; $ODB encode -C $C data.csv -x -0; } | $ODB strings -0
+$ODB encode $F data.tsv > data
+$ODB encode -C $C data.csv > csv
+
+$ODB decode data > out.tsv
+check tsv data.tsv out.tsv
+
+$ODB decode -C csv > out.csv
+check csv data.csv out.csv
+
+gzip -c data.tsv > data.tsv.gz
+$ODB encode $F data.tsv.gz | $ODB decode > out.tsv
+check gzip data.tsv out.tsv
+
+bgzf data.tsv > data.tsv.bgz
+$ODB encode -j 2 $F data.tsv.bgz | $ODB decode > out.tsv
+check bgzf data.tsv out.tsv
+
+$ODB encode -2 $F data.tsv > v2
+$ODB decode v2 > out.tsv
+check v2 data.tsv out.tsv
+$ODB sort -q -2 v2 -f x
+sort -t "$(printf '\t')" -k 3n data.tsv > sorted.tsv
+$ODB decode v2 > out.tsv
+check "v2 sort" sorted.tsv out.tsv
+$ODB sort -q v2 -f x
+$ODB decode v2 > out.tsv
+check "v2 sorted again" sorted.tsv out.tsv
+
+$ODB decode -A data > data.arrow
+$ODB encode -A data.arrow | $ODB decode > out.tsv
+check arrow data.tsv out.tsv
+
+# times that can't be written are arrow nulls, which come back as NaN
+printf 'nan\n1.500000\ninf\n' > times.tsv
+printf 'nan\n1.500000\nnan\n' > nulls.tsv
+$ODB encode -fa:timestamp -T times.tsv | $ODB decode -A -T > times.arrow
+$ODB encode -A times.arrow | $ODB decode -T > out.tsv
+check "arrow nulls" nulls.tsv out.tsv
+
+# the rows of the binary copy: field counts, then each value's length and
+# big-endian bytes, with times counted from 2000-01-01 and NaN as NULL
+$ODB encode -fa:string,x:int,z:float,t:timestamp,d:date -T -D > pg <<EOF
+foo	1	-0.250000	946684801.000000	946771200.000000
+qux	-2	2.500000	nan	nan
+EOF
+$ODB decode -P t -B pg | sed '1,/^copy/d' | od -An -tx1 -v | xargs > out.hex
+cat > pg.hex <<EOF
+50 47 43 4f 50 59 0a ff 0d 0a 00 00 00 00 00 00 00 00 00 00 05 00 00 00 03 66 6f 6f 00 00 00 08 00 00 00 00 00 00 00 01 00 00 00 08 bf d0 00 00 00 00 00 00 00 00 00 08 00 00 00 00 00 0f 42 40 00 00 00 04 00 00 00 01 00 05 00 00 00 03 71 75 78 00 00 00 08 ff ff ff ff ff ff ff fe 00 00 00 08 40 04 00 00 00 00 00 00 ff ff ff ff ff ff ff ff ff ff
+EOF
+check pgcopy pg.hex out.hex
+
+# compacting keeps just the strings data uses, and the file names the new
+# dictionary in its header
+$ODB strings -s strings.idx --compact=small.idx data > /dev/null
+$ODB decode data > out.tsv
+check "strings compact" data.tsv out.tsv
+test "$(wc -c < small.idx)" -lt "$(wc -c < strings.idx)" || { echo "FAIL strings compact size"; failed=1; }
+mv strings.idx old.idx
+$ODB decode data > out.tsv
+check "strings compact without old" data.tsv out.tsv
+
+exit $failed
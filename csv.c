@@ -0,0 +1,190 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __PCLMUL__
+#include <wmmintrin.h>
+#endif
+
+#include "csv.h"
+
+#define CSV_READ (1 << 20)
+#define CSV_BLOCK 64
+
+typedef struct {
+    unsigned long long quote, delim, newline;
+} masks_t;
+
+static void scan_block(const unsigned char *p, char delim, masks_t *m) {
+    m->quote = m->delim = m->newline = 0;
+#ifdef __SSE2__
+    __m128i q = _mm_set1_epi8('"'), d = _mm_set1_epi8(delim), nl = _mm_set1_epi8('\n');
+    for (int i = 0; i < CSV_BLOCK; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (p + i));
+        m->quote |= (unsigned long long) (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(v, q)) << i;
+        m->delim |= (unsigned long long) (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(v, d)) << i;
+        m->newline |= (unsigned long long) (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)) << i;
+    }
+#else
+    for (int i = 0; i < CSV_BLOCK; i++) {
+        m->quote |= (unsigned long long) (p[i] == '"') << i;
+        m->delim |= (unsigned long long) (p[i] == delim) << i;
+        m->newline |= (unsigned long long) (p[i] == '\n') << i;
+    }
+#endif
+}
+
+// bit i is the xor of bits 0 to i: set from an opening quote up to the
+// closing one, which the pair of an escaped quote closes and reopens
+static unsigned long long prefix_xor(unsigned long long x) {
+#ifdef __PCLMUL__
+    __m128i v = _mm_clmulepi64_si128(_mm_set_epi64x(0, x), _mm_set1_epi8(-1), 0);
+    return _mm_cvtsi128_si64(v);
+#else
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+#endif
+}
+
+void csv_reader_free(csv_reader_t *r) {
+    free(r->buf);
+    free(r->fields);
+    free(r->lens);
+    memset(r, 0, sizeof(*r));
+}
+
+int csv_reader_init(csv_reader_t *r, FILE *file, char delim) {
+    memset(r, 0, sizeof(*r));
+    r->file = file;
+    r->delim = delim;
+    r->size = CSV_READ + CSV_BLOCK;
+    r->allocated = 16;
+    r->buf = calloc(r->size, 1);
+    r->fields = malloc(r->allocated*sizeof(char*));
+    r->lens = malloc(r->allocated*sizeof(size_t));
+    if (!r->buf || !r->fields || !r->lens) {
+        csv_reader_free(r);
+        return ODB_ENOMEM;
+    }
+    return ODB_OK;
+}
+
+// the record being read moves to the front of the buffer, growing it if it
+// fills half, and more is read after it; the bytes past the end are kept
+// zero, so the last block can be scanned whole
+static int refill(csv_reader_t *r) {
+    memmove(r->buf, r->buf + r->start, r->end - r->start);
+    for (size_t i = 0; i < r->n; i++) r->lens[i] -= r->start;
+    r->end -= r->start;
+    r->block -= r->start;
+    r->start = 0;
+    if (r->size - r->end < CSV_READ/2 + CSV_BLOCK) {
+        unsigned char *buf = realloc(r->buf, 2*r->size);
+        if (!buf) return ODB_ENOMEM;
+        r->buf = buf;
+        r->size *= 2;
+    }
+    r->end += fread(r->buf + r->end, 1, r->size - r->end - CSV_BLOCK, r->file);
+    if (ferror(r->file)) return ODB_EIO;
+    r->eof = feof(r->file);
+    memset(r->buf + r->end, 0, CSV_BLOCK);
+    return ODB_OK;
+}
+
+// until the record is complete, lens holds the offset where each field ends
+static int add_field(csv_reader_t *r, size_t end) {
+    if (r->n == r->allocated) {
+        r->allocated *= 2;
+        char **fields = realloc(r->fields, r->allocated*sizeof(char*));
+        if (fields) r->fields = fields;
+        size_t *lens = realloc(r->lens, r->allocated*sizeof(size_t));
+        if (lens) r->lens = lens;
+        if (!fields || !lens) return ODB_ENOMEM;
+    }
+    r->lens[r->n++] = end;
+    return ODB_OK;
+}
+
+// unquote the fields in place; quotes are only allowed around whole fields
+static int finish_record(csv_reader_t *r) {
+    size_t begin = r->start;
+    for (size_t i = 0; i < r->n; i++) {
+        unsigned char *p = r->buf + begin, *q = r->buf + r->lens[i];
+        begin = r->lens[i] + 1;
+        if (i == r->n - 1 && q > p && q[-1] == '\r') q--;
+        r->fields[i] = (char*) p;
+        if (p < q && *p == '"') {
+            if (q - p < 2 || q[-1] != '"') return ODB_ECSV;
+            unsigned char *w = p;
+            for (unsigned char *s = p + 1; s < q - 1; s++) {
+                if (*s == '"' && *++s != '"') return ODB_ECSV;
+                *w++ = *s;
+            }
+            q = w;
+        } else if (memchr(p, '"', q - p)) {
+            return ODB_ECSV;
+        }
+        *q = '\0';
+        r->lens[i] = q - p;
+    }
+    return ODB_OK;
+}
+
+// structural bits are the delimiters and newlines outside quotes, of the
+// block before r->block, and are taken one at a time
+int csv_read_record(csv_reader_t *r) {
+    int e;
+    r->n = 0;
+    for (;;) {
+        while (!r->bits) {
+            if (r->block >= r->end || (r->block + CSV_BLOCK > r->end && !r->eof)) {
+                if (!r->eof) {
+                    if (e = refill(r)) return e;
+                    continue;
+                }
+                // the last record may lack its line end
+                if (r->quoted) return ODB_ECSV;
+                if (r->start == r->end) return ODB_OK;
+                if (e = add_field(r, r->end)) return e;
+                e = finish_record(r);
+                r->start = r->end;
+                return e;
+            }
+            masks_t m;
+            scan_block(r->buf + r->block, r->delim, &m);
+            unsigned long long inside = prefix_xor(m.quote) ^ -r->quoted;
+            r->quoted = inside >> 63;
+            r->bits = (m.delim | m.newline) & ~inside;
+            r->block += CSV_BLOCK;
+        }
+        size_t pos = r->block - CSV_BLOCK + __builtin_ctzll(r->bits);
+        r->bits &= r->bits - 1;
+        if (e = add_field(r, pos)) return e;
+        if (r->buf[pos] == '\n') {
+            e = finish_record(r);
+            r->start = pos + 1;
+            return e;
+        }
+    }
+}
+
+size_t csv_write_field(FILE *file, const char *str, size_t len, char delim) {
+    const char special[] = {'"', delim, '\n', '\r', '\0'};
+    if (strcspn(str, special) >= len) return fwrite(str, 1, len, file);
+    size_t bytes = 2;
+    putc('"', file);
+    for (const char *end = str + len, *q; str < end; str = q + 1) {
+        if (!(q = memchr(str, '"', end - str))) q = end;
+        bytes += fwrite(str, 1, q - str, file);
+        if (q < end) bytes += fwrite("\"\"", 1, 2, file);
+    }
+    putc('"', file);
+    return bytes;
+}
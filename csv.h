@@ -0,0 +1,38 @@
+#ifndef CSV_H
+#define CSV_H
+
+#include <stdio.h>
+
+#include "libodb.h"
+
+// RFC 4180 text: records end at line ends (\n or \r\n) and fields at a
+// delimiter, except within double quotes, where "" stands for a quote.
+// Input is scanned 64 bytes at a time into bitmasks of its quotes,
+// delimiters and newlines; the bytes within quotes are a prefix xor of the
+// quotes, so which delimiters and newlines count is found without a branch
+// per byte, and quoted line ends and escaped quotes need no special cases
+
+typedef struct {
+    FILE *file;
+    char delim;
+    unsigned char *buf;
+    size_t size, start, end, block;
+    unsigned long long bits, quoted;
+    int eof;
+    // the fields of the last record read
+    char **fields;
+    size_t *lens, n, allocated;
+} csv_reader_t;
+
+int csv_reader_init(csv_reader_t *r, FILE *file, char delim);
+// reads the next record into fields and lens, unquoted and ended by NULs and
+// valid until the next call; n is 0 at the end of the input, and malformed
+// quoting is ODB_ECSV
+int csv_read_record(csv_reader_t *r);
+void csv_reader_free(csv_reader_t *r);
+
+// writes a field, quoted only if it holds a quote, the delimiter or a line
+// end; returns the bytes written
+size_t csv_write_field(FILE *file, const char *str, size_t len, char delim);
+
+#endif
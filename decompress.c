@@ -0,0 +1,321 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/param.h>
+#include <zlib.h>
+#ifdef ODB_ZSTD
+#include <zstd.h>
+#endif
+
+#include "decompress.h"
+
+#define INPUT_SIZE (1 << 17)
+#define BGZF_HEADER 18
+#define BGZF_BLOCK 65536
+
+typedef struct {
+    unsigned char *data;
+    size_t size, pos;
+    int ready;
+} chunk_t;
+
+// threads claim chunks in order and the reader takes them in the same order,
+// so chunk seq lives in chunks[seq % nchunks] until the reader is done with it
+typedef struct {
+    FILE *file;
+    int format, threads, nchunks;
+    unsigned char magic[BGZF_HEADER];
+    size_t magic_size, magic_pos;
+    chunk_t *chunks;
+    size_t chunk_size;
+    pthread_t *workers;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    long long filled, read;
+    int done, closing, error;
+} decompressor_t;
+
+// the magic bytes read to recognize the format come first
+static size_t input(decompressor_t *d, unsigned char *buf, size_t n) {
+    size_t m = MIN(n, d->magic_size - d->magic_pos);
+    memcpy(buf, d->magic + d->magic_pos, m);
+    d->magic_pos += m;
+    return m + fread(buf + m, 1, n - m, d->file);
+}
+
+static void fail(decompressor_t *d, int error) {
+    pthread_mutex_lock(&d->lock);
+    if (!d->error) d->error = error;
+    d->done = 1;
+    pthread_cond_broadcast(&d->cond);
+    pthread_mutex_unlock(&d->lock);
+}
+
+// wait for the next chunk to be free, with the lock held
+static chunk_t *claim(decompressor_t *d) {
+    while (!d->done && !d->closing && d->filled >= d->read + d->nchunks)
+        pthread_cond_wait(&d->cond, &d->lock);
+    if (d->done || d->closing) return NULL;
+    return &d->chunks[d->filled % d->nchunks];
+}
+
+static void publish(decompressor_t *d, chunk_t *c, size_t size, int done) {
+    pthread_mutex_lock(&d->lock);
+    c->size = size;
+    c->pos = 0;
+    c->ready = 1;
+    d->done |= done;
+    pthread_cond_broadcast(&d->cond);
+    pthread_mutex_unlock(&d->lock);
+}
+
+// bgzf blocks are complete gzip members of at most 64K either way, whose
+// header gives their compressed size, so threads take turns reading a block
+// and then inflate it alongside the others
+static int bgzf_header(const unsigned char *h) {
+    return h[0] == 0x1f && h[1] == 0x8b && h[2] == 8 && h[3] & 4 && h[10] == 6 && !h[11] &&
+           h[12] == 'B' && h[13] == 'C' && h[14] == 2 && !h[15];
+}
+
+static void *bgzf_worker(void *arg) {
+    decompressor_t *d = arg;
+    unsigned char *block = malloc(BGZF_BLOCK);
+    z_stream z = {0};
+    if (!block || inflateInit2(&z, 16 + MAX_WBITS) != Z_OK) {
+        fail(d, ENOMEM);
+        free(block);
+        return NULL;
+    }
+    for (;;) {
+        pthread_mutex_lock(&d->lock);
+        chunk_t *c = claim(d);
+        if (!c) {
+            pthread_mutex_unlock(&d->lock);
+            break;
+        }
+        size_t n = input(d, block, BGZF_HEADER), size = 0;
+        if (n == BGZF_HEADER && bgzf_header(block)) {
+            size = (block[16] | block[17] << 8) + 1;
+            n += input(d, block + n, size - n);
+        }
+        int error = ferror(d->file) ? EIO : n && n != size ? EBADMSG : 0;
+        if (!n || error) {
+            d->done = 1;
+            d->error = d->error ? d->error : error;
+            pthread_cond_broadcast(&d->cond);
+            pthread_mutex_unlock(&d->lock);
+            break;
+        }
+        d->filled++;
+        pthread_mutex_unlock(&d->lock);
+
+        inflateReset(&z);
+        z.next_in = block;
+        z.avail_in = size;
+        z.next_out = c->data;
+        z.avail_out = d->chunk_size;
+        if (inflate(&z, Z_FINISH) != Z_STREAM_END) {
+            fail(d, EBADMSG);
+            break;
+        }
+        publish(d, c, d->chunk_size - z.avail_out, 0);
+    }
+    inflateEnd(&z);
+    free(block);
+    return NULL;
+}
+
+// other formats are a single stream, decompressed by one thread a chunk at a
+// time; gzip members and zstd frames may follow each other
+static void *stream_worker(void *arg) {
+    decompressor_t *d = arg;
+    unsigned char *in = malloc(INPUT_SIZE);
+    size_t in_pos = 0, in_size = 0;
+    int end = 0, open = 0, finished = 0;
+    z_stream z = {0};
+#ifdef ODB_ZSTD
+    ZSTD_DStream *zs = NULL;
+    if (d->format == DECOMPRESS_ZSTD && (zs = ZSTD_createDStream())) ZSTD_initDStream(zs);
+    if (!in || (d->format == DECOMPRESS_ZSTD ? !zs : inflateInit2(&z, 16 + MAX_WBITS) != Z_OK)) {
+#else
+    if (!in || inflateInit2(&z, 16 + MAX_WBITS) != Z_OK) {
+#endif
+        fail(d, ENOMEM);
+        free(in);
+        return NULL;
+    }
+    while (!finished) {
+        pthread_mutex_lock(&d->lock);
+        chunk_t *c = claim(d);
+        if (c) d->filled++;
+        pthread_mutex_unlock(&d->lock);
+        if (!c) break;
+
+        size_t out = 0;
+        int error = 0;
+        while (out < d->chunk_size && !error) {
+            if (in_pos == in_size && !end) {
+                in_pos = 0;
+                in_size = input(d, in, INPUT_SIZE);
+                end = !in_size;
+                if (ferror(d->file)) error = EIO;
+            }
+            size_t consumed = in_pos, produced = out;
+#ifdef ODB_ZSTD
+            if (zs) {
+                ZSTD_inBuffer zin = {in, in_size, in_pos};
+                ZSTD_outBuffer zout = {c->data, d->chunk_size, out};
+                size_t r = ZSTD_decompressStream(zs, &zout, &zin);
+                if (ZSTD_isError(r)) error = EBADMSG;
+                in_pos = zin.pos;
+                out = zout.pos;
+                if (in_pos != consumed || out != produced) open = r != 0;
+            } else
+#endif
+            {
+                z.next_in = in + in_pos;
+                z.avail_in = in_size - in_pos;
+                z.next_out = c->data + out;
+                z.avail_out = d->chunk_size - out;
+                int r = inflate(&z, Z_NO_FLUSH);
+                in_pos = in_size - z.avail_in;
+                out = d->chunk_size - z.avail_out;
+                if (r == Z_STREAM_END) inflateReset(&z);
+                else if (r != Z_OK && r != Z_BUF_ERROR) error = EBADMSG;
+                if (in_pos != consumed || out != produced) open = r != Z_STREAM_END;
+            }
+            // a stream cut short leaves a member or frame open
+            if (end && in_pos == in_size && out == produced) {
+                if (open) error = EBADMSG;
+                finished = 1;
+                break;
+            }
+        }
+        if (error) {
+            fail(d, error);
+            break;
+        }
+        publish(d, c, out, finished);
+    }
+#ifdef ODB_ZSTD
+    if (zs) ZSTD_freeDStream(zs);
+    else
+#endif
+    inflateEnd(&z);
+    free(in);
+    return NULL;
+}
+
+static ssize_t read_chunks(void *cookie, char *buf, size_t size) {
+    decompressor_t *d = cookie;
+    chunk_t *c;
+    pthread_mutex_lock(&d->lock);
+    for (;;) {
+        c = &d->chunks[d->read % d->nchunks];
+        if (c->ready && c->pos < c->size) break;
+        if (c->ready) {
+            c->ready = 0;
+            d->read++;
+            pthread_cond_broadcast(&d->cond);
+        } else if (d->error) {
+            errno = d->error;
+            pthread_mutex_unlock(&d->lock);
+            return -1;
+        } else if (d->done && d->read == d->filled) {
+            pthread_mutex_unlock(&d->lock);
+            return 0;
+        } else {
+            pthread_cond_wait(&d->cond, &d->lock);
+        }
+    }
+    pthread_mutex_unlock(&d->lock);
+    size_t n = MIN(size, c->size - c->pos);
+    memcpy(buf, c->data + c->pos, n);
+    c->pos += n;
+    return n;
+}
+
+static void free_decompressor(decompressor_t *d) {
+    for (int i = 0; i < d->nchunks; i++) free(d->chunks[i].data);
+    free(d->chunks);
+    free(d->workers);
+    pthread_mutex_destroy(&d->lock);
+    pthread_cond_destroy(&d->cond);
+    free(d);
+}
+
+static void stop(decompressor_t *d) {
+    pthread_mutex_lock(&d->lock);
+    d->closing = 1;
+    pthread_cond_broadcast(&d->cond);
+    pthread_mutex_unlock(&d->lock);
+    for (int i = 0; i < d->threads; i++) pthread_join(d->workers[i], NULL);
+}
+
+static int close_chunks(void *cookie) {
+    decompressor_t *d = cookie;
+    stop(d);
+    int e = fclose(d->file);
+    free_decompressor(d);
+    return e;
+}
+
+int decompress_open(FILE **file, int threads, int *format) {
+    unsigned char magic[BGZF_HEADER];
+    size_t n = 0;
+    int c = getc(*file);
+    *format = DECOMPRESS_NONE;
+    if (c == EOF) return ferror(*file) ? ODB_EIO : ODB_OK;
+    magic[n++] = c;
+    if (c == 0x1f || c == 0x28) n += fread(magic + n, 1, BGZF_HEADER - n, *file);
+    if (ferror(*file)) return ODB_EIO;
+
+    if (n >= 4 && !memcmp(magic, "\x28\xb5\x2f\xfd", 4)) *format = DECOMPRESS_ZSTD;
+    else if (n == BGZF_HEADER && bgzf_header(magic)) *format = DECOMPRESS_BGZF;
+    else if (n >= 3 && !memcmp(magic, "\x1f\x8b\x08", 3)) *format = DECOMPRESS_GZIP;
+    else {
+        // glibc allows pushing back more than one byte
+        while (n) ungetc(magic[--n], *file);
+        return ODB_OK;
+    }
+#ifndef ODB_ZSTD
+    if (*format == DECOMPRESS_ZSTD) return ODB_EUNSUPPORTED;
+#endif
+
+    decompressor_t *d = calloc(1, sizeof(decompressor_t));
+    if (!d) return ODB_ENOMEM;
+    d->file = *file;
+    d->format = *format;
+    memcpy(d->magic, magic, n);
+    d->magic_size = n;
+    d->threads = *format == DECOMPRESS_BGZF ? MAX(1, threads) : 1;
+    d->nchunks = 4*d->threads;
+    d->chunk_size = *format == DECOMPRESS_BGZF ? BGZF_BLOCK : DECOMPRESS_CHUNK;
+    pthread_mutex_init(&d->lock, NULL);
+    pthread_cond_init(&d->cond, NULL);
+    d->chunks = calloc(d->nchunks, sizeof(chunk_t));
+    d->workers = calloc(d->threads, sizeof(pthread_t));
+    for (int i = 0; d->chunks && i < d->nchunks; i++)
+        if (!(d->chunks[i].data = malloc(d->chunk_size))) d->nchunks = i;
+    if (!d->chunks || !d->workers || d->nchunks < 4*d->threads) {
+        free_decompressor(d);
+        return ODB_ENOMEM;
+    }
+
+    int started = 0;
+    void *(*worker)(void*) = *format == DECOMPRESS_BGZF ? bgzf_worker : stream_worker;
+    for (; started < d->threads; started++)
+        if (pthread_create(&d->workers[started], NULL, worker, d)) break;
+    d->threads = started;
+    cookie_io_functions_t io = {read_chunks, NULL, NULL, close_chunks};
+    FILE *out = started ? fopencookie(d, "r", io) : NULL;
+    if (!out) {
+        stop(d);
+        free_decompressor(d);
+        return ODB_ENOMEM;
+    }
+    *file = out;
+    return ODB_OK;
+}
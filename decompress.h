@@ -0,0 +1,23 @@
+#ifndef DECOMPRESS_H
+#define DECOMPRESS_H
+
+#include <stdio.h>
+
+#include "libodb.h"
+
+// gzip and zstd inputs, recognized by their magic bytes and decompressed by
+// threads running ahead of the reader; zstd needs building with ZSTD=1
+
+// uncompressed chunks handed from the threads to the reader
+#define DECOMPRESS_CHUNK (1 << 20)
+
+enum {DECOMPRESS_NONE, DECOMPRESS_GZIP, DECOMPRESS_BGZF, DECOMPRESS_ZSTD};
+
+// replaces *file with a stream of its decompressed contents if it is
+// compressed, and leaves it alone otherwise; closing the stream closes the
+// original file, and corrupt input makes reads fail with EBADMSG. bgzf files
+// (gzip made of independent blocks, as written by bgzip) are decompressed by
+// up to threads threads, other formats by one
+int decompress_open(FILE **file, int threads, int *format);
+
+#endif
@@ -0,0 +1,1704 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <math.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+// external dependencies:
+#include <cmph.h>
+
+// internal headers:
+#include "smoothsort.h"
+#include "sketch.h"
+#include "readahead.h"
+#include "libodb.h"
+
+#define reinterpret(type,value) *((type*)&value)
+#define dbl(v) reinterpret(double,v)
+
+const char *odb_strerror(int err) {
+    switch (err) {
+        case ODB_OK:        return "success";
+        case ODB_EIO:       return strerror(errno);
+        case ODB_ENOMEM:    return "out of memory";
+        case ODB_EFORMAT:   return "invalid odb file";
+        case ODB_ETRUNC:    return "unexpected eof";
+        case ODB_EMISMATCH: return "field spec mismatch";
+        case ODB_EFIELD:    return "invalid field";
+        case ODB_ESTREAM:   return "operation not supported on streamed input";
+        case ODB_EDUP:      return "strings not unique";
+        case ODB_EEMPTY:    return "no strings provided";
+        case ODB_EHASH:     return "error generating hash";
+        case ODB_ESTALE:    return "index is out of date";
+        case ODB_EARROW:    return "invalid arrow stream";
+        case ODB_EUNSUPPORTED: return "unsupported arrow type or feature";
+        case ODB_ECSV:      return "invalid CSV quoting";
+    }
+    return "unknown error";
+}
+
+static const char *const typestrs[] = {
+    "int",
+    "float",
+    "string",
+    "timestamp",
+    "date"
+};
+
+const char *odb_type_name(odb_type_t t) {
+    if (t < 0 || ODB_TYPES <= t) return "<unknown>";
+    return typestrs[t];
+}
+
+int odb_type_from_name(const char *name) {
+    for (odb_type_t t = 0; t < ODB_TYPES; t++)
+        if (!strcmp(typestrs[t], name)) return t;
+    return -1;
+}
+
+typedef struct {
+    char magic[4];
+    unsigned long long bom;
+} __attribute__ ((__packed__)) preamble_t;
+
+static const preamble_t preamble = {"odb", 0x0123456789abcdef};
+static const preamble_t preamble2 = {"odb\2", 0x0123456789abcdef};
+
+// a version 2 header is the preamble, the field count, the record count,
+// the footer offset and the field specs, zero padded to ODB_ALIGN
+#define RECORDS_OFFSET (sizeof(preamble_t) + sizeof(long long))
+
+static int short_read(FILE *file) {
+    return ferror(file) ? ODB_EIO : ODB_ETRUNC;
+}
+
+int odb_read_header(FILE *file, odb_header_t *h) {
+    preamble_t p;
+    h->field_specs = NULL;
+    h->version = 1;
+    h->records = -1;
+    h->footer = 0;
+    if (fread(&p, sizeof(p), 1, file) != 1) return short_read(file);
+    if (!memcmp(&p, &preamble2, sizeof(p))) h->version = 2;
+    else if (memcmp(&p, &preamble, sizeof(p))) return ODB_EFORMAT;
+    if (fread(&h->field_count, sizeof(h->field_count), 1, file) != 1) return short_read(file);
+    if (h->field_count <= 0 || h->field_count > INT_MAX) return ODB_EFORMAT;
+    if (h->version == 2 &&
+        (fread(&h->records, sizeof(h->records), 1, file) != 1 ||
+         fread(&h->footer, sizeof(h->footer), 1, file) != 1))
+        return short_read(file);
+    if (h->footer < 0 || h->footer && h->records < 0) return ODB_EFORMAT;
+    h->field_specs = malloc(h->field_count*sizeof(odb_field_spec_t));
+    if (!h->field_specs) return ODB_ENOMEM;
+    if (fread(h->field_specs, sizeof(odb_field_spec_t), h->field_count, file) != h->field_count) {
+        odb_free_header(h);
+        return short_read(file);
+    }
+    // the footer starts right after the records
+    if (h->footer && h->footer != odb_header_size(h) + h->records*odb_record_size(h)) {
+        odb_free_header(h);
+        return ODB_EFORMAT;
+    }
+    // read rather than seek past the padding, so streams work too
+    char pad[ODB_ALIGN];
+    size_t n = odb_header_size(h) - RECORDS_OFFSET - sizeof(odb_field_spec_t)*h->field_count;
+    if (h->version == 2 && (n -= 2*sizeof(long long)) && fread(pad, n, 1, file) != 1) {
+        odb_free_header(h);
+        return short_read(file);
+    }
+    return ODB_OK;
+}
+
+int odb_write_header(FILE *file, const odb_header_t *h) {
+    static const char pad[ODB_ALIGN];
+    int v2 = h->version == 2;
+    if (fwrite(v2 ? &preamble2 : &preamble, sizeof(preamble_t), 1, file) != 1 ||
+        fwrite(&h->field_count, sizeof(h->field_count), 1, file) != 1 ||
+        v2 && fwrite(&h->records, sizeof(h->records), 1, file) != 1 ||
+        v2 && fwrite(&h->footer, sizeof(h->footer), 1, file) != 1 ||
+        fwrite(h->field_specs, sizeof(odb_field_spec_t), h->field_count, file) != h->field_count)
+        return ODB_EIO;
+    size_t n = odb_header_size(h) - RECORDS_OFFSET - sizeof(odb_field_spec_t)*h->field_count;
+    if (v2 && (n -= 2*sizeof(long long)) && fwrite(pad, n, 1, file) != 1) return ODB_EIO;
+    return ODB_OK;
+}
+
+void odb_free_header(odb_header_t *h) {
+    free(h->field_specs);
+    h->field_specs = NULL;
+}
+
+int odb_header_equal(const odb_header_t *a, const odb_header_t *b) {
+    return a->field_count == b->field_count &&
+        !memcmp(a->field_specs, b->field_specs, a->field_count*sizeof(odb_field_spec_t));
+}
+
+size_t odb_header_size(const odb_header_t *h) {
+    size_t size = sizeof(preamble_t) +
+                  sizeof(h->field_count) +
+                  sizeof(odb_field_spec_t) * h->field_count;
+    if (h->version != 2) return size;
+    size += 2*sizeof(long long);
+    return (size + ODB_ALIGN - 1)/ODB_ALIGN*ODB_ALIGN;
+}
+
+size_t odb_record_size(const odb_header_t *h) {
+    return h->field_count*sizeof(long long);
+}
+
+int odb_field_index(const odb_header_t *h, const char *name) {
+    for (int i = 0; i < h->field_count; i++)
+        if (!strcmp(name, h->field_specs[i].name)) return i;
+    return -1;
+}
+
+// the dictionary a string field names, or NULL if it uses the default one
+const char *odb_field_dictionary(const odb_field_spec_t *f) {
+    size_t len = strnlen(f->name, ODB_NAME_SIZE);
+    if (f->type != ODB_STRING || len + 2 >= ODB_NAME_SIZE || !f->name[len + 1]) return NULL;
+    if (!memchr(f->name + len + 1, 0, ODB_NAME_SIZE - len - 1)) return NULL;
+    return f->name + len + 1;
+}
+
+int odb_field_set_dictionary(odb_field_spec_t *f, const char *path) {
+    size_t len = strnlen(f->name, ODB_NAME_SIZE), n = path ? strlen(path) : 0;
+    if (len + n + 2 > ODB_NAME_SIZE) return ODB_EFIELD;
+    memset(f->name + len + 1, 0, ODB_NAME_SIZE - len - 1);
+    if (n) memcpy(f->name + len + 1, path, n);
+    return ODB_OK;
+}
+
+int odb_string_fields(const odb_header_t *h) {
+    int n = 0;
+    for (int i = 0; i < h->field_count; i++)
+        if (h->field_specs[i].type == ODB_STRING) n++;
+    return n;
+}
+
+int odb_reader_init(odb_reader_t *r, FILE *file) {
+    bzero(r, sizeof(*r));
+    r->file = file;
+    int e = odb_read_header(file, &r->header);
+    if (e) return e;
+    r->record_size = odb_record_size(&r->header);
+    r->data_offset = ftello(file);
+    r->seekable = r->data_offset != -1 && !fseeko(file, 0, SEEK_CUR);
+    return ODB_OK;
+}
+
+// read the remaining records from memory, e.g. a stream sorted in a buffer
+void odb_reader_set_buffer(odb_reader_t *r, long long *records, size_t n) {
+    r->buffer = records;
+    r->order = NULL;
+    r->buffer_records = n;
+    r->buffer_pos = 0;
+}
+
+int odb_open(odb_reader_t *r, const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) return ODB_EIO;
+    if (flock(fileno(file), LOCK_SH) && errno != ENOTSUP) {
+        fclose(file);
+        return ODB_EIO;
+    }
+    int e = odb_reader_init(r, file);
+    if (e) fclose(file);
+    return e;
+}
+
+static int merge_batch(odb_reader_t *r, long long *records, size_t max, size_t *n);
+
+int odb_read_batch(odb_reader_t *r, long long *records, size_t max, size_t *n) {
+    if (r->runs) return merge_batch(r, records, max, n);
+    if (r->buffer) {
+        *n = MIN(max, r->buffer_records - r->buffer_pos);
+        if (r->order) {
+            long long fc = r->header.field_count;
+            for (size_t i = 0; i < *n; i++)
+                memcpy(records + i*fc, r->buffer + r->order[r->buffer_pos + i]*fc, r->record_size);
+        } else {
+            memcpy(records, r->buffer + r->buffer_pos*r->header.field_count, *n*r->record_size);
+        }
+        r->buffer_pos += *n;
+        r->records += *n;
+        return ODB_OK;
+    }
+    if (r->ahead) {
+        ssize_t got = readahead_read(r->ahead, records, max*r->record_size);
+        if (got < 0) return ODB_EIO;
+        *n = got/r->record_size;
+        r->records += *n;
+        return got % r->record_size ? ODB_ETRUNC : ODB_OK;
+    }
+    // the records of a file with a footer end where the footer starts
+    if (r->header.footer) {
+        long long pos = r->records;
+        if (r->seekable) pos = (ftello(r->file) - r->data_offset)/(off_t) r->record_size;
+        if (r->header.records - pos < (long long) max) max = MAX(r->header.records - pos, 0);
+    }
+    size_t words = fread(records, sizeof(long long), max*r->header.field_count, r->file);
+    *n = words/r->header.field_count;
+    r->records += *n;
+    if (words < max*r->header.field_count) {
+        if (ferror(r->file)) return ODB_EIO;
+        if (words % r->header.field_count) return ODB_ETRUNC;
+    }
+    return ODB_OK;
+}
+
+// skip n records forward, or backward on seekable inputs
+int odb_skip(odb_reader_t *r, off_t n) {
+    if (r->buffer) {
+        if (n < 0 && -n > r->buffer_pos) n = -r->buffer_pos;
+        if (n > 0 && n > r->buffer_records - r->buffer_pos) n = r->buffer_records - r->buffer_pos;
+        r->buffer_pos += n;
+        r->records += n;
+        return ODB_OK;
+    }
+    if (r->ahead) {
+        if (readahead_seek(r->ahead, readahead_tell(r->ahead) + n*(off_t) r->record_size)) return ODB_EIO;
+        r->records += n;
+        return ODB_OK;
+    }
+    if (r->seekable) {
+        if (fseeko(r->file, n*r->record_size, SEEK_CUR)) return ODB_EIO;
+        r->records += n;
+        return ODB_OK;
+    }
+    if (n < 0) return ODB_ESTREAM;
+    long long buffer[1024];
+    size_t batch = sizeof(buffer)/r->record_size;
+    if (!batch) batch = 1;
+    long long *records = batch == 1 ? malloc(r->record_size) : buffer;
+    if (!records) return ODB_ENOMEM;
+    int e = ODB_OK;
+    while (n > 0) {
+        size_t got;
+        if ((e = odb_read_batch(r, records, n < batch ? n : batch, &got)) || !got) break;
+        n -= got;
+    }
+    if (records != buffer) free(records);
+    return e;
+}
+
+// read the records with the given sorted indexes, one pread per run of
+// adjacent indexes; the stream position is left alone
+int odb_read_at(odb_reader_t *r, const off_t *ids, size_t n, long long *records) {
+    for (size_t i = 0, j; i < n; i = j) {
+        for (j = i + 1; j < n && ids[j] == ids[j-1] + 1; j++);
+        char *p = (char*) (records + i*r->header.field_count);
+        size_t size = (j - i)*r->record_size;
+        if (r->buffer) {
+            if (ids[i] < 0 || ids[j-1] >= r->buffer_records) return ODB_ETRUNC;
+            if (r->order) {
+                long long fc = r->header.field_count;
+                for (size_t k = i; k < j; k++)
+                    memcpy(records + k*fc, r->buffer + r->order[ids[k]]*fc, r->record_size);
+            } else {
+                memcpy(p, r->buffer + ids[i]*r->header.field_count, size);
+            }
+            continue;
+        }
+        if (!r->seekable) return ODB_ESTREAM;
+        off_t offset = r->data_offset + ids[i]*r->record_size;
+        while (size) {
+            ssize_t got = pread(fileno(r->file), p, size, offset);
+            if (got < 0) return ODB_EIO;
+            if (!got) return ODB_ETRUNC;
+            p += got;
+            offset += got;
+            size -= got;
+        }
+    }
+    return ODB_OK;
+}
+
+// number of records in a seekable input or one with a stored count, or -1
+long long odb_record_count(odb_reader_t *r) {
+    struct stat fs;
+    if (r->buffer) return r->buffer_records;
+    if (r->header.footer) return r->header.records;
+    if (!r->seekable || fstat(fileno(r->file), &fs)) return -1;
+    return (fs.st_size - r->data_offset)/r->record_size;
+}
+
+static void merge_free(odb_reader_t *r);
+
+// readahead buffers take up to this much memory across the inputs read at once
+#define READAHEAD_MEMORY (64 << 20)
+
+int odb_reader_readahead(odb_reader_t *r, int inputs, int flags) {
+    struct stat fs;
+    if (!r->seekable || r->buffer || r->runs || r->ahead) return ODB_OK;
+    off_t pos = ftello(r->file);
+    if (pos < 0 || fstat(fileno(r->file), &fs)) return ODB_EIO;
+    // double buffering for many inputs, more reads in flight for few
+    int depth = inputs > 4 ? 2 : 4;
+    size_t size = READAHEAD_MEMORY/depth/MAX(inputs, 1);
+    size = MAX(64 << 10, MIN(size, 1 << 20));
+    r->ahead = readahead_open(fileno(r->file), pos, r->header.footer ? r->header.footer : fs.st_size,
+                              size, depth, flags & ODB_READAHEAD_DIRECT);
+    return r->ahead ? ODB_OK : ODB_ENOMEM;
+}
+
+int odb_reader_readahead_stop(odb_reader_t *r) {
+    if (!r->ahead) return ODB_OK;
+    off_t pos = readahead_tell(r->ahead);
+    readahead_close(r->ahead);
+    r->ahead = NULL;
+    return fseeko(r->file, pos, SEEK_SET) ? ODB_EIO : ODB_OK;
+}
+
+int odb_close(odb_reader_t *r) {
+    if (r->ahead) odb_reader_readahead_stop(r);
+    if (r->runs) merge_free(r);
+    odb_free_header(&r->header);
+    int e = fclose(r->file) ? ODB_EIO : ODB_OK;
+    r->file = NULL;
+    return e;
+}
+
+int odb_writer_init(odb_writer_t *w, FILE *file, const odb_header_t *h) {
+    odb_header_t v = *h;
+    v.records = -1;
+    v.footer = 0;
+    w->file = file;
+    w->field_count = h->field_count;
+    w->records = 0;
+    w->version = h->version;
+    w->start = ftello(file);
+    return odb_write_header(file, &v);
+}
+
+int odb_write_batch(odb_writer_t *w, const long long *records, size_t n) {
+    if (fwrite(records, sizeof(long long)*w->field_count, n, w->file) != n)
+        return ODB_EIO;
+    w->records += n;
+    return ODB_OK;
+}
+
+// write sections and the end tag at offset at of fd, which ends after them
+static int write_footer(int fd, off_t at, const odb_section_t *sections, int n) {
+    static const char pad[8];
+    for (int i = 0; i <= n; i++) {
+        odb_section_t end = {ODB_FOOTER_END, 0, NULL};
+        const odb_section_t *s = i < n ? &sections[i] : &end;
+        long long head[2] = {s->tag, s->size};
+        size_t padding = -s->size & 7;
+        if (pwrite(fd, head, sizeof(head), at) != sizeof(head) ||
+            s->size && pwrite(fd, s->data, s->size, at + sizeof(head)) != s->size ||
+            padding && pwrite(fd, pad, padding, at + sizeof(head) + s->size) != padding)
+            return ODB_EIO;
+        at += sizeof(head) + s->size + padding;
+    }
+    return ftruncate(fd, at) ? ODB_EIO : ODB_OK;
+}
+
+// append the footer and fill in the record count and footer offset
+int odb_writer_finish(odb_writer_t *w, const odb_section_t *sections, int n) {
+    int fd = fileno(w->file);
+    if (w->version != 2 || w->start < 0 || fcntl(fd, F_GETFL) & O_APPEND) return ODB_OK;
+    if (fflush(w->file)) return ODB_EIO;
+    long long counts[2] = {w->records, ftello(w->file)};
+    if (counts[1] < 0) return ODB_EIO;
+    int e = write_footer(fd, counts[1], sections, n);
+    if (e) return e;
+    if (pwrite(fd, counts, sizeof(counts), w->start + RECORDS_OFFSET) != sizeof(counts) ||
+        fseeko(w->file, 0, SEEK_END))
+        return ODB_EIO;
+    return ODB_OK;
+}
+
+int odb_read_footer(odb_reader_t *r, long long tag, void **data, size_t *size) {
+    struct stat fs;
+    *data = NULL;
+    *size = 0;
+    if (!r->header.footer) return ODB_OK;
+    if (!r->seekable) return ODB_ESTREAM;
+    int fd = fileno(r->file);
+    if (fstat(fd, &fs)) return ODB_EIO;
+    for (off_t at = r->header.footer;;) {
+        long long head[2];
+        ssize_t got = pread(fd, head, sizeof(head), at);
+        if (got < 0) return ODB_EIO;
+        if (got != sizeof(head)) return ODB_ETRUNC;
+        if (head[0] == ODB_FOOTER_END) return ODB_OK;
+        at += sizeof(head);
+        if (head[1] < 0 || head[1] > fs.st_size - at) return ODB_EFORMAT;
+        if (head[0] == tag) {
+            if (!(*data = malloc(head[1] + 1))) return ODB_ENOMEM;
+            if (pread(fd, *data, head[1], at) == head[1]) {
+                *size = head[1];
+                return ODB_OK;
+            }
+            free(*data);
+            *data = NULL;
+            return ODB_EIO;
+        }
+        at += head[1] + (-head[1] & 7);
+    }
+}
+
+// front coded dictionaries end with one of these instead of their count
+#define STRINGS_FRONT -2
+#define STRINGS_PARTS -3
+
+static unsigned long long get_varint(const unsigned char **p) {
+    unsigned long long v = 0;
+    for (int shift = 0;; shift += 7) {
+        unsigned char b = *(*p)++;
+        v |= (unsigned long long) (b & 127) << shift;
+        if (b < 128) return v;
+    }
+}
+
+static size_t put_varint(unsigned char *p, unsigned long long v) {
+    size_t n = 0;
+    for (; v >= 128; v >>= 7) p[n++] = v & 127 | 128;
+    p[n++] = v;
+    return n;
+}
+
+typedef struct {
+    unsigned long long id;
+    long long index;
+    const unsigned char *next;
+    char *buf;
+    size_t size;
+} front_t;
+
+// strings are decoded from the start of their block, or onwards from the one
+// decoded before if it is earlier in the same block
+static const char *front_decode(front_t *f, const char *data, const off_t *blocks, int block,
+                                size_t maxlen, long long index) {
+    if (f->size <= maxlen) {
+        char *buf = realloc(f->buf, maxlen + 1);
+        if (!buf) return NULL;
+        f->buf = buf;
+        f->size = maxlen + 1;
+    }
+    if (f->index < 0 || f->index > index || f->index/block != index/block) {
+        f->next = (const unsigned char*) data + blocks[index/block];
+        f->index = index - index%block - 1;
+    }
+    while (f->index < index) {
+        size_t shared = ++f->index % block ? get_varint(&f->next) : 0;
+        size_t len = get_varint(&f->next);
+        if (shared + len > maxlen) {
+            f->index = -1;
+            return NULL;
+        }
+        memcpy(f->buf + shared, f->next, len);
+        f->buf[shared + len] = '\0';
+        f->next += len;
+    }
+    return f->buf;
+}
+
+static __thread front_t front_cache = {0, -1};
+static unsigned long long strings_opened = 0;
+
+static unsigned long long unpack(const unsigned char *packed, int bits, long long i) {
+    unsigned long long bit = i*bits, word;
+    memcpy(&word, packed + bit/8, sizeof(word));
+    return word >> bit%8 & (bits < 64 ? (1ULL << bits) - 1 : ~0ULL);
+}
+
+// the partition of the hash holding a string; this is part of the format
+static int string_part(const char *str, size_t len, int parts) {
+    unsigned long long h = len*0x9e3779b97f4a7c15ULL, w;
+    for (; len >= 8; str += 8, len -= 8) {
+        memcpy(&w, str, 8);
+        h = (h ^ w)*0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+    }
+    w = 0;
+    memcpy(&w, str, len);
+    h = (h ^ w)*0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 29;
+    return (unsigned __int128) h*parts >> 64;
+}
+
+int odb_strings_open(odb_strings_t *s, const char *path) {
+    struct stat fs;
+    bzero(s, sizeof(*s));
+    FILE *strings = fopen(path, "r");
+    if (!strings) return ODB_EIO;
+    if (fstat(fileno(strings), &fs)) goto io_error;
+    if (fs.st_size < 6*sizeof(off_t)) {
+        fclose(strings);
+        return ODB_EFORMAT;
+    }
+    char *data = mmap(
+        NULL,
+        fs.st_size,
+        PROT_READ,
+        MAP_PRIVATE,
+        fileno(strings),
+        0
+    );
+    if (data == MAP_FAILED) goto io_error;
+    s->map = data;
+    s->map_size = fs.st_size;
+    off_t *offsets = (off_t*) data;
+    off_t i = fs.st_size/sizeof(off_t);
+    int parted = offsets[i-1] == STRINGS_PARTS;
+    s->parts = 1;
+    if (offsets[i-1] == STRINGS_FRONT || parted) {
+        if (i < 9 + parted) goto format_error;
+        if (offsets[--i] == STRINGS_PARTS) s->parts = offsets[--i];
+        s->count = offsets[--i];
+        s->block = offsets[--i];
+        s->bits = offsets[--i];
+        s->data = data + offsets[--i];
+        s->blocks = (off_t*)(data + offsets[--i]);
+        s->packed = (unsigned char*)(data + offsets[--i]);
+        if (s->block < 1 || s->bits < 1 || s->bits > 57) goto format_error;
+        if (s->parts < 1 || s->parts > s->count) goto format_error;
+        s->id = __sync_add_and_fetch(&strings_opened, 1);
+    } else {
+        s->count = offsets[--i];
+        s->data = data + offsets[--i];
+        s->offsets = (off_t*)(data + offsets[--i]);
+        s->reverse = (off_t*)(data + offsets[--i]);
+    }
+    if (!(s->hash = calloc(s->parts, sizeof(void*)))) {
+        fclose(strings);
+        odb_strings_close(s);
+        return ODB_ENOMEM;
+    }
+    // partitioned hashes start with the first hash of each partition, then
+    // where each is dumped; empty partitions have none
+    off_t table = offsets[--i];
+    const off_t *dumps = &table;
+    if (parted) {
+        if (table < 0 || table + (2*s->parts + 1)*sizeof(off_t) > fs.st_size) goto format_error;
+        s->bases = (off_t*)(data + table);
+        dumps = s->bases + s->parts + 1;
+    }
+    for (int p = 0; p < s->parts; p++) {
+        if (s->bases && s->bases[p] == s->bases[p+1]) continue;
+        if (fseeko(strings, dumps[p], SEEK_SET)) goto io_error;
+        if (!(s->hash[p] = cmph_load(strings))) goto format_error;
+    }
+    s->maxlen = offsets[--i];
+    fclose(strings);
+    return ODB_OK;
+format_error:
+    fclose(strings);
+    odb_strings_close(s);
+    return ODB_EFORMAT;
+io_error:
+    fclose(strings);
+    odb_strings_close(s);
+    return ODB_EIO;
+}
+
+void odb_strings_close(odb_strings_t *s) {
+    for (int p = 0; s->hash && p < s->parts; p++)
+        if (s->hash[p]) cmph_destroy(s->hash[p]);
+    free(s->hash);
+    if (s->map) munmap(s->map, s->map_size);
+    bzero(s, sizeof(*s));
+}
+
+// index of str in the dictionary, or -1 if it is not there
+long long odb_string_to_index(const odb_strings_t *s, const char *str, size_t len) {
+    long long index;
+    odb_strings_lookup(s, &str, &len, 1, &index);
+    return index;
+}
+
+// strings are looked up in groups, each step done for the whole group before
+// the next, with the memory the next reads prefetched
+#define LOOKUP_GROUP 32
+
+void odb_strings_lookup(const odb_strings_t *s, const char *const *strs, const size_t *lens,
+                        size_t n, long long *indexes) {
+    for (size_t at = 0; at < n; at += LOOKUP_GROUP) {
+        const char *const *str = strs + at;
+        const size_t *len = lens + at;
+        long long *index = indexes + at;
+        size_t m = MIN(LOOKUP_GROUP, n - at);
+
+        // hash each string, and find its entry of the reverse map
+        for (size_t i = 0; i < m; i++) {
+            int p = s->parts > 1 ? string_part(str[i], len[i], s->parts) : 0;
+            off_t base = s->bases ? s->bases[p] : 0, size = s->bases ? s->bases[p+1] - base : s->count;
+            index[i] = -1;
+            if (!s->hash[p]) continue;
+            cmph_uint32 h = cmph_search(s->hash[p], str[i], len[i]);
+            if (h >= size) continue;
+            index[i] = base + h;
+            if (s->packed) __builtin_prefetch(s->packed + index[i]*s->bits/8);
+            else __builtin_prefetch(&s->reverse[index[i]]);
+        }
+
+        // then the index it holds, and where that string is stored
+        for (size_t i = 0; i < m; i++) {
+            if (index[i] < 0) continue;
+            index[i] = s->packed ? unpack(s->packed, s->bits, index[i]) : s->reverse[index[i]];
+            if (!(0 <= index[i] && index[i] < s->count)) index[i] = -1;
+            else if (s->blocks) __builtin_prefetch(&s->blocks[index[i]/s->block]);
+            else __builtin_prefetch(&s->offsets[index[i]]);
+        }
+        for (size_t i = 0; i < m; i++) {
+            if (index[i] < 0) continue;
+            off_t offset = s->blocks ? s->blocks[index[i]/s->block] : s->offsets[index[i]];
+            __builtin_prefetch(s->data + offset);
+        }
+
+        // and compare it with the string looked up
+        for (size_t i = 0; i < m; i++) {
+            if (index[i] < 0) continue;
+            const char *candidate = odb_index_to_string(s, index[i]);
+            if (!candidate || strncmp(str[i], candidate, len[i]) || candidate[len[i]]) index[i] = -1;
+        }
+    }
+}
+
+const char *odb_index_to_string(const odb_strings_t *s, long long index) {
+    if (!(0 <= index && index < s->count)) return NULL;
+    if (s->blocks) {
+        if (front_cache.id != s->id) {
+            front_cache.id = s->id;
+            front_cache.index = -1;
+        }
+        return front_decode(&front_cache, s->data, s->blocks, s->block, s->maxlen, index);
+    }
+    const char *str = s->data + s->offsets[index];
+    if (index && str[-1]) return NULL;
+    return str;
+}
+
+// the strings of one partition of the hash, in order, with their indexes
+typedef struct {
+    char *data;
+    size_t size, used, at;
+    cmph_uint32 *lens;
+    off_t *index;
+    off_t n, allocated, next;
+    cmph_t *hash;
+} part_t;
+
+static int key_read(void *state, char **key, cmph_uint32 *len) {
+    part_t *p = (part_t*) state;
+    *key = p->data + p->at;
+    *len = p->lens[p->next++];
+    p->at += *len;
+    return *len;
+}
+static void key_rewind(void *state) {
+    part_t *p = (part_t*) state;
+    p->next = 0;
+    p->at = 0;
+}
+// keys point into the partition, so there is nothing to free
+static void key_dispose(void *state, char *key, cmph_uint32 len) {
+}
+
+static int part_add(part_t *p, const char *str, size_t len, off_t index) {
+    if (p->used + len >= p->size) {
+        p->size = MAX(2*p->size, p->used + len + 4096);
+        char *data = realloc(p->data, p->size);
+        if (!data) return ODB_ENOMEM;
+        p->data = data;
+    }
+    if (p->n == p->allocated) {
+        p->allocated = MAX(2*p->allocated, 1024);
+        cmph_uint32 *lens = realloc(p->lens, p->allocated*sizeof(cmph_uint32));
+        if (lens) p->lens = lens;
+        off_t *indexes = realloc(p->index, p->allocated*sizeof(off_t));
+        if (indexes) p->index = indexes;
+        if (!lens || !indexes) return ODB_ENOMEM;
+    }
+    memcpy(p->data + p->used, str, len);
+    p->used += len;
+    p->lens[p->n] = len;
+    p->index[p->n++] = index;
+    return ODB_OK;
+}
+
+static void part_free(part_t *p) {
+    free(p->data);
+    free(p->lens);
+    free(p->index);
+    p->data = NULL;
+    p->lens = NULL;
+    p->index = NULL;
+}
+
+typedef struct {
+    part_t *parts;
+    const off_t *bases;
+    unsigned long long *packed;
+    int n, next, bits, error;
+} build_t;
+
+// threads take whole partitions, hashing them and setting their entries of
+// the reverse map, whose words may be shared with the neighbouring ones
+static void *build_parts(void *arg) {
+    build_t *b = arg;
+    for (int i; (i = __sync_fetch_and_add(&b->next, 1)) < b->n;) {
+        part_t *p = &b->parts[i];
+        if (!p->n) continue;
+        cmph_io_adapter_t adapter;
+        adapter.data = (void*) p;
+        adapter.nkeys = p->n;
+        adapter.read = key_read;
+        adapter.rewind = key_rewind;
+        adapter.dispose = key_dispose;
+        // CHD picks its seeds at random, so a failure needn't repeat
+        for (int tries = 0; !p->hash && tries < 3; tries++) {
+            key_rewind(p);
+            cmph_config_t *config = cmph_config_new(&adapter);
+            cmph_config_set_algo(config, CMPH_CHD);
+            p->hash = cmph_new(config);
+            cmph_config_destroy(config);
+        }
+        off_t k = 0;
+        for (size_t at = 0; p->hash && k < p->n; at += p->lens[k++]) {
+            cmph_uint32 h = cmph_search(p->hash, p->data + at, p->lens[k]);
+            if (h >= p->n) break;
+            unsigned long long bit = (b->bases[i] + h)*(unsigned long long) b->bits;
+            unsigned long long *word = &b->packed[bit/64], index = p->index[k];
+            __atomic_fetch_or(word, index << bit%64, __ATOMIC_RELAXED);
+            if (bit%64 + b->bits > 64) __atomic_fetch_or(word + 1, index >> (64 - bit%64), __ATOMIC_RELAXED);
+        }
+        int built = p->hash && k == p->n;
+        part_free(p);
+        if (!built) {
+            __atomic_store_n(&b->error, ODB_EHASH, __ATOMIC_RELAXED);
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+// the calling thread builds partitions too
+static int build_hashes(build_t *b, int threads) {
+    pthread_t workers[threads];
+    int started = 0;
+    while (started < threads - 1 && !pthread_create(&workers[started], NULL, build_parts, b)) started++;
+    build_parts(b);
+    for (int i = 0; i < started; i++) pthread_join(workers[i], NULL);
+    return b->error;
+}
+
+static int ff_align(FILE *file, size_t unit) {
+    return fseeko(file, unit*(ftello(file)/unit+1), SEEK_SET) ? ODB_EIO : ODB_OK;
+}
+
+int odb_strings_writer_init(odb_strings_writer_t *w, FILE *file) {
+    bzero(w, sizeof(*w));
+    w->file = file;
+    w->threads = 1;
+    w->allocated = 4096;
+    if ((w->pos = ftello(file)) < 0) return ODB_EIO;
+    w->offsets = malloc(w->allocated*sizeof(off_t));
+    return w->offsets ? ODB_OK : ODB_ENOMEM;
+}
+
+// strings are front coded into buf, written out when it fills up
+#define STRINGS_BUFFER (1 << 20)
+
+static int flush_strings(odb_strings_writer_t *w) {
+    if (w->used && fwrite(w->buf, 1, w->used, w->file) != w->used) return ODB_EIO;
+    w->pos += w->used;
+    w->used = 0;
+    return ODB_OK;
+}
+
+// offsets holds the offset of each block
+int odb_strings_add(odb_strings_writer_t *w, const char *str, size_t len) {
+    if (w->n && w->last_len == len && !memcmp(w->last, str, len)) return ODB_EDUP;
+    // decoded strings end at their first NUL
+    if (memchr(str, '\0', len)) return ODB_EFIELD;
+    size_t shared = 0, need = len + 20;
+    int e;
+    if (w->used + need > w->size) {
+        if (e = flush_strings(w)) return e;
+        if (need > w->size) {
+            w->size = MAX(need, STRINGS_BUFFER);
+            free(w->buf);
+            if (!(w->buf = malloc(w->size))) return ODB_ENOMEM;
+        }
+    }
+    if (w->n % ODB_STRINGS_BLOCK) {
+        while (shared < len && shared < w->last_len && str[shared] == w->last[shared]) shared++;
+        w->used += put_varint(w->buf + w->used, shared);
+    } else {
+        if (w->allocated <= w->n/ODB_STRINGS_BLOCK) {
+            w->allocated *= 2;
+            w->offsets = realloc(w->offsets, w->allocated*sizeof(off_t));
+            if (!w->offsets) return ODB_ENOMEM;
+        }
+        w->offsets[w->n/ODB_STRINGS_BLOCK] = w->pos + w->used;
+    }
+    w->used += put_varint(w->buf + w->used, len - shared);
+    memcpy(w->buf + w->used, str + shared, len - shared);
+    w->used += len - shared;
+    if (w->last_size <= len) {
+        w->last_size = 2*len+1;
+        w->last = realloc(w->last, w->last_size);
+        if (!w->last) return ODB_ENOMEM;
+    }
+    memcpy(w->last, str, len);
+    w->last_len = len;
+    w->n++;
+    if (w->maxlen < len) w->maxlen = len;
+    return ODB_OK;
+}
+
+int odb_strings_finish(odb_strings_writer_t *w) {
+    off_t strings_off = 0, blocks_off, reverse_off, table_off;
+    FILE *strings = w->file;
+    off_t n = w->n, blocks = (n + ODB_STRINGS_BLOCK - 1)/ODB_STRINGS_BLOCK;
+    int parts = MAX(1, n/ODB_STRINGS_PARTITION);
+    unsigned char *packed = NULL;
+    part_t *part = NULL;
+    off_t *table = NULL;
+    front_t front = {0, -1};
+    int e = flush_strings(w);
+
+    free(w->last);
+    free(w->buf);
+    w->last = NULL;
+    w->buf = NULL;
+    if (e) return e;
+    if (!n) return ODB_EEMPTY;
+
+    // write out the table of block offsets
+    if (e = ff_align(strings, sizeof(off_t))) return e;
+    blocks_off = ftello(strings);
+    if (fwrite(w->offsets, sizeof(off_t), blocks, strings) != blocks) return ODB_EIO;
+
+    // mmap the written strings data for reading
+    if (fflush(strings)) return ODB_EIO;
+    size_t size = ftello(strings);
+    char *data = mmap(
+        NULL,
+        size,
+        PROT_READ,
+        MAP_PRIVATE,
+        fileno(strings),
+        0
+    );
+    if (data == MAP_FAILED) return ODB_EIO;
+
+    // split the strings between the partitions of the hash; the table holds
+    // the first hash of each partition, then the offset of each one's dump
+    e = ODB_ENOMEM;
+    part = calloc(parts, sizeof(part_t));
+    table = calloc(2*parts + 1, sizeof(off_t));
+    if (!part || !table) goto done;
+    for (off_t i = 0; i < n; i++) {
+        const char *str = front_decode(&front, data, (off_t*)(data + blocks_off), ODB_STRINGS_BLOCK, w->maxlen, i);
+        if (!str) {
+            e = ODB_EFORMAT;
+            goto done;
+        }
+        size_t len = strlen(str);
+        if (e = part_add(&part[parts > 1 ? string_part(str, len, parts) : 0], str, len, i)) goto done;
+    }
+    for (int p = 0; p < parts; p++) table[p+1] = table[p] + part[p].n;
+
+    // generate a minimal perfect hash for each partition, and the reverse
+    // map packing the index of each hash into bits bits
+    e = ODB_ENOMEM;
+    int bits = n > 1 ? 64 - __builtin_clzll(n - 1) : 1;
+    size_t packed_size = ((n*bits + 7)/8 + 15) & ~7;
+    if (!(packed = calloc(packed_size, 1))) goto done;
+    build_t build = {part, table, (unsigned long long*) packed, parts, 0, bits, ODB_OK};
+    if (e = build_hashes(&build, MAX(1, MIN(w->threads, parts)))) goto done;
+
+    // write out the reverse map
+    if (e = ff_align(strings, sizeof(off_t))) goto done;
+    reverse_off = ftello(strings);
+    e = ODB_EIO;
+    if (fwrite(packed, 1, packed_size, strings) != packed_size) goto done;
+
+    // write out the cmph structures and the table
+    for (int p = 0; p < parts; p++) {
+        if (!part[p].hash) continue;
+        if (e = ff_align(strings, sizeof(off_t))) goto done;
+        table[parts + 1 + p] = ftello(strings);
+        cmph_dump(part[p].hash, strings);
+    }
+    if (e = ff_align(strings, sizeof(off_t))) goto done;
+    table_off = ftello(strings);
+    e = ODB_EIO;
+    if (fwrite(table, sizeof(off_t), 2*parts + 1, strings) != 2*parts + 1) goto done;
+
+    // write n and table of offsets
+    if (e = ff_align(strings, sizeof(off_t))) goto done;
+    e = ODB_EIO;
+    off_t trailer[] = {w->maxlen, table_off, reverse_off, blocks_off, strings_off,
+                       bits, ODB_STRINGS_BLOCK, n, parts, STRINGS_PARTS};
+    if (fwrite(trailer, sizeof(trailer), 1, strings) != 1) goto done;
+    e = ODB_OK;
+done:
+    for (int p = 0; part && p < parts; p++) {
+        if (part[p].hash) cmph_destroy(part[p].hash);
+        part_free(&part[p]);
+    }
+    munmap(data, size);
+    free(front.buf);
+    free(part);
+    free(table);
+    free(packed);
+    free(w->offsets);
+    w->offsets = NULL;
+    return e;
+}
+
+// NULL fields sorts by all fields in order; a leading - sorts descending
+int odb_sort_init(odb_sort_t *s, const odb_header_t *h, const char *fields) {
+    bzero(s, sizeof(*s));
+    s->field_count = h->field_count;
+    s->field_specs = h->field_specs;
+    if (!fields) {
+        s->n = h->field_count;
+        s->order = malloc(s->n*sizeof(int));
+        if (!s->order) return ODB_ENOMEM;
+        for (int i = 0; i < s->n; i++) s->order[i] = i+1;
+        return ODB_OK;
+    }
+    s->n = 1;
+    for (const char *p = fields; *p; p++) if (*p == ',') s->n++;
+    s->order = calloc(s->n, sizeof(int));
+    if (!s->order) return ODB_ENOMEM;
+    const char *p = fields;
+    for (int i = 0; i < s->n; i++) {
+        int sign = 1;
+        if (p[0] == '-') {
+            p++;
+            sign = -1;
+        } else if (p[0] == '+') {
+            p++;
+        }
+        size_t len = strcspn(p, ",");
+        for (int j = 0; j < h->field_count; j++)
+            if (!strncmp(p, h->field_specs[j].name, len) && !h->field_specs[j].name[len])
+                s->order[i] = sign*(j+1);
+        if (!s->order[i]) {
+            odb_sort_free(s);
+            return ODB_EFIELD;
+        }
+        p += len + 1;
+    }
+    return ODB_OK;
+}
+
+void odb_sort_free(odb_sort_t *s) {
+    free(s->order);
+    s->order = NULL;
+}
+
+int odb_record_lt(odb_sort_t *s, const long long *a, const long long *b) {
+    s->comparisons++;
+    for (int i = 0; i < s->n; i++) {
+        int j = s->order[i];
+        int r = j < 0;
+        j = abs(j)-1;
+        long long x = a[j], y = b[j];
+        if (x != y) {
+            if (!odb_floatlike(s->field_specs[j].type)) return r^(x < y);
+            if (isnan(dbl(x)) && isnan(dbl(y))) continue;
+            if (isnan(dbl(x))) return r^1;
+            if (isnan(dbl(y))) return r^0;
+            return r^(dbl(x) < dbl(y));
+        }
+    }
+    return 0;
+}
+
+#define record(j) (s->data + (j)*s->field_count)
+
+static int lt_records(void *d, size_t a, size_t b) {
+    odb_sort_t *s = (odb_sort_t*) d;
+    return odb_record_lt(s, record(a), record(b));
+}
+
+static void swap_records(void *d, size_t a, size_t b) {
+    odb_sort_t *s = (odb_sort_t*) d;
+    long long *x = record(a), *y = record(b);
+    s->swaps++;
+    for (int i = 0; i < s->field_count; i++) {
+        if (x[i] != y[i]) {
+            long long t = x[i];
+            x[i] = y[i];
+            y[i] = t;
+        }
+    }
+}
+
+void odb_sort_records(odb_sort_t *s, long long *records, size_t n) {
+    s->data = records;
+    su_smoothsort(s, 0, n, lt_records, swap_records);
+    s->data = NULL;
+}
+
+// fill in the version and counts of the header of a mapped odb file and
+// return its number of records, or -1 if it isn't one
+static off_t map_header(const char *mapped, off_t size, odb_header_t *h) {
+    h->version = memcmp(mapped, &preamble2, sizeof(preamble_t)) ? 1 : 2;
+    h->records = -1;
+    h->footer = 0;
+    if (h->version == 1 && memcmp(mapped, &preamble, sizeof(preamble_t))) return -1;
+    off_t h_size = odb_header_size(h);
+    if (size < h_size) return -1;
+    off_t n = (size - h_size)/odb_record_size(h);
+    if (h->version == 1) return n;
+    memcpy(&h->records, mapped + RECORDS_OFFSET, sizeof(h->records));
+    memcpy(&h->footer, mapped + RECORDS_OFFSET + sizeof(h->records), sizeof(h->footer));
+    if (!h->footer) return n;
+    return h->records > n || h->footer != h_size + h->records*odb_record_size(h) ? -1 : h->records;
+}
+
+// sort the records of the odb file open read-write on fd in place; files
+// with version 2 headers get a footer holding their new sort order, in
+// place of any old one
+int odb_sort_file(odb_sort_t *s, int fd) {
+    struct stat fs;
+    if (fstat(fd, &fs)) return ODB_EIO;
+    odb_header_t h = {s->field_count, s->field_specs};
+    if (fs.st_size < odb_header_size(&h)) return ODB_EFORMAT;
+    char *mapped = mmap(
+        NULL,
+        fs.st_size,
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED,
+        fd,
+        0
+    );
+    if (mapped == MAP_FAILED) return ODB_EIO;
+    off_t n = map_header(mapped, fs.st_size, &h);
+    if (n < 0) {
+        munmap(mapped, fs.st_size);
+        return ODB_EFORMAT;
+    }
+    size_t h_size = odb_header_size(&h);
+    odb_sort_records(s, (long long*)(mapped + h_size), n);
+    if (munmap(mapped, fs.st_size)) return ODB_EIO;
+    if (h.version != 2) return ODB_OK;
+
+    long long *order = malloc(s->n*sizeof(long long));
+    if (!order) return ODB_ENOMEM;
+    for (int k = 0; k < s->n; k++) order[k] = s->order[k];
+    odb_section_t sort = {ODB_FOOTER_SORT, s->n*sizeof(long long), order};
+    long long counts[2] = {n, h_size + n*odb_record_size(&h)};
+    int e = write_footer(fd, counts[1], &sort, 1);
+    if (!e && pwrite(fd, counts, sizeof(counts), RECORDS_OFFSET) != sizeof(counts)) e = ODB_EIO;
+    free(order);
+    return e;
+}
+
+// merge sorted inputs into out; on error *failed is the offending input or -1
+int odb_merge(odb_sort_t *s, odb_reader_t *inputs, int n, odb_writer_t *out, int *failed) {
+    size_t batch = ODB_BATCH;
+    size_t record_size = s->field_count*sizeof(long long);
+    long long *buffers = malloc(n*batch*record_size);
+    size_t *pos = calloc(n, sizeof(size_t));
+    size_t *len = calloc(n, sizeof(size_t));
+    int e = ODB_OK;
+    *failed = -1;
+    if (!buffers || !pos || !len) {
+        e = ODB_ENOMEM;
+        goto done;
+    }
+#define head(i) (buffers + ((i)*batch + pos[i])*s->field_count)
+    for (int i = 0; i < n; i++) {
+        if ((e = odb_reader_readahead(&inputs[i], n, 0)) ||
+            (e = odb_read_batch(&inputs[i], head(i), batch, &len[i]))) {
+            *failed = i;
+            goto done;
+        }
+    }
+    for (;;) {
+        int min = -1;
+        for (int i = 0; i < n; i++)
+            if (pos[i] < len[i] && (min < 0 || odb_record_lt(s, head(i), head(min))))
+                min = i;
+        if (min < 0) break;
+        if (e = odb_write_batch(out, head(min), 1)) goto done;
+        if (++pos[min] == len[min]) {
+            pos[min] = 0;
+            if (e = odb_read_batch(&inputs[min], head(min), batch, &len[min])) {
+                *failed = min;
+                goto done;
+            }
+        }
+    }
+#undef head
+done:
+    free(buffers);
+    free(pos);
+    free(len);
+    return e;
+}
+
+typedef struct {
+    char magic[8];
+    long long records, stride, keys;
+    long long data_size, data_mtime, data_mtime_nsec;
+} odx_header_t;
+
+static const char odx_magic[8] = "ODX\0\0\0\0\1";
+
+typedef struct {
+    odb_sort_t *s;
+    long long *ids;
+} id_sort_t;
+
+static int lt_ids(void *d, size_t a, size_t b) {
+    id_sort_t *x = (id_sort_t*) d;
+    odb_sort_t *s = x->s;
+    return odb_record_lt(s, record(x->ids[a]), record(x->ids[b]));
+}
+
+static void swap_ids(void *d, size_t a, size_t b) {
+    id_sort_t *x = (id_sort_t*) d;
+    long long t = x->ids[a];
+    x->s->swaps++;
+    x->ids[a] = x->ids[b];
+    x->ids[b] = t;
+}
+
+// sort the record ids of the odb file open on fd and write them as an index
+int odb_index_write(FILE *file, odb_sort_t *s, int fd) {
+    struct stat fs;
+    if (fstat(fd, &fs)) return ODB_EIO;
+    odb_header_t h = {s->field_count, s->field_specs};
+    if (fs.st_size < odb_header_size(&h)) return ODB_EFORMAT;
+    char *mapped = mmap(NULL, fs.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (mapped == MAP_FAILED) return ODB_EIO;
+
+    odx_header_t x;
+    memcpy(x.magic, odx_magic, sizeof(x.magic));
+    if ((x.records = map_header(mapped, fs.st_size, &h)) < 0) {
+        munmap(mapped, fs.st_size);
+        return ODB_EFORMAT;
+    }
+    size_t h_size = odb_header_size(&h);
+    x.stride = ODB_INDEX_STRIDE;
+    x.keys = s->n;
+    x.data_size = fs.st_size;
+    x.data_mtime = fs.st_mtim.tv_sec;
+    x.data_mtime_nsec = fs.st_mtim.tv_nsec;
+
+    int e = ODB_OK;
+    long long *ids = malloc(x.records*sizeof(long long) + 1);
+    long long *key = malloc(x.keys*sizeof(long long));
+    if (!ids || !key) {
+        e = ODB_ENOMEM;
+        goto done;
+    }
+    for (long long i = 0; i < x.records; i++) ids[i] = i;
+    s->data = (long long*) (mapped + h_size);
+    id_sort_t d = {s, ids};
+    su_smoothsort(&d, 0, x.records, lt_ids, swap_ids);
+
+    if (fwrite(&x, sizeof(x), 1, file) != 1) goto io;
+    for (int k = 0; k < x.keys; k++) {
+        key[k] = s->order[k];
+        if (fwrite(&key[k], sizeof(long long), 1, file) != 1) goto io;
+    }
+    if (fwrite(ids, sizeof(long long), x.records, file) != x.records) goto io;
+    for (long long i = 0; i < x.records; i += x.stride) {
+        for (int k = 0; k < x.keys; k++) key[k] = record(ids[i])[abs(s->order[k])-1];
+        if (fwrite(key, sizeof(long long), x.keys, file) != x.keys) goto io;
+    }
+    if (fflush(file)) goto io;
+    goto done;
+io:
+    e = ODB_EIO;
+done:
+    s->data = NULL;
+    free(ids);
+    free(key);
+    munmap(mapped, fs.st_size);
+    return e;
+}
+
+// map an index and the data file of reader r, which it must be up to date with
+int odb_index_open(odb_index_t *x, const char *path, odb_reader_t *r) {
+    struct stat fs, xs;
+    bzero(x, sizeof(*x));
+    if (!r->seekable) return ODB_ESTREAM;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return ODB_EIO;
+    if (fstat(fd, &xs) || fstat(fileno(r->file), &fs)) {
+        close(fd);
+        return ODB_EIO;
+    }
+    x->map_size = xs.st_size;
+    x->map = mmap(NULL, x->map_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (x->map == MAP_FAILED) {
+        x->map = NULL;
+        return ODB_EIO;
+    }
+    int e = ODB_EFORMAT;
+    odx_header_t *h = x->map;
+    if (x->map_size < sizeof(odx_header_t) || memcmp(h->magic, odx_magic, sizeof(h->magic)))
+        goto fail;
+    if (h->keys < 1 || h->keys > r->header.field_count || h->stride < 1 || h->records < 0)
+        goto fail;
+    long long fences = (h->records + h->stride - 1)/h->stride;
+    if (x->map_size != sizeof(odx_header_t) + (h->keys + h->records + fences*h->keys)*sizeof(long long))
+        goto fail;
+    e = ODB_ESTALE;
+    if (h->data_size != fs.st_size || h->data_mtime != fs.st_mtim.tv_sec ||
+        h->data_mtime_nsec != fs.st_mtim.tv_nsec)
+        goto fail;
+
+    const long long *order = (long long*) (h + 1);
+    x->records = h->records;
+    x->stride = h->stride;
+    x->ids = order + h->keys;
+    x->fences = x->ids + h->records;
+    x->sort.field_count = r->header.field_count;
+    x->sort.field_specs = r->header.field_specs;
+    x->sort.n = h->keys;
+    x->sort.order = malloc(h->keys*sizeof(int));
+    e = ODB_ENOMEM;
+    if (!x->sort.order) goto fail;
+    e = ODB_EFORMAT;
+    for (int k = 0; k < h->keys; k++) {
+        x->sort.order[k] = order[k];
+        if (!order[k] || llabs(order[k]) > r->header.field_count) goto fail;
+    }
+
+    x->data_map_size = fs.st_size;
+    x->data_map = mmap(NULL, fs.st_size, PROT_READ, MAP_SHARED, fileno(r->file), 0);
+    if (x->data_map == MAP_FAILED) {
+        x->data_map = NULL;
+        e = ODB_EIO;
+        goto fail;
+    }
+    x->data = (long long*) ((char*) x->data_map + r->data_offset);
+    return ODB_OK;
+fail:
+    odb_index_close(x);
+    return e;
+}
+
+void odb_index_close(odb_index_t *x) {
+    if (x->map) munmap(x->map, x->map_size);
+    if (x->data_map) munmap(x->data_map, x->data_map_size);
+    odb_sort_free(&x->sort);
+    bzero(x, sizeof(*x));
+}
+
+// read the records of r in index order from now on
+void odb_reader_set_index(odb_reader_t *r, const odb_index_t *x) {
+    r->buffer = (long long*) x->data;
+    r->order = x->ids;
+    r->buffer_records = x->records;
+    r->buffer_pos = 0;
+}
+
+// bound is the position of the first record whose leading keys are not less
+// than key (or, if upper, greater than key); key holds one value per index field
+int odb_index_bound(odb_index_t *x, const long long *key, int keys, int upper, long long *bound) {
+    odb_sort_t *s = &x->sort;
+    long long *probe = calloc(2*s->field_count, sizeof(long long));
+    if (!probe) return ODB_ENOMEM;
+    long long *fence = probe + s->field_count;
+    int n = s->n;
+    s->n = keys;
+    for (int k = 0; k < keys; k++) probe[abs(s->order[k])-1] = key[k];
+#define before(r) (upper ? !odb_record_lt(s, probe, r) : odb_record_lt(s, r, probe))
+    // the fences narrow the search down to one stride of the permutation
+    long long lo = 0, hi = (x->records + x->stride - 1)/x->stride;
+    while (lo < hi) {
+        long long mid = lo + (hi - lo)/2;
+        for (int k = 0; k < keys; k++)
+            fence[abs(s->order[k])-1] = x->fences[mid*n + k];
+        if (before(fence)) lo = mid + 1; else hi = mid;
+    }
+    long long a = lo ? (lo-1)*x->stride + 1 : 0, b = MIN(lo*x->stride, x->records);
+    while (a < b) {
+        long long mid = a + (b - a)/2;
+        if (before(x->data + x->ids[mid]*s->field_count)) a = mid + 1; else b = mid;
+    }
+#undef before
+    s->n = n;
+    free(probe);
+    *bound = a;
+    return ODB_OK;
+}
+
+static char *runs_path(const char *target) {
+    char *path;
+    return asprintf(&path, "%s.runs", target) < 0 ? NULL : path;
+}
+
+// runs are listed by name, relative to the directory of the target
+static char *sibling(const char *target, const char *name) {
+    const char *slash = strrchr(target, '/');
+    char *path;
+    int dir = slash ? slash - target + 1 : 0;
+    return asprintf(&path, "%.*s%s", dir, target, name) < 0 ? NULL : path;
+}
+
+static const char *basename_of(const char *path) {
+    const char *slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+// open and lock the current list, retrying if it is replaced meanwhile
+static FILE *lock_runs(const char *path, int op) {
+    for (;;) {
+        FILE *f = fopen(path, "r");
+        struct stat a, b;
+        if (!f) return NULL;
+        if (flock(fileno(f), op) || fstat(fileno(f), &a)) {
+            fclose(f);
+            return NULL;
+        }
+        if (!stat(path, &b) && a.st_ino == b.st_ino && a.st_dev == b.st_dev) return f;
+        fclose(f);
+    }
+}
+
+static int read_runs(FILE *f, const char *target, char **fields, char ***runs, int *n) {
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    int e = ODB_OK;
+    *fields = NULL;
+    *runs = NULL;
+    *n = 0;
+    while (!e && (len = getline(&line, &size, f)) > 0) {
+        if (line[len-1] == '\n') line[--len] = '\0';
+        if (!*fields) {
+            if (!(*fields = strdup(line))) e = ODB_ENOMEM;
+            continue;
+        }
+        char **more = realloc(*runs, (*n + 1)*sizeof(char*));
+        if (!more || !(more[*n] = sibling(target, line))) e = ODB_ENOMEM;
+        if (more) *runs = more;
+        if (!e) (*n)++;
+    }
+    free(line);
+    if (!e && ferror(f)) e = ODB_EIO;
+    if (!e && !*fields) e = ODB_EFORMAT;
+    if (e) odb_runs_free(*fields, *runs, *n);
+    return e;
+}
+
+// the sort fields and run paths of target; ODB_EIO with errno ENOENT if it has none
+int odb_runs_list(const char *target, char **fields, char ***runs, int *n) {
+    char *path = runs_path(target);
+    if (!path) return ODB_ENOMEM;
+    FILE *f = lock_runs(path, LOCK_SH);
+    free(path);
+    if (!f) return ODB_EIO;
+    int e = read_runs(f, target, fields, runs, n);
+    fclose(f);
+    return e;
+}
+
+void odb_runs_free(char *fields, char **runs, int n) {
+    for (int i = 0; i < n; i++) free(runs[i]);
+    free(runs);
+    free(fields);
+}
+
+// a new, unlisted run file next to target
+int odb_run_create(const char *target, FILE **file, char **path) {
+    if (asprintf(path, "%s.run.XXXXXX", target) < 0) return ODB_ENOMEM;
+    int fd = mkstemp(*path);
+    if (fd < 0 || !(*file = fdopen(fd, "w+"))) {
+        if (fd >= 0) {
+            unlink(*path);
+            close(fd);
+        }
+        free(*path);
+        return ODB_EIO;
+    }
+    return ODB_OK;
+}
+
+// replace the runs in remove (as listed) with add, either of which may be
+// empty; ODB_ESTALE if one of them has already been removed
+int odb_runs_update(const char *target, const char *fields, char **remove, int n, const char *add) {
+    char *path = runs_path(target), *tmp = NULL;
+    if (!path || asprintf(&tmp, "%s.XXXXXX", path) < 0) {
+        free(path);
+        return ODB_ENOMEM;
+    }
+    size_t tmp_len = strlen(tmp);
+    int e;
+    for (;;) {
+        char *old_fields = NULL, **runs = NULL;
+        int m = 0, found = 0, fd = -1;
+        FILE *f = lock_runs(path, LOCK_EX), *out = NULL;
+        e = ODB_EIO;
+        if (!f && errno != ENOENT) break;
+        if (f && (e = read_runs(f, target, &old_fields, &runs, &m))) goto next;
+        e = ODB_EMISMATCH;
+        if (f && strcmp(old_fields, fields)) goto next;
+        e = ODB_EIO;
+        strcpy(tmp + tmp_len - 6, "XXXXXX");
+        if ((fd = mkstemp(tmp)) < 0 || !(out = fdopen(fd, "w"))) goto next;
+        fprintf(out, "%s\n", fields);
+        for (int i = 0; i < m; i++) {
+            int removed = 0;
+            for (int j = 0; j < n; j++) removed |= !strcmp(runs[i], remove[j]);
+            if (removed) found++;
+            else fprintf(out, "%s\n", basename_of(runs[i]));
+        }
+        if (add) fprintf(out, "%s\n", basename_of(add));
+        if (fflush(out) || fsync(fileno(out))) goto next;
+        e = ODB_ESTALE;
+        if (found < n) goto next;
+        e = ODB_EIO;
+        if (f) {
+            if (!rename(tmp, path)) {
+                e = ODB_OK;
+                for (int j = 0; j < n; j++) unlink(remove[j]);
+            }
+        } else if (!link(tmp, path)) {
+            e = ODB_OK;
+        } else if (errno == EEXIST) {
+            e = -1; // the list was created meanwhile, try again
+        }
+next:
+        if (fd >= 0 && (e || !f)) unlink(tmp);
+        if (out) fclose(out);
+        else if (fd >= 0) close(fd);
+        if (f) fclose(f);
+        if (old_fields) odb_runs_free(old_fields, runs, m);
+        if (e != -1) break;
+    }
+    free(path);
+    free(tmp);
+    return e;
+}
+
+typedef struct {
+    odb_sort_t sort;
+    int n;
+    odb_reader_t *inputs;
+    long long *buffers;
+    size_t *pos, *len;
+} merge_t;
+
+static void merge_free(odb_reader_t *r) {
+    merge_t *m = r->runs;
+    for (int i = 0; i < m->n; i++) odb_close(&m->inputs[i]);
+    odb_sort_free(&m->sort);
+    free(m->inputs);
+    free(m->buffers);
+    free(m->pos);
+    free(m->len);
+    free(m);
+    r->runs = NULL;
+}
+
+#define head(m,i) ((m)->buffers + ((i)*ODB_BATCH + (m)->pos[i])*(m)->sort.field_count)
+
+// read target merged with its runs from now on; nothing changes if it has none
+int odb_reader_set_runs(odb_reader_t *r, const char *target) {
+    char *path = runs_path(target), *fields, **runs;
+    if (!path) return ODB_ENOMEM;
+    FILE *f = lock_runs(path, LOCK_SH);
+    free(path);
+    if (!f) return errno == ENOENT ? ODB_OK : ODB_EIO;
+    int n, e = read_runs(f, target, &fields, &runs, &n);
+    if (e) {
+        fclose(f);
+        return e;
+    }
+    // the runs are opened before the list is unlocked, so none can vanish
+    merge_t *m = calloc(1, sizeof(merge_t));
+    e = ODB_ENOMEM;
+    if (!m) goto done;
+    r->runs = m;
+    if (!(m->inputs = calloc(n + 1, sizeof(odb_reader_t)))) goto done;
+    if (e = odb_sort_init(&m->sort, &r->header, fields)) goto done;
+    for (int i = 0; i <= n; i++) {
+        if (e = odb_open(&m->inputs[i], i ? runs[i-1] : target)) goto done;
+        m->n++;
+        e = ODB_EMISMATCH;
+        if (!odb_header_equal(&r->header, &m->inputs[i].header)) goto done;
+    }
+    m->buffers = malloc(m->n*ODB_BATCH*r->record_size);
+    m->pos = calloc(m->n, sizeof(size_t));
+    m->len = calloc(m->n, sizeof(size_t));
+    e = ODB_ENOMEM;
+    if (!m->buffers || !m->pos || !m->len) goto done;
+    for (int i = 0; i < m->n; i++)
+        if ((e = odb_reader_readahead(&m->inputs[i], m->n, 0)) ||
+            (e = odb_read_batch(&m->inputs[i], head(m,i), ODB_BATCH, &m->len[i]))) goto done;
+    r->seekable = 0;
+    e = ODB_OK;
+done:
+    if (e && r->runs) merge_free(r);
+    fclose(f);
+    odb_runs_free(fields, runs, n);
+    return e;
+}
+
+static int merge_batch(odb_reader_t *r, long long *records, size_t max, size_t *n) {
+    merge_t *m = r->runs;
+    int e;
+    for (*n = 0; *n < max; (*n)++) {
+        int min = -1;
+        for (int i = 0; i < m->n; i++)
+            if (m->pos[i] < m->len[i] && (min < 0 || odb_record_lt(&m->sort, head(m,i), head(m,min))))
+                min = i;
+        if (min < 0) break;
+        memcpy(records + *n*m->sort.field_count, head(m,min), r->record_size);
+        if (++m->pos[min] == m->len[min]) {
+            m->pos[min] = 0;
+            if (e = odb_read_batch(&m->inputs[min], head(m,min), ODB_BATCH, &m->len[min])) return e;
+        }
+    }
+    r->records += *n;
+    return ODB_OK;
+}
+
+#undef head
+
+// profiles keep exact count, min, max, mean and variance (merged with
+// chan's formula), a hyperloglog sketch of the raw words and, for numeric
+// fields, a kll sketch of the values; NaNs are left out of all of them, as
+// if the records holding them lacked the field
+
+#define KLL_K 200
+
+int odb_profile_init(odb_profile_t *p, const odb_header_t *h, const char *fields) {
+    odb_sort_t s;
+    int e = odb_sort_init(&s, h, fields);
+    if (e) return e;
+    p->field_count = h->field_count;
+    p->n = s.n;
+    p->columns = calloc(s.n, sizeof(odb_column_profile_t));
+    if (!p->columns) e = ODB_ENOMEM;
+    for (int i = 0; !e && i < s.n; i++) {
+        odb_column_profile_t *c = &p->columns[i];
+        c->field = abs(s.order[i]) - 1;
+        c->type = h->field_specs[c->field].type;
+        c->imin = LLONG_MAX;
+        c->imax = LLONG_MIN;
+        c->min = INFINITY;
+        c->max = -INFINITY;
+        if (!(c->distinct = malloc(sizeof(hll_t)))) e = ODB_ENOMEM;
+        else hll_init(c->distinct);
+        if (c->type == ODB_STRING) continue;
+        if (!(c->quantiles = malloc(sizeof(kll_t)))) e = ODB_ENOMEM;
+        else kll_init(c->quantiles, KLL_K);
+    }
+    odb_sort_free(&s);
+    if (e) odb_profile_free(p);
+    return e;
+}
+
+void odb_profile_free(odb_profile_t *p) {
+    for (int i = 0; p->columns && i < p->n; i++) {
+        free(p->columns[i].distinct);
+        if (p->columns[i].quantiles) kll_free(p->columns[i].quantiles);
+        free(p->columns[i].quantiles);
+    }
+    free(p->columns);
+    p->columns = NULL;
+}
+
+// fold batch statistics into the running ones
+static void add_moments(odb_column_profile_t *c, long long n, double mean, double m2) {
+    long long total = c->count + n;
+    double delta = mean - c->mean;
+    c->m2 += m2 + delta*delta*c->count*n/total;
+    c->mean += delta*n/total;
+    c->count = total;
+}
+
+int odb_profile_add(odb_profile_t *p, const long long *records, size_t n) {
+    if (!n) return ODB_OK;
+    long long fc = p->field_count;
+    for (int i = 0; i < p->n; i++) {
+        odb_column_profile_t *c = &p->columns[i];
+        const long long *v = records + c->field;
+        if (c->type == ODB_INTEGER || c->type == ODB_STRING) {
+            for (size_t j = 0; j < n; j++) hll_add(c->distinct, v[j*fc]);
+            long long lo = c->imin, hi = c->imax;
+            for (size_t j = 0; j < n; j++) {
+                lo = v[j*fc] < lo ? v[j*fc] : lo;
+                hi = v[j*fc] > hi ? v[j*fc] : hi;
+            }
+            c->imin = lo;
+            c->imax = hi;
+            if (c->type == ODB_STRING) {
+                c->count += n;
+                continue;
+            }
+        }
+        double lo = c->min, hi = c->max, sum = 0, m2 = 0;
+        size_t m = 0;
+        for (size_t j = 0; j < n; j++) {
+            long long w = v[j*fc];
+            double x = c->type == ODB_INTEGER ? (double) w : dbl(w);
+            if (isnan(x)) continue;
+            if (c->type != ODB_INTEGER) hll_add(c->distinct, w);
+            lo = x < lo ? x : lo;
+            hi = x > hi ? x : hi;
+            sum += x;
+            m++;
+            if (kll_add(c->quantiles, x)) return ODB_ENOMEM;
+        }
+        if (!m) continue;
+        double mean = sum/m;
+        for (size_t j = 0; j < n; j++) {
+            long long w = v[j*fc];
+            double d = (c->type == ODB_INTEGER ? (double) w : dbl(w)) - mean;
+            if (!isnan(d)) m2 += d*d;
+        }
+        c->min = lo;
+        c->max = hi;
+        add_moments(c, m, mean, m2);
+    }
+    return ODB_OK;
+}
+
+int odb_profile_merge(odb_profile_t *a, const odb_profile_t *b) {
+    for (int i = 0; i < a->n; i++) {
+        odb_column_profile_t *c = &a->columns[i], *d = &b->columns[i];
+        if (!d->count) continue;
+        hll_merge(c->distinct, d->distinct);
+        if (d->imin < c->imin) c->imin = d->imin;
+        if (d->imax > c->imax) c->imax = d->imax;
+        if (c->type == ODB_STRING) {
+            c->count += d->count;
+            continue;
+        }
+        if (d->min < c->min) c->min = d->min;
+        if (d->max > c->max) c->max = d->max;
+        if (kll_merge(c->quantiles, d->quantiles)) return ODB_ENOMEM;
+        add_moments(c, d->count, d->mean, d->m2);
+    }
+    return ODB_OK;
+}
+
+double odb_profile_distinct(const odb_column_profile_t *c) {
+    double e = hll_count(c->distinct);
+    return e > c->count ? c->count : round(e);
+}
+
+// NAN for string fields and empty inputs
+double odb_profile_quantile(const odb_column_profile_t *c, double q) {
+    return c->quantiles ? kll_quantile(c->quantiles, q) : NAN;
+}
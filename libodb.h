@@ -0,0 +1,266 @@
+#ifndef LIBODB_H
+#define LIBODB_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+// all calls return ODB_OK or one of these; ODB_EIO leaves errno set
+enum {
+    ODB_OK = 0,
+    ODB_EIO,
+    ODB_ENOMEM,
+    ODB_EFORMAT,
+    ODB_ETRUNC,
+    ODB_EMISMATCH,
+    ODB_EFIELD,
+    ODB_ESTREAM,
+    ODB_EDUP,
+    ODB_EEMPTY,
+    ODB_EHASH,
+    ODB_ESTALE,
+    ODB_EARROW,
+    ODB_EUNSUPPORTED,
+    ODB_ECSV
+};
+
+const char *odb_strerror(int err);
+
+typedef enum {
+    ODB_INTEGER,
+    ODB_FLOAT,
+    ODB_STRING,
+    ODB_TIMESTAMP,
+    ODB_DATE,
+    ODB_UNSPECIFIED
+} odb_type_t;
+
+#define ODB_TYPES 5
+#define odb_floatlike(t) ((t)==ODB_FLOAT||(t)==ODB_TIMESTAMP||(t)==ODB_DATE)
+
+const char *odb_type_name(odb_type_t t);
+int odb_type_from_name(const char *name);
+
+#define ODB_NAME_SIZE (256-sizeof(odb_type_t))
+
+typedef struct {
+    odb_type_t type;
+    char name[ODB_NAME_SIZE];
+} __attribute__ ((__packed__)) odb_field_spec_t;
+
+// version 2 headers also hold the record count and the offset of a footer
+// after the records, both set once a seekable writer finishes (until then
+// records is -1 and footer 0), and pad the records to an ODB_ALIGN boundary;
+// version 0 is the same as 1
+#define ODB_ALIGN 4096
+
+typedef struct {
+    long long field_count;
+    odb_field_spec_t *field_specs;
+    int version;
+    long long records;
+    off_t footer;
+} odb_header_t;
+
+int odb_read_header(FILE *file, odb_header_t *h);
+int odb_write_header(FILE *file, const odb_header_t *h);
+void odb_free_header(odb_header_t *h);
+int odb_header_equal(const odb_header_t *a, const odb_header_t *b);
+size_t odb_header_size(const odb_header_t *h);
+size_t odb_record_size(const odb_header_t *h);
+int odb_field_index(const odb_header_t *h, const char *name);
+// a string field can name its own dictionary after the nul ending its name
+const char *odb_field_dictionary(const odb_field_spec_t *f);
+int odb_field_set_dictionary(odb_field_spec_t *f, const char *path);
+int odb_string_fields(const odb_header_t *h);
+
+// records are arrays of field_count 64-bit words, batches are runs of records
+
+#define ODB_BATCH 1024
+
+typedef struct {
+    FILE *file;
+    odb_header_t header;
+    size_t record_size;
+    off_t data_offset;
+    int seekable;
+    long long records;
+    long long *buffer;
+    const long long *order;
+    size_t buffer_records, buffer_pos;
+    void *runs;
+    void *ahead;
+} odb_reader_t;
+
+int odb_open(odb_reader_t *r, const char *path);
+int odb_reader_init(odb_reader_t *r, FILE *file);
+void odb_reader_set_buffer(odb_reader_t *r, long long *records, size_t n);
+int odb_read_batch(odb_reader_t *r, long long *records, size_t max, size_t *n);
+int odb_skip(odb_reader_t *r, off_t n);
+int odb_read_at(odb_reader_t *r, const off_t *ids, size_t n, long long *records);
+long long odb_record_count(odb_reader_t *r);
+int odb_close(odb_reader_t *r);
+
+// read the records of a seekable file asynchronously from now on, with reads
+// sized for that many inputs being read at once in flight (through io_uring,
+// or large preads without it); streams are left alone. Stopping moves the
+// file to the first record not read
+#define ODB_READAHEAD_DIRECT 1 // bypass the page cache
+int odb_reader_readahead(odb_reader_t *r, int inputs, int flags);
+int odb_reader_readahead_stop(odb_reader_t *r);
+
+typedef struct {
+    FILE *file;
+    long long field_count;
+    long long records;
+    int version;
+    off_t start;
+} odb_writer_t;
+
+int odb_writer_init(odb_writer_t *w, FILE *file, const odb_header_t *h);
+int odb_write_batch(odb_writer_t *w, const long long *records, size_t n);
+
+// footers are tagged sections, each padded to 8 bytes; a version 2 writer
+// on a seekable file appends them and records where they start when it
+// finishes, other writers ignore them
+enum {
+    ODB_FOOTER_END = 0,
+    ODB_FOOTER_SORT         // the sort order as +/-(index+1) words
+};
+
+typedef struct {
+    long long tag, size;
+    const void *data;
+} odb_section_t;
+
+int odb_writer_finish(odb_writer_t *w, const odb_section_t *sections, int n);
+// *data is malloced, or NULL if the input has no such section
+int odb_read_footer(odb_reader_t *r, long long tag, void **data, size_t *size);
+
+// string dictionaries (strings.idx files): strings are front coded in blocks
+// of ODB_STRINGS_BLOCK, each storing the length of the prefix it shares with
+// the one before, and the hash of a string leads to its index through a table
+// of ceil(log2(count))-bit entries. The hash is made of one minimal perfect
+// hash for each partition of about ODB_STRINGS_PARTITION strings, chosen by a
+// hash of its own. Dictionaries of older versions, holding whole strings and
+// 64-bit tables, or one hash, are still read
+#define ODB_STRINGS_BLOCK 32
+#define ODB_STRINGS_PARTITION (1 << 20)
+
+typedef struct {
+    off_t count;
+    off_t maxlen;
+    char *data;
+    off_t *offsets;
+    off_t *reverse;
+    const off_t *blocks;
+    const unsigned char *packed;
+    int block, bits;
+    unsigned long long id;
+    void **hash;
+    const off_t *bases;
+    int parts;
+    void *map;
+    size_t map_size;
+} odb_strings_t;
+
+int odb_strings_open(odb_strings_t *s, const char *path);
+void odb_strings_close(odb_strings_t *s);
+long long odb_string_to_index(const odb_strings_t *s, const char *str, size_t len);
+// the indexes of n strings, or -1 for those missing; looking many up at once
+// lets the cache misses of one overlap with those of the others
+void odb_strings_lookup(const odb_strings_t *s, const char *const *strs, const size_t *lens,
+                        size_t n, long long *indexes);
+// strings are decoded into a buffer of the calling thread, so the result is
+// only valid until its next call
+const char *odb_index_to_string(const odb_strings_t *s, long long index);
+
+// strings must be added in sorted order; file must be open for update. The
+// partitions of the hash are built by up to threads threads (1 after init)
+typedef struct {
+    FILE *file;
+    off_t n, allocated, maxlen, pos;
+    off_t *offsets;
+    char *last;
+    size_t last_len, last_size;
+    unsigned char *buf;
+    size_t used, size;
+    int threads;
+} odb_strings_writer_t;
+
+int odb_strings_writer_init(odb_strings_writer_t *w, FILE *file);
+int odb_strings_add(odb_strings_writer_t *w, const char *str, size_t len);
+int odb_strings_finish(odb_strings_writer_t *w);
+
+// sorting and merging by a list of fields, order entries are +/-(index+1)
+
+typedef struct {
+    long long field_count;
+    odb_field_spec_t *field_specs;
+    int n;
+    int *order;
+    long long *data;
+    long long comparisons;
+    long long swaps;
+} odb_sort_t;
+
+int odb_sort_init(odb_sort_t *s, const odb_header_t *h, const char *fields);
+void odb_sort_free(odb_sort_t *s);
+int odb_record_lt(odb_sort_t *s, const long long *a, const long long *b);
+void odb_sort_records(odb_sort_t *s, long long *records, size_t n);
+int odb_sort_file(odb_sort_t *s, int fd);
+int odb_merge(odb_sort_t *s, odb_reader_t *inputs, int n, odb_writer_t *out, int *failed);
+
+// permutation indexes (.odx files): the record ids of a file in a sort
+// order, and the keys of every stride-th of them as fences for lookups
+
+#define ODB_INDEX_STRIDE 256
+
+typedef struct {
+    long long records, stride;
+    odb_sort_t sort;
+    const long long *ids, *fences, *data;
+    void *map, *data_map;
+    size_t map_size, data_map_size;
+} odb_index_t;
+
+int odb_index_write(FILE *file, odb_sort_t *s, int fd);
+int odb_index_open(odb_index_t *x, const char *path, odb_reader_t *r);
+void odb_index_close(odb_index_t *x);
+void odb_reader_set_index(odb_reader_t *r, const odb_index_t *x);
+int odb_index_bound(odb_index_t *x, const long long *key, int keys, int upper, long long *bound);
+
+// log-structured ingest: target.runs names the fields and the files of
+// sorted runs that readers of target merge with it on the fly; the list
+// is replaced atomically, so readers never see a half-written run
+
+int odb_runs_list(const char *target, char **fields, char ***runs, int *n);
+void odb_runs_free(char *fields, char **runs, int n);
+int odb_run_create(const char *target, FILE **file, char **path);
+int odb_runs_update(const char *target, const char *fields, char **remove, int n, const char *add);
+int odb_reader_set_runs(odb_reader_t *r, const char *target);
+
+// single-pass column profiles; partial profiles of the same fields merge
+
+typedef struct {
+    int field;
+    odb_type_t type;
+    long long count;
+    long long imin, imax;
+    double min, max, mean, m2;
+    void *distinct, *quantiles;
+} odb_column_profile_t;
+
+typedef struct {
+    long long field_count;
+    int n;
+    odb_column_profile_t *columns;
+} odb_profile_t;
+
+int odb_profile_init(odb_profile_t *p, const odb_header_t *h, const char *fields);
+void odb_profile_free(odb_profile_t *p);
+int odb_profile_add(odb_profile_t *p, const long long *records, size_t n);
+int odb_profile_merge(odb_profile_t *a, const odb_profile_t *b);
+double odb_profile_distinct(const odb_column_profile_t *c);
+double odb_profile_quantile(const odb_column_profile_t *c, double q);
+
+#endif
@@ -3,18 +3,27 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <errno.h>
+#include <ctype.h>
 #include <string.h>
 #include <stdarg.h>
 #include <getopt.h>
+#include <libgen.h>
 #include <math.h>
 #include <time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include <sys/file.h>
+#include <fcntl.h>
 #include <sys/mman.h>
 #include <sys/param.h>
-#include <sys/sysctl.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <pthread.h>
 
 #ifndef __APPLE__
 #include <stdio.h>
@@ -22,19 +31,25 @@
 #define fpurge(stream) __fpurge(stream)
 #endif
 
-// external dependencies:
-#include <cmph.h>
-
 // internal headers:
-#include "smoothsort.h"
+#include "libodb.h"
+#include "sketch.h"
+#include "arrow.h"
+#include "decompress.h"
+#include "csv.h"
 
 #define errstr                  strerror(errno)
 
-#define warn(fmt,args...)     { fflush(stdout); fsync(fileno(stdout)); \
+// errno is kept for errstr across the syncs, which fail on pipes
+#define warn(fmt,args...)     { int errno_ = errno;                    \
+                                fflush(stdout); fsync(fileno(stdout)); \
+                                errno = errno_;                        \
                                 fprintf(stderr,fmt,##args);            \
                                 fflush(stderr); fsync(fileno(stderr)); }
 
-#define die(fmt,args...)      { fpurge(stdout); fsync(fileno(stdout)); \
+#define die(fmt,args...)      { int errno_ = errno;                    \
+                                fpurge(stdout); fsync(fileno(stdout)); \
+                                errno = errno_;                        \
                                 fprintf(stderr,fmt,##args);            \
                                 fflush(stderr); fsync(fileno(stderr)); \
                                 fclose(stderr); exit(1); }
@@ -55,6 +70,17 @@ static const char *const cmdstr =
     "  paste      Paste columns from different files\n"
     "  join       Join files on specified fields\n"
     "  sort       Sort by specified fields (in place)\n"
+    "  index      Write a sort order index for files\n"
+    "  lookup     Output records by key using an index\n"
+    "  append     Add records to a file as a sorted run\n"
+    "  compact    Merge the sorted runs of a file\n"
+    "  partition  Split records between files by key\n"
+    "  bloom      Write a Bloom filter of the keys of files\n"
+    "  semijoin   Output records whose keys appear in another file\n"
+    "  sample     Output a random sample of records\n"
+    "  stats      Profile the values of each field\n"
+    "  run        Run a pipeline of commands in one process\n"
+    "  serve      Run commands sent over a Unix socket\n"
     "  help       Print this message\n"
 ;
 
@@ -63,9 +89,14 @@ static const char *const optstr =
     " -C --csv                  CSV encode/decode mode\n"
     " -P --psql=<table>         PosgreSQL encode/decode mode\n"
     " -M --mysql=<table>        MySQL encode/decode mode\n"
+    " -B --binary               Use binary COPY format for PostgreSQL\n"
+    " -A --arrow                Use the Apache Arrow IPC stream format\n"
     " -f --fields=<fields>      Comma-sparated fields\n"
     " -x --extract              String extraction mode for encode\n"
+    " -0 --null                 End extracted strings, and those read by strings, with NULs\n"
     " -s --strings=<file>       Use <file> as string index\n"
+    " -I --index=<fields>       Read files in the order of their index on <fields>\n"
+    " -k --key=<values>         Comma-separated key values for lookup\n"
     " -r --range=<range>        Output a range slice of records\n"
     " -n --count=<n>            Output at most <n> records\n"
     " -N --line-numbers[=<b>]   Output with line numbers\n"
@@ -74,8 +105,21 @@ static const char *const optstr =
     " -T --timestamp[=<fmt>]    Use <fmt> as a timestamp format\n"
     " -D --date[=<fmt>]         Use <fmt> as a date format\n"
     " -q --quiet                Suppress output for sort\n"
+    " -c --cow                  Sort a copy of each file and rename it into place\n"
+    " -m --memory=<size>        Sort streams in up to <size> bytes of memory\n"
+    " -R --seed=<n>             Seed the random choices of sample\n"
+    " -H --hash                 Partition by hashes of keys\n"
+    " -p --splits=<values>      Partition by ranges of keys split at <values>\n"
+    " -b --bloom=<file>         Semijoin with the keys of <file> or its Bloom filter\n"
+    " -F --follow               Keep outputting records appended to a file\n"
+    " -K --compact=<file>       Write a string index of just the strings files use\n"
+    " -2 --v2                   Write version 2 headers with record counts and footers\n"
+    " -j --jobs=<n>             Use <n> threads for stats, decode and strings\n"
     " -y --tty                  Force acting as for a TTY\n"
     " -Y --no-tty               Force acting as not for a TTY\n"
+    " -S --stats[=json]         Report timings and counters to stderr\n"
+    " -U --socket=<path>        Serve on, or send the command to, the socket <path>\n"
+    " -a --approximate          Semijoin with a Bloom filter alone if its keys are gone\n"
     " -h --help                 Print this message\n"
 ;
 
@@ -84,7 +128,8 @@ typedef enum {
     TABLE,
     CSV,
     PSQL,
-    MYSQL
+    MYSQL,
+    ARROW
 } codec_t;
 
 typedef struct {
@@ -93,10 +138,14 @@ typedef struct {
 
 static codec_t codec = DELIMITED;
 static char *table_name = NULL;
+static int binary = 0;
 static char *delim = "\t";
 static char *fields_arg = NULL;
 static char *strings_file = "strings.idx";
+static char *index_arg = NULL;
+static char *key_arg = NULL;
 static int extract = 0;
+static char string_end = '\n';
 static range_t range = {1,1,-1};
 static long long count = LLONG_MAX;
 static long long line_number = 1;
@@ -105,7 +154,20 @@ static char float_format_char = 'f';
 static char *timestamp_fmt = "%F %T";
 static char *date_fmt = "%F";
 static int quiet = 0;
+static int cow = 0;
+static long long sort_memory = -1;
+static long long seed = -1;
+static long long jobs = 0;
+static char *splits_arg = NULL;
+static char *bloom_arg = NULL;
+static int approximate = 0;
+static int follow = 0;
+static int version = 1;
+static int compact = 0;
+static char *compact_arg = NULL;
 static int tty = 0;
+static int stats = 0;
+static char *socket_arg = NULL;
 
 char *ltrunc(char *line) {
     char *nl = strchr(line, '\n');
@@ -133,6 +195,19 @@ double parse_d(char **str) {
     return v;
 }
 
+long long parse_size(char *str) {
+    char *p = str;
+    long long v = parse_ll(&p);
+    switch (*p) {
+        case 'T': case 't': v *= 1024;
+        case 'G': case 'g': v *= 1024;
+        case 'M': case 'm': v *= 1024;
+        case 'K': case 'k': v *= 1024; p++;
+    }
+    dieif(*p || v < 0, "invalid size: %s\n", str);
+    return v;
+}
+
 range_t make_range(long long start, long long step, long long stop) {
     range_t r;
     r.start = start;
@@ -169,15 +244,20 @@ invalid:
 }
 
 void parse_opts(int *argcp, char ***argvp) {
-    static char* shortopts = "d:CP:M:f:s:xr:n:N::egT::D::qyYh";
+    static char* shortopts = "d:CP:M:BAf:s:I:k:x0r:n:N::egT::D::qcm:R:Hp:b:F2K::j:yYS::U:ah";
     static struct option longopts[] = {
         { "delim",          required_argument, 0, 'd' },
         { "csv",            no_argument,       0, 'C' },
         { "psql",           required_argument, 0, 'P' },
         { "mysql",          required_argument, 0, 'M' },
+        { "binary",         no_argument,       0, 'B' },
+        { "arrow",          no_argument,       0, 'A' },
         { "fields",         required_argument, 0, 'f' },
         { "strings",        required_argument, 0, 's' },
+        { "index",          required_argument, 0, 'I' },
+        { "key",            required_argument, 0, 'k' },
         { "extract",        no_argument,       0, 'x' },
+        { "null",           no_argument,       0, '0' },
         { "range",          required_argument, 0, 'r' },
         { "count",          required_argument, 0, 'n' },
         { "line-numbers",   optional_argument, 0, 'N' },
@@ -186,8 +266,21 @@ void parse_opts(int *argcp, char ***argvp) {
         { "timestamp",      required_argument, 0, 'T' },
         { "date",           required_argument, 0, 'D' },
         { "quiet",          no_argument,       0, 'q' },
+        { "cow",            no_argument,       0, 'c' },
+        { "memory",         required_argument, 0, 'm' },
+        { "seed",           required_argument, 0, 'R' },
+        { "hash",           no_argument,       0, 'H' },
+        { "splits",         required_argument, 0, 'p' },
+        { "bloom",          required_argument, 0, 'b' },
+        { "follow",         no_argument,       0, 'F' },
+        { "v2",             no_argument,       0, '2' },
+        { "compact",        optional_argument, 0, 'K' },
+        { "jobs",           required_argument, 0, 'j' },
         { "tty",            no_argument,       0, 'y' },
         { "no-tty",         no_argument,       0, 'y' },
+        { "stats",          optional_argument, 0, 'S' },
+        { "socket",         required_argument, 0, 'U' },
+        { "approximate",    no_argument,       0, 'a' },
         { "help",           no_argument,       0, 'h' },
         { 0, 0, 0, 0 }
     };
@@ -208,15 +301,30 @@ void parse_opts(int *argcp, char ***argvp) {
                 codec = MYSQL;
                 table_name = optarg;
                 break;
+            case 'B':
+                binary = 1;
+                break;
+            case 'A':
+                codec = ARROW;
+                break;
             case 'f':
                 fields_arg = optarg;
                 break;
             case 's':
                 strings_file = optarg;
                 break;
+            case 'I':
+                index_arg = optarg;
+                break;
+            case 'k':
+                key_arg = optarg;
+                break;
             case 'x':
                 extract = 1;
                 break;
+            case '0':
+                string_end = '\0';
+                break;
             case 'r':
                 range = parse_range(optarg);
                 break;
@@ -242,12 +350,55 @@ void parse_opts(int *argcp, char ***argvp) {
             case 'q':
                 quiet = 1;
                 break;
+            case 'c':
+                cow = 1;
+                break;
+            case 'm':
+                sort_memory = parse_size(optarg);
+                break;
+            case 'R':
+                seed = parse_ll(&optarg);
+                break;
+            case 'H':
+                splits_arg = NULL;
+                break;
+            case 'p':
+                splits_arg = optarg;
+                break;
+            case 'b':
+                bloom_arg = optarg;
+                break;
+            case 'a':
+                approximate = 1;
+                break;
+            case 'F':
+                follow = 1;
+                break;
+            case '2':
+                version = 2;
+                break;
+            case 'K':
+                compact = 1;
+                compact_arg = optarg;
+                break;
+            case 'j':
+                jobs = parse_ll(&optarg);
+                dieif(jobs < 1, "invalid number of jobs: %lld\n", jobs);
+                break;
             case 'y':
                 tty = 1;
                 break;
             case 'Y':
                 tty = -1;
                 break;
+            case 'S':
+                dieif(optarg && strcmp(optarg, "json"),
+                      "invalid stats format: %s\n", optarg);
+                stats = optarg ? 2 : 1;
+                break;
+            case 'U':
+                socket_arg = optarg;
+                break;
             case 'h':
                 printf("%s\n\ncommands:\n%s\noptions:\n%s\n", usage, cmdstr, optstr);
                 exit(0);
@@ -257,6 +408,8 @@ void parse_opts(int *argcp, char ***argvp) {
                 die("unhandled option -- %c\n", c);
         }
     }
+    // CSV is comma separated unless -d says otherwise
+    if (codec == CSV && !strcmp(delim, "\t")) delim = ",";
     *argvp += optind;
     *argcp -= optind;
 }
@@ -270,6 +423,17 @@ typedef enum {
     PASTE,
     JOIN,
     SORT,
+    INDEX,
+    LOOKUP,
+    APPEND,
+    COMPACT,
+    PARTITION,
+    BLOOM,
+    SEMIJOIN,
+    SAMPLE,
+    STATS,
+    RUN,
+    SERVE,
     RENAME,
     CAST,
     HELP,
@@ -286,32 +450,22 @@ cmd_t parse_cmd(char *str) {
            !strcmp(str, "paste")   ? PASTE   :
            !strcmp(str, "join")    ? JOIN    :
            !strcmp(str, "sort")    ? SORT    :
+           !strcmp(str, "index")   ? INDEX   :
+           !strcmp(str, "lookup")  ? LOOKUP  :
+           !strcmp(str, "append")  ? APPEND  :
+           !strcmp(str, "compact") ? COMPACT :
+           !strcmp(str, "partition") ? PARTITION :
+           !strcmp(str, "bloom")   ? BLOOM   :
+           !strcmp(str, "semijoin") ? SEMIJOIN :
+           !strcmp(str, "sample")  ? SAMPLE  :
+           !strcmp(str, "stats")   ? STATS   :
+           !strcmp(str, "run")     ? RUN     :
+           !strcmp(str, "serve")   ? SERVE   :
            !strcmp(str, "rename")  ? RENAME  :
            !strcmp(str, "cast")    ? CAST    :
            !strcmp(str, "help")    ? HELP    : INVALID;
 }
 
-const int n_types = 5;
-
-typedef enum {
-    INTEGER,
-    FLOAT,
-    STRING,
-    TIMESTAMP,
-    DATE,
-    UNSPECIFIED
-} field_type_t;
-
-#define floatlike(t) ((t)==FLOAT||(t)==TIMESTAMP||(t)==DATE)
-
-char *typestrs[] = {
-    "int",
-    "float",
-    "string",
-    "timestamp",
-    "date"
-};
-
 char *psql_types[] = {
     "bigint",
     "double precision",
@@ -320,62 +474,50 @@ char *psql_types[] = {
     "date"
 };
 
-char *typestr(field_type_t t) {
-    if (t < 0 || n_types <= t) return "<unknown>";
-    return typestrs[t];
-}
-
-field_type_t parse_type(const char *const str) {
-    for (field_type_t t = 0; t < n_types; t++)
-        if (!strcmp(typestrs[t], str)) return t;
-    die("invalid type: %s\n", str);
+odb_type_t parse_type(const char *const str) {
+    int t = odb_type_from_name(str);
+    dieif(t < 0, "invalid type: %s\n", str);
+    return t;
 }
 
-typedef struct {
-    char magic[4];
-    unsigned long long bom;
-} __attribute__ ((__packed__)) preamble_t;
-
-static const preamble_t preamble = {"odb", 0x0123456789abcdef};
-
-#define name_size (256-sizeof(field_type_t))
-
-typedef struct {
-    field_type_t type;
-    char name[name_size];
-} __attribute__ ((__packed__)) field_spec_t;
-
-field_spec_t parse_field_spec(const char *const str) {
-    field_spec_t spec;
+// name:type, or name:string:dictionary for a string field with its own
+odb_field_spec_t parse_field_spec(const char *const str) {
+    odb_field_spec_t spec;
     bzero(&spec, sizeof(spec));
     char *colon = strchr(str, ':');
     dieif(!colon, "invalid field spec: %s\n", str);
     int n = colon++ - str;
-    dieif(n >= name_size, "field name too long: %s\n", str);
+    dieif(n >= ODB_NAME_SIZE, "field name too long: %s\n", str);
     memcpy(spec.name, str, n);
-    spec.type = parse_type(colon);
+    char *type = strndup(colon, strcspn(colon, ":")), *path = colon + strlen(type);
+    spec.type = parse_type(type);
+    free(type);
+    if (*path++) {
+        dieif(spec.type != ODB_STRING || !*path, "invalid field spec: %s\n", str);
+        dieif(odb_field_set_dictionary(&spec, path), "field name and dictionary too long: %s\n", str);
+    }
     return spec;
 }
 
 typedef struct {
-    char from_name[name_size];
-    char to_name[name_size];
-    field_type_t to_type;
+    char from_name[ODB_NAME_SIZE];
+    char to_name[ODB_NAME_SIZE];
+    odb_type_t to_type;
 } cut_spec_t;
 
 cut_spec_t parse_cut_spec(const char *str) {
     cut_spec_t spec;
     bzero(&spec, sizeof(spec));
-    spec.to_type = UNSPECIFIED;
+    spec.to_type = ODB_UNSPECIFIED;
     off_t n = strcspn(str, "=:");
-    dieif(n >= name_size, "invalid field: %s\n", str);
+    dieif(n >= ODB_NAME_SIZE, "invalid field: %s\n", str);
     memcpy(spec.from_name, str, n);
     if (str[n] != '=') memcpy(spec.to_name, str, n);
     if (!str[n]) return spec;
     if (str[n] == '=') {
         str += n + 1;
         n = strcspn(str, "=:");
-        dieif(n >= name_size, "field name too long: %s\n", str);
+        dieif(n >= ODB_NAME_SIZE, "field name too long: %s\n", str);
         memcpy(spec.to_name, str, n);
     }
     if (str[n]) {
@@ -387,9 +529,121 @@ cut_spec_t parse_cut_spec(const char *str) {
 
 typedef struct {
     int from;
-    field_spec_t field_spec;
+    odb_field_spec_t field_spec;
 } cut_t;
 
+typedef enum {
+    OTHER,
+    HEADER,
+    LOAD_STRINGS,
+    PARSE,
+    COPY,
+    SMOOTHSORT,
+    MERGE,
+    STRING_SORT,
+    SCAN,
+    OUTPUT,
+    n_phases
+} phase_t;
+
+char *phase_names[] = {
+    "other",
+    "header",
+    "load_strings",
+    "parse",
+    "copy",
+    "smoothsort",
+    "merge",
+    "string_sort",
+    "scan",
+    "output"
+};
+
+static struct {
+    char *cmd;
+    phase_t phase;
+    double wall0, cpu0, start;
+    double wall[n_phases], cpu[n_phases];
+    long long records_in, bytes_in;
+    long long records_out, bytes_out;
+    long long comparisons, swaps;
+    int reported;
+} perf;
+
+double clock_seconds(clockid_t clock) {
+    struct timespec ts;
+    dieif(clock_gettime(clock, &ts), "clock error: %s\n", errstr);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+// charge time since the last switch to the current phase and enter phase p
+void stats_phase(phase_t p) {
+    if (!stats) return;
+    double wall = clock_seconds(CLOCK_MONOTONIC);
+    double cpu = clock_seconds(CLOCK_PROCESS_CPUTIME_ID);
+    perf.wall[perf.phase] += wall - perf.wall0;
+    perf.cpu[perf.phase] += cpu - perf.cpu0;
+    perf.wall0 = wall;
+    perf.cpu0 = cpu;
+    perf.phase = p;
+}
+
+void stats_report() {
+    if (!stats || perf.reported) return;
+    perf.reported = 1;
+    stats_phase(OTHER);
+    double total = perf.wall0 - perf.start;
+    double rate = total > 0 ? perf.records_in/total : 0;
+    struct rusage ru;
+    dieif(getrusage(RUSAGE_SELF, &ru), "getrusage error: %s\n", errstr);
+#ifdef __APPLE__
+    long maxrss = ru.ru_maxrss/1024;
+#else
+    long maxrss = ru.ru_maxrss;
+#endif
+    if (stats == 1) {
+        fprintf(stderr, "odb %s stats (pid %d):\n", perf.cmd, getpid());
+        fprintf(stderr, "  %-14s %12s %12s\n", "phase", "wall", "cpu");
+        for (phase_t p = 0; p < n_phases; p++) {
+            if (!perf.wall[p] && !perf.cpu[p]) continue;
+            fprintf(stderr, "  %-14s %12.6f %12.6f\n", phase_names[p], perf.wall[p], perf.cpu[p]);
+        }
+        fprintf(stderr, "  %-14s %12.6f\n", "total", total);
+        fprintf(stderr, "  records in     %12lld (%.0f/s)\n", perf.records_in, rate);
+        fprintf(stderr, "  bytes in       %12lld\n", perf.bytes_in);
+        fprintf(stderr, "  records out    %12lld\n", perf.records_out);
+        fprintf(stderr, "  bytes out      %12lld\n", perf.bytes_out);
+        fprintf(stderr, "  comparisons    %12lld\n", perf.comparisons);
+        fprintf(stderr, "  swaps          %12lld\n", perf.swaps);
+        fprintf(stderr, "  max rss        %12ld kB\n", maxrss);
+        fprintf(stderr, "  page faults    %12ld major, %ld minor\n", ru.ru_majflt, ru.ru_minflt);
+    } else {
+        fprintf(stderr, "{\"command\":\"%s\",\"pid\":%d,\"phases\":{", perf.cmd, getpid());
+        int first = 1;
+        for (phase_t p = 0; p < n_phases; p++) {
+            if (!perf.wall[p] && !perf.cpu[p]) continue;
+            fprintf(stderr, "%s\"%s\":{\"wall\":%.6f,\"cpu\":%.6f}",
+                    first ? "" : ",", phase_names[p], perf.wall[p], perf.cpu[p]);
+            first = 0;
+        }
+        fprintf(stderr, "},\"wall\":%.6f,\"records_in\":%lld,\"records_per_sec\":%.0f,"
+                "\"bytes_in\":%lld,\"records_out\":%lld,\"bytes_out\":%lld,"
+                "\"comparisons\":%lld,\"swaps\":%lld,\"max_rss_kb\":%ld,"
+                "\"major_faults\":%ld,\"minor_faults\":%ld}\n",
+                total, perf.records_in, rate, perf.bytes_in, perf.records_out, perf.bytes_out,
+                perf.comparisons, perf.swaps, maxrss, ru.ru_majflt, ru.ru_minflt);
+    }
+    fflush(stderr);
+}
+
+void stats_init(char *cmd) {
+    perf.cmd = cmd;
+    if (!stats) return;
+    perf.start = perf.wall0 = clock_seconds(CLOCK_MONOTONIC);
+    perf.cpu0 = clock_seconds(CLOCK_PROCESS_CPUTIME_ID);
+    atexit(stats_report);
+}
+
 char *get_line(FILE *file, char **buffer, size_t *len) {
 #ifdef __APPLE__
     *buffer = fgetln(file,len);
@@ -398,76 +652,20 @@ char *get_line(FILE *file, char **buffer, size_t *len) {
 #else
     size_t n;
     int r = getline(buffer,&n,file);
+    // a line cut short by a read error is not returned
+    dieif(ferror(file), "error reading line: %s\n", errstr);
     if (r != -1) {
         *len = strlen(*buffer);
         return *buffer;
     }
-    if (feof(file)) {
-        if (buffer) free(*buffer);
-        return *buffer = NULL;
-    } else if (ferror(file)) {
-        die("error reading line: %s\n", errstr);
-    }
+    if (buffer) free(*buffer);
+    return *buffer = NULL;
 #endif
 }
 
 void fwriten(const void *restrict ptr, size_t size, size_t n, FILE *restrict stream) {
     dieif(fwrite(ptr, size, n, stream) != n, "write error: %s\n", errstr);
-}
-
-void fwrite1(const void *restrict ptr, size_t size, FILE *restrict stream) {
-    fwriten(ptr, size, 1, stream);
-}
-
-void freadn(void *restrict ptr, size_t size, size_t n, FILE *restrict stream) {
-    size_t r = fread(ptr, size, n, stream);
-    if (r == n) return;
-    dieif(errno, "read error: %s\n", errstr);
-    exit(1); // die silently
-}
-
-void fread1(void *restrict ptr, size_t size, FILE *restrict stream) {
-    freadn(ptr, size, 1, stream);
-}
-
-typedef struct {
-    long long field_count;
-    field_spec_t *field_specs;
-} header_t;
-
-void write_header(FILE *file, long long n, field_spec_t *specs) {
-    fwrite1(&preamble, sizeof(preamble_t), file);
-    fwrite1(&n, sizeof(n), file);
-    fwriten(specs, sizeof(field_spec_t), n, file);
-}
-
-int string_fields;
-
-header_t read_header(FILE *file) {
-    char preamble_b[sizeof(preamble_t)];
-    fread1(preamble_b, sizeof(preamble_t), file);
-    dieif(memcmp(preamble_b, &preamble, sizeof(preamble_t)), "invalid odb file\n");
-
-    header_t h;
-    fread1(&h.field_count, sizeof(h.field_count), file);
-    h.field_specs = malloc(h.field_count*sizeof(field_spec_t));
-    freadn(h.field_specs, sizeof(field_spec_t), h.field_count, file);
-
-    string_fields = 0;
-    for (int i = 0; i < h.field_count; i++)
-        if (h.field_specs[i].type == STRING) string_fields++;
-
-    return h;
-}
-
-void free_header(header_t h) { free(h.field_specs); }
-
-int check_header(FILE *file, header_t hh) {
-    header_t h = read_header(file);
-    int match = hh.field_count == h.field_count &&
-        !memcmp(hh.field_specs, h.field_specs, h.field_count*sizeof(field_spec_t));
-    free_header(h);
-    return match;
+    perf.bytes_out += size*n;
 }
 
 int seekable(FILE *file) {
@@ -478,12 +676,16 @@ int seekable(FILE *file) {
 
 FILE **files = NULL;
 int *writable = NULL;
+odb_reader_t *inputs = NULL;
+odb_index_t *indexes = NULL;
 
 FILE *fopenr_arg(int argc, char **argv, int i, int try_write) {
     if (argc <= i) return NULL;
     if (!files) {
         files = calloc(argc+1, sizeof(FILE*));
         writable = calloc(argc+1, sizeof(int*));
+        inputs = calloc(argc+1, sizeof(odb_reader_t));
+        indexes = calloc(argc+1, sizeof(odb_index_t));
     }
     if (files[i]) {
         writable[i] &= try_write;
@@ -511,131 +713,714 @@ lock_and_return:
     return files[i];
 }
 
-header_t read_headers(int argc, char **argv, int w) {
-    header_t h;
-    FILE *file;
-    for (int i = 0; file = fopenr_arg(argc, argv, i, w); i++) {
-        if (i == 0) h = read_header(file);
-        else dieif(!check_header(file,h), "field spec mismatch: %s\n", argv[i]);
+// open argument i and read its header the first time it is opened
+// the index of data on fields a,b lives next to it in data.a,b.odx
+char *index_path(char *name, char *fields) {
+    char *path;
+    dieif(asprintf(&path, "%s.%s.odx", name, fields) < 0, "out of memory\n");
+    return path;
+}
+
+odb_reader_t *open_input(int argc, char **argv, int i, int try_write) {
+    FILE *file = fopenr_arg(argc, argv, i, try_write);
+    if (!file) return NULL;
+    odb_reader_t *r = &inputs[i];
+    if (!r->header.field_specs) {
+        int e = odb_reader_init(r, file);
+        if (e == ODB_ETRUNC) exit(1); // die silently
+        dieif(e, "error reading %s: %s\n", argv[i], odb_strerror(e));
+        perf.bytes_in += odb_header_size(&r->header);
+        if (strcmp(argv[i], "-")) {
+            e = odb_reader_set_runs(r, argv[i]);
+            dieif(e, "error reading runs of %s: %s\n", argv[i], odb_strerror(e));
+            dieif(r->runs && index_arg, "indexes cannot be used with sorted runs: %s\n", argv[i]);
+        }
+        if (index_arg) {
+            char *path = index_path(argv[i], index_arg);
+            e = odb_index_open(&indexes[i], path, r);
+            dieif(e == ODB_ESTREAM, "indexes cannot be used with streamed inputs\n");
+            dieif(e, "error opening %s: %s\n", path, odb_strerror(e));
+            odb_reader_set_index(r, &indexes[i]);
+            free(path);
+        }
     }
-    return h;
+    r->file = file;
+    return r;
+}
+
+odb_header_t read_headers(int argc, char **argv, int w) {
+    odb_reader_t *r;
+    for (int i = 0; r = open_input(argc, argv, i, w); i++)
+        dieif(i && !odb_header_equal(&inputs[0].header, &r->header),
+              "field spec mismatch: %s\n", argv[i]);
+    return inputs[0].header;
+}
+
+void close_input(odb_reader_t *r, char *name) {
+    odb_reader_readahead_stop(r);
+    dieif(fclose(r->file), "error closing %s: %s\n", name, errstr);
+}
+
+// files read through are read ahead asynchronously, and scans of more than
+// a quarter of memory bypass the page cache rather than evict everything else;
+// records is how many will be read, or -1 for the whole file
+void read_ahead(odb_reader_t *r, char *name, int inputs, long long records) {
+    long long total = odb_record_count(r);
+    if (records < 0 || total >= 0 && total < records) records = total;
+    long long memory = sysconf(_SC_PHYS_PAGES)/4*sysconf(_SC_PAGESIZE);
+    int flags = records > 0 && records > memory/(long long) r->record_size ? ODB_READAHEAD_DIRECT : 0;
+    int e = odb_reader_readahead(r, inputs, flags);
+    dieif(e, "error reading %s: %s\n", name, odb_strerror(e));
+}
+
+size_t read_batch(odb_reader_t *r, long long *records, size_t max, char *name) {
+    size_t n;
+    int e = odb_read_batch(r, records, max, &n);
+    dieif(e, "error reading %s: %s\n", name, odb_strerror(e));
+    perf.records_in += n;
+    perf.bytes_in += n*r->record_size;
+    return n;
 }
 
-size_t header_size(header_t h) {
-    return sizeof(preamble_t) +
-           sizeof(h.field_count) +
-           sizeof(field_spec_t) * h.field_count;
+void open_output(odb_writer_t *w, FILE *file, long long n, odb_field_spec_t *specs) {
+    odb_header_t h = {n, specs, version};
+    int e = odb_writer_init(w, file, &h);
+    dieif(e, "write error: %s\n", odb_strerror(e));
+    perf.bytes_out += odb_header_size(&h);
 }
 
-size_t h_size;
-static header_t h;
-int sort_n, *sort_order;
+void close_output(odb_writer_t *w, const odb_section_t *sections, int n) {
+    int e = odb_writer_finish(w, sections, n);
+    dieif(e, "write error: %s\n", odb_strerror(e));
+}
 
-#define data(j,k) data[(j)*h.field_count+(k)]
-#define dbl(v) reinterpret(double,v)
+void write_batch(odb_writer_t *w, long long *records, size_t n) {
+    int e = odb_write_batch(w, records, n);
+    dieif(e, "write error: %s\n", odb_strerror(e));
+    perf.records_out += n;
+    perf.bytes_out += n*w->field_count*sizeof(long long);
+}
 
-int lt_records(void *d, size_t a, size_t b) {
-    long long *data = (long long*) d;
-    for (int i = 0; i < sort_n; i++) {
-        int j = sort_order[i];
-        int r = j < 0;
-        j = abs(j)-1;
-        if (data(a,j) != data(b,j)) {
-            if (!floatlike(h.field_specs[j].type)) return r^(data(a,j) < data(b,j));
-            if (isnan(dbl(data(a,j))) && isnan(dbl(data(b,j)))) continue;
-            if (isnan(dbl(data(a,j)))) return r^1;
-            if (isnan(dbl(data(b,j)))) return r^0;
-            return r^(dbl(data(a,j)) < dbl(data(b,j)));
+// dictionaries are loaded once for all the fields that use them, and known
+// by their real paths since served commands each have their own directory
+typedef struct {
+    char *path;
+    struct stat st;
+    odb_strings_t strings;
+} dictionary_t;
+
+static dictionary_t **dictionaries = NULL;
+static int dictionary_count = 0;
+
+odb_strings_t *load_strings(const char *path) {
+    char *real = realpath(path, NULL);
+    const char *key = real ? real : path;
+    for (int i = 0; i < dictionary_count; i++) {
+        if (!strcmp(dictionaries[i]->path, key)) {
+            free(real);
+            return &dictionaries[i]->strings;
         }
     }
-    return 0;
+    phase_t p = perf.phase;
+    stats_phase(LOAD_STRINGS);
+    dictionary_t *d = malloc(sizeof(dictionary_t));
+    dictionaries = realloc(dictionaries, (dictionary_count + 1)*sizeof(dictionary_t*));
+    dieif(!d || !dictionaries || !(d->path = strdup(key)), "out of memory\n");
+    free(real);
+    int e = odb_strings_open(&d->strings, path);
+    dieif(e, "error loading %s: %s\n", path, odb_strerror(e));
+    dieif(stat(d->path, &d->st), "error loading %s: %s\n", path, errstr);
+    dictionaries[dictionary_count++] = d;
+    stats_phase(p);
+    return &d->strings;
 }
 
-void swap_records(void *d, size_t a, size_t b) {
-    long long *data = (long long*) d;
-    for (int i = 0; i < h.field_count; i++) {
-        if (data(a,i) != data(b,i)) {
-            long long t = data(a,i);
-            data(a,i) = data(b,i);
-            data(b,i) = t;
+// forget dictionaries that have been replaced or changed since they were loaded
+void refresh_strings() {
+    int n = 0;
+    for (int i = 0; i < dictionary_count; i++) {
+        dictionary_t *d = dictionaries[i];
+        struct stat st;
+        if (!stat(d->path, &st) && st.st_dev == d->st.st_dev && st.st_ino == d->st.st_ino &&
+            st.st_size == d->st.st_size && st.st_mtim.tv_sec == d->st.st_mtim.tv_sec &&
+            st.st_mtim.tv_nsec == d->st.st_mtim.tv_nsec) {
+            dictionaries[n++] = d;
+        } else {
+            odb_strings_close(&d->strings);
+            free(d->path);
+            free(d);
         }
     }
+    dictionary_count = n;
+}
+
+// fields that name no dictionary of their own use strings_file
+const char *field_dictionary(const odb_field_spec_t *spec) {
+    const char *path = odb_field_dictionary(spec);
+    return path ? path : strings_file;
+}
+
+odb_strings_t *field_strings(const odb_field_spec_t *spec) {
+    return load_strings(field_dictionary(spec));
+}
+
+// the dictionary of each string field of h, or NULL for other fields
+odb_strings_t **header_strings(odb_header_t h) {
+    odb_strings_t **strings = calloc(h.field_count, sizeof(odb_strings_t*));
+    dieif(!strings, "out of memory\n");
+    for (int j = 0; j < h.field_count; j++)
+        if (h.field_specs[j].type == ODB_STRING) strings[j] = field_strings(&h.field_specs[j]);
+    return strings;
+}
+
+long long string_to_index(odb_strings_t *strings, char *str, off_t len) {
+    long long index = odb_string_to_index(strings, str, len);
+    dieif(index < 0, "unexpected string: %.*s\n", (int) len, str);
+    return index;
 }
 
+// the string values of a batch of rows being encoded, copied as they are
+// parsed and looked up a field at a time once the batch is full
 typedef struct {
-    off_t *offsets;
-    off_t index;
     char *data;
-} cmph_state_t;
+    size_t size, used;
+    size_t *offsets, *lens;
+    const char **strs;
+    long long *indexes;
+} probes_t;
+
+void probes_init(probes_t *p, int n) {
+    p->size = 1 << 16;
+    p->used = 0;
+    p->data = malloc(p->size);
+    p->offsets = malloc(n*ODB_BATCH*sizeof(size_t));
+    p->lens = malloc(n*ODB_BATCH*sizeof(size_t));
+    p->strs = malloc(ODB_BATCH*sizeof(char*));
+    p->indexes = malloc(ODB_BATCH*sizeof(long long));
+    dieif(!p->data || !p->offsets || !p->lens || !p->strs || !p->indexes, "out of memory\n");
+}
+
+void probe_string(probes_t *p, int field, size_t row, const char *str, size_t len) {
+    if (p->used + len > p->size) {
+        p->size = MAX(2*p->size, p->used + len);
+        dieif(!(p->data = realloc(p->data, p->size)), "out of memory\n");
+    }
+    memcpy(p->data + p->used, str, len);
+    p->offsets[field*ODB_BATCH + row] = p->used;
+    p->lens[field*ODB_BATCH + row] = len;
+    p->used += len;
+}
+
+// fill in the string fields of the n rows of records
+void lookup_strings(probes_t *p, odb_strings_t **strings, int fields, long long *records, size_t n) {
+    for (int j = 0; j < fields; j++) {
+        if (!strings[j]) continue;
+        for (size_t r = 0; r < n; r++) p->strs[r] = p->data + p->offsets[j*ODB_BATCH + r];
+        odb_strings_lookup(strings[j], p->strs, p->lens + j*ODB_BATCH, n, p->indexes);
+        for (size_t r = 0; r < n; r++) {
+            dieif(p->indexes[r] < 0, "unexpected string: %.*s\n",
+                  (int) p->lens[j*ODB_BATCH + r], p->strs[r]);
+            records[r*fields + j] = p->indexes[r];
+        }
+    }
+    p->used = 0;
+}
+
+// count a parsed row, writing the batch once it is full
+size_t encode_row(probes_t *p, odb_strings_t **strings, int fields, long long *records, size_t rows,
+                  odb_writer_t *out) {
+    if (++rows < ODB_BATCH) return rows;
+    lookup_strings(p, strings, fields, records, rows);
+    write_batch(out, records, rows);
+    return 0;
+}
+
+const char *index_to_string(odb_strings_t *strings, long long index) {
+    const char *str = odb_index_to_string(strings, index);
+    dieif(!str, "invalid string index: %lld\n", index);
+    return str;
+}
 
-static int key_read(void *state, char **key, cmph_uint32 *len) {
-    cmph_state_t *s = (cmph_state_t*) state;
-    *key = s->data + s->offsets[s->index++];
-    return *len = strlen(*key);
+// whether the footer of an input says it is sorted by s or by more keys
+// starting with those of s
+int sorted_by(odb_reader_t *in, char *name, odb_sort_t *s) {
+    long long *order;
+    size_t size;
+    int e = odb_read_footer(in, ODB_FOOTER_SORT, (void**) &order, &size);
+    if (e == ODB_ESTREAM) return 0;
+    dieif(e, "error reading footer of %s: %s\n", name, odb_strerror(e));
+    int sorted = order && size >= s->n*sizeof(long long);
+    for (int k = 0; sorted && k < s->n; k++) sorted = order[k] == s->order[k];
+    free(order);
+    return sorted;
 }
-static void key_rewind(void *state) {
-    cmph_state_t *s = (cmph_state_t*) state;
-    s->index = 0;
+
+// the sort order of s as a footer section
+odb_section_t sort_section(odb_sort_t *s) {
+    long long *order = malloc(s->n*sizeof(long long));
+    dieif(!order, "out of memory\n");
+    for (int k = 0; k < s->n; k++) order[k] = s->order[k];
+    odb_section_t section = {ODB_FOOTER_SORT, s->n*sizeof(long long), order};
+    return section;
 }
-static void key_dispose(void *state, char *key, cmph_uint32 len) { }
 
-void ff_align(FILE *file, size_t unit) {
-    dieif(fseeko(file, unit*(ftello(file)/unit+1), SEEK_SET), "seek error: %s\n", errstr);
+#define COMPACT_FANIN 4
+
+// runs fall into tiers of sizes growing by a factor of COMPACT_FANIN; the
+// smallest tier holding COMPACT_FANIN or more runs is merged, or none (-1);
+// runs that are gone get tier -1
+int full_tier(char **runs, int n, int *tier) {
+    int t = -1;
+    for (int i = 0; i < n; i++) {
+        struct stat fs;
+        int r = stat(runs[i], &fs);
+        tier[i] = -1;
+        if (r && errno == ENOENT) continue;
+        dieif(r, "error reading %s: %s\n", runs[i], errstr);
+        tier[i] = fs.st_size > 1 ? (int) (log(fs.st_size)/log(COMPACT_FANIN)) : 0;
+    }
+    for (int i = 0; i < n; i++) {
+        int c = 0;
+        if (tier[i] < 0) continue;
+        for (int j = 0; j < n; j++) c += tier[j] == tier[i];
+        if (c >= COMPACT_FANIN && (t < 0 || tier[i] < t)) t = tier[i];
+    }
+    return t;
 }
 
-off_t string_count;
-char *string_data;
-off_t *string_offsets;
-off_t *string_reverse;
-cmph_t *string_hash;
-off_t string_maxlen;
+// a rename is only durable once the directory holding it is synced
+void sync_dir(char *name) {
+    char *dir = strdup(name);
+    dieif(!dir, "out of memory\n");
+    int d = open(dirname(dir), O_RDONLY | O_DIRECTORY);
+    dieif(d < 0 || fsync(d) || close(d), "error syncing the directory of %s: %s\n", name, errstr);
+    free(dir);
+}
 
-void load_strings() {
+// sort a copy of a file next to it and rename the copy into place, so
+// readers of the original are never blocked and a crash leaves one of the
+// two versions whole; the copy is returned positioned at its records
+FILE *sort_copy(odb_reader_t *in, char *name, odb_sort_t *s) {
     struct stat fs;
-    FILE *strings = fopen(strings_file, "r");
-    dieif(!strings, "error opening %s: %s\n", strings_file, errstr);
-    dieif(fstat(fileno(strings), &fs), "stat error for %s: %s\n", strings_file, errstr);
-    char *data = mmap(
-        NULL,
-        fs.st_size,
-        PROT_READ,
-        MAP_PRIVATE,
-        fileno(strings),
-        0
-    );
-    dieif(data == MAP_FAILED, "mmap failed for %s: %s\n", strings_file, errstr);
-    off_t *offsets = (off_t*) data;
-    off_t i = fs.st_size/sizeof(off_t);
-    string_count = offsets[--i];
-    string_data = data + offsets[--i];
-    string_offsets = (off_t*)(data + offsets[--i]);
-    string_reverse = (off_t*)(data + offsets[--i]);
-    dieif(fseeko(strings, offsets[--i], SEEK_SET), "seek error in %s: %s", strings_file, errstr);
-    string_hash = cmph_load(strings);
-    dieif(fseeko(strings, 0, SEEK_SET), "seek error in %s: %s", strings_file, errstr);
-    string_maxlen = offsets[--i];
-    dieif(!string_hash, "error loading string hash\n");
-    return;
-}
-
-long long string_to_index(char *str, off_t len) {
-    cmph_uint32 h = cmph_search(string_hash, str, len);
-    if (!(0 <= h && h < string_count)) goto unexpected;
-    off_t index = string_reverse[h];
-    off_t offset = string_offsets[index];
-    if (strncmp(str, string_data + offset, len)) goto unexpected;
-    return index;
-unexpected:
-    str[len] = '\0';
-    die("unexpected string: %s\n", str);
+    char *tmp;
+    dieif(fstat(fileno(in->file), &fs), "stat error for %s: %s\n", name, errstr);
+    dieif(asprintf(&tmp, "%s.XXXXXX", name) < 0, "out of memory\n");
+    int fd = mkstemp(tmp);
+    dieif(fd < 0, "error creating %s: %s\n", tmp, errstr);
+
+    stats_phase(COPY);
+    size_t size = 1 << 20;
+    char *buffer = malloc(size);
+    ssize_t n = 0;
+    for (off_t offset = 0; buffer && offset < fs.st_size; offset += n)
+        if ((n = pread(fileno(in->file), buffer, MIN(size, fs.st_size - offset), offset)) <= 0 ||
+            write(fd, buffer, n) != n && (n = -1))
+            break;
+    free(buffer);
+    stats_phase(SMOOTHSORT);
+    int e = n < 0 || !buffer ? ODB_EIO : odb_sort_file(s, fd);
+    stats_phase(OTHER);
+    if (e || fchmod(fd, fs.st_mode & 07777) || fsync(fd) || rename(tmp, name)) {
+        int saved = errno;
+        unlink(tmp);
+        errno = saved;
+        die("error sorting %s: %s\n", name, e ? odb_strerror(e) : errstr);
+    }
+    sync_dir(name);
+    free(tmp);
+    FILE *file = fdopen(fd, "r");
+    dieif(!file || fseeko(file, in->data_offset, SEEK_SET), "error reopening %s: %s\n", name, errstr);
+    return file;
 }
 
-char *index_to_string(long long index) {
-    dieif(!(0 <= index && index <= string_count),
-          "invalid string index: %lld\n", index);
-    char *str = string_data + string_offsets[index];
-    dieif(index && str[-1], "string index mismatch\n");
-    return str;
+// read a streamed input into anonymous memory and sort it there; if it
+// doesn't fit in sort_memory, return a temporary file holding it instead
+FILE *sort_stream(odb_reader_t *in, char *name, odb_sort_t *s) {
+    if (sort_memory < 0) sort_memory = sysconf(_SC_PHYS_PAGES)/2*sysconf(_SC_PAGESIZE);
+    size_t limit = sort_memory/in->record_size*in->record_size;
+    size_t size = 0, n;
+    char *buffer = NULL;
+    int e;
+    if (limit) {
+        buffer = mmap(
+            NULL,
+            limit,
+            PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+            -1,
+            0
+        );
+        dieif(buffer == MAP_FAILED, "mmap failed for %s: %s\n", name, errstr);
+#ifdef MADV_HUGEPAGE
+        madvise(buffer, limit, MADV_HUGEPAGE);
+#endif
+    }
+    while (size < limit) {
+        e = odb_read_batch(in, (long long*)(buffer + size), (limit - size)/in->record_size, &n);
+        dieif(e, "error reading %s: %s\n", name, odb_strerror(e));
+        if (!n) break;
+        size += n*in->record_size;
+    }
+    long long *record = malloc(in->record_size);
+    e = odb_read_batch(in, record, 1, &n);
+    dieif(e, "error reading %s: %s\n", name, odb_strerror(e));
+    if (!n) {
+        free(record);
+        stats_phase(SMOOTHSORT);
+        odb_sort_records(s, (long long*) buffer, size/in->record_size);
+        odb_reader_set_buffer(in, (long long*) buffer, size/in->record_size);
+        return NULL;
+    }
+
+    // too big for memory: spill what we have and copy the rest to disk
+    odb_writer_t tmp;
+    FILE *file = tmpfile();
+    dieif(!file, "error creating temporary file: %s\n", errstr);
+    open_output(&tmp, file, in->header.field_count, in->header.field_specs);
+    off_t data_offset = ftello(file);
+    dieif(e = odb_write_batch(&tmp, (long long*) buffer, size/in->record_size),
+          "write error: %s\n", odb_strerror(e));
+    if (buffer) munmap(buffer, limit);
+    record = realloc(record, ODB_BATCH*in->record_size);
+    do {
+        dieif(e = odb_write_batch(&tmp, record, n), "write error: %s\n", odb_strerror(e));
+        e = odb_read_batch(in, record, ODB_BATCH, &n);
+        dieif(e, "error reading %s: %s\n", name, odb_strerror(e));
+    } while (n);
+    free(record);
+    dieif(fseeko(file, data_offset, SEEK_SET), "seek error: %s", errstr);
+    // the records are read again from the start of the copy
+    in->records = 0;
+    return file;
+}
+
+// copy bytes start to end of an input file to out unchanged
+void copy_bytes(odb_reader_t *in, char *name, off_t start, off_t end, FILE *out) {
+    char buffer[1 << 16];
+    for (ssize_t n; start < end; start += n) {
+        n = pread(fileno(in->file), buffer, MIN(sizeof(buffer), end - start), start);
+        dieif(n < 0, "error reading %s: %s\n", name, errstr);
+        dieif(!n, "error reading %s: %s\n", name, odb_strerror(ODB_ETRUNC));
+        fwriten(buffer, 1, n, out);
+    }
+}
+
+// the lines given to odb strings, held in one buffer in input order
+typedef struct {
+    const unsigned char *str;
+    size_t len;
+} line_t;
+
+typedef struct {
+    line_t *lines;
+    size_t n;
+} lines_t;
+
+// lines sharing their first depth bytes, in byte order, shorter ones first
+int line_cmp(const line_t *a, const line_t *b, size_t depth) {
+    int c = memcmp(a->str + depth, b->str + depth, MIN(a->len, b->len) - depth);
+    return c ? c : (a->len > b->len) - (a->len < b->len);
+}
+
+// the byte of a line at depth, or 0 past its end
+#define line_at(l, depth) ((depth) < (l)->len ? (l)->str[depth] + 1 : 0)
+
+// multikey quicksort: lines are split three ways by the byte at depth, and
+// the middle part goes on to the next byte, so common prefixes are compared
+// once per partitioning rather than once per comparison
+void sort_lines(line_t *a, size_t n, size_t depth) {
+    while (n > 16) {
+        int x = line_at(&a[0], depth), y = line_at(&a[n/2], depth), z = line_at(&a[n-1], depth);
+        int v = x < y ? (y < z ? y : x < z ? z : x) : (x < z ? x : y < z ? z : y);
+        size_t lt = 0, i = 0, gt = n;
+        while (i < gt) {
+            int c = line_at(&a[i], depth);
+            line_t t = a[i];
+            if (c < v) {
+                a[i++] = a[lt];
+                a[lt++] = t;
+            } else if (c > v) {
+                a[i] = a[--gt];
+                a[gt] = t;
+            } else {
+                i++;
+            }
+        }
+        sort_lines(a, lt, depth);
+        sort_lines(a + gt, n - gt, depth);
+        if (!v) return;
+        a += lt;
+        n = gt - lt;
+        depth++;
+    }
+    for (size_t i = 1; i < n; i++) {
+        line_t t = a[i];
+        size_t j = i;
+        for (; j && line_cmp(&a[j-1], &t, depth) > 0; j--) a[j] = a[j-1];
+        a[j] = t;
+    }
+}
+
+// each thread sorts a run of the lines and drops its duplicates
+void *sort_lines_thread(void *arg) {
+    lines_t *run = arg;
+    sort_lines(run->lines, run->n, 0);
+    size_t k = 0;
+    for (size_t i = 0; i < run->n; i++)
+        if (!k || line_cmp(&run->lines[k-1], &run->lines[i], 0)) run->lines[k++] = run->lines[i];
+    run->n = k;
+    return NULL;
+}
+
+#define run_less(a, b) (line_cmp(runs[a].lines, runs[b].lines, 0) < 0)
+
+void sift_runs(lines_t *runs, int *heap, int n, int i) {
+    for (int child; (child = 2*i + 1) < n; i = child) {
+        if (child + 1 < n && run_less(heap[child+1], heap[child])) child++;
+        if (!run_less(heap[child], heap[i])) break;
+        int t = heap[i];
+        heap[i] = heap[child];
+        heap[child] = t;
+    }
+}
+
+// build a dictionary from lines in any order, duplicates included: the whole
+// input is read, sorted in runs by -j threads, and the runs merged through a
+// heap into the writer, which hashes the dictionary in partitions, as many at
+// once as there are threads
+void build_strings(int argc, char **argv) {
+    unsigned char *data = NULL;
+    size_t size = 0, used = 0, n = 0, allocated = 0;
+    line_t *lines = NULL;
+
+    stats_phase(PARSE);
+    FILE *file;
+    for (int i = 0; file = fopenr_arg(argc, argv, i, 0); i++) {
+        size_t start = used;
+        for (size_t got = 1; got;) {
+            if (size - used < 1 << 20) {
+                size = MAX(2*size, used + (1 << 20));
+                dieif(!(data = realloc(data, size)), "out of memory\n");
+            }
+            got = fread(data + used, 1, size - used - 1, file);
+            used += got;
+        }
+        dieif(ferror(file), "error reading %s: %s\n", argv[i], errstr);
+        dieif(fclose(file), "error closing %s: %s\n", argv[i], errstr);
+        // a last string without its end (a newline, or a NUL with -0) gets one
+        if (used > start && data[used-1] != string_end) data[used++] = string_end;
+        perf.bytes_in += used - start;
+        for (unsigned char *p = data + start, *end = data + used; p < end;) {
+            unsigned char *nl = memchr(p, string_end, end - p);
+            if (n == allocated) {
+                allocated = MAX(2*allocated, 4096);
+                dieif(!(lines = realloc(lines, allocated*sizeof(line_t))), "out of memory\n");
+            }
+            // strings end at their first NUL, as they are decoded
+            lines[n].str = (unsigned char*) (p - data);
+            lines[n++].len = strnlen((char*) p, nl - p);
+            p = nl + 1;
+        }
+    }
+    perf.records_in = n;
+    for (size_t i = 0; i < n; i++) lines[i].str = data + (size_t) lines[i].str;
+
+    stats_phase(STRING_SORT);
+    int t = MAX(1, MIN(jobs, n/65536));
+    lines_t runs[t];
+    pthread_t threads[t];
+    for (int i = 0; i < t; i++) {
+        runs[i].lines = lines + i*n/t;
+        runs[i].n = (i+1)*n/t - i*n/t;
+        dieif(i && pthread_create(&threads[i], NULL, sort_lines_thread, &runs[i]),
+              "error creating thread: %s\n", errstr);
+    }
+    sort_lines_thread(&runs[0]);
+    for (int i = 1; i < t; i++) pthread_join(threads[i], NULL);
+
+    stats_phase(MERGE);
+    FILE *out = fopen(strings_file, "w+");
+    dieif(!out, "error opening %s: %s\n", strings_file, errstr);
+    odb_strings_writer_t w;
+    int e = odb_strings_writer_init(&w, out);
+    dieif(e, "error writing %s: %s\n", strings_file, odb_strerror(e));
+    w.threads = jobs;
+    int heap[t], k = 0;
+    for (int i = 0; i < t; i++)
+        if (runs[i].n) heap[k++] = i;
+    for (int i = k/2 - 1; i >= 0; i--) sift_runs(runs, heap, k, i);
+    const line_t *last = NULL;
+    while (k) {
+        lines_t *run = &runs[heap[0]];
+        if (!last || line_cmp(last, run->lines, 0)) {
+            last = run->lines;
+            e = odb_strings_add(&w, (const char*) last->str, last->len);
+            dieif(e, "error writing %s: %s\n", strings_file, odb_strerror(e));
+        }
+        run->lines++;
+        if (!--run->n) heap[0] = heap[--k];
+        sift_runs(runs, heap, k, 0);
+    }
+    free(lines);
+    free(data);
+
+    stats_phase(OUTPUT);
+    e = odb_strings_finish(&w);
+    dieif(e, "error writing %s: %s\n", strings_file, odb_strerror(e));
+    dieif(fclose(out), "error closing %s: %s\n", strings_file, errstr);
+}
+
+// the new index of a used string: the number of used strings before it
+#define compacted(x) (before[(x) >> 6] + __builtin_popcountll(used[(x) >> 6] & ((1ULL << ((x) & 63)) - 1)))
+
+// the string fields using strings_file, rather than a dictionary of their own
+// fields using the dictionary given by -s, whether by default or by name
+#define compacted_field(spec) ((spec)->type == ODB_STRING && !strcmp(field_dictionary(spec), strings_file))
+
+// write a new dictionary holding only the strings used by the given files,
+// and rewrite their string fields to match; strings keep their order, so sort
+// orders stay valid, but indexes go stale and bloom filters are refused until
+// they are rebuilt. the old dictionary is left to files that weren't listed
+void compact_strings(int argc, char **argv) {
+    dieif(!argc || !compact_arg, "usage: odb strings --compact=<new file> <file> ...\n");
+    struct stat old, new;
+    dieif(!stat(strings_file, &old) && !stat(compact_arg, &new) &&
+          old.st_dev == new.st_dev && old.st_ino == new.st_ino,
+          "the compacted dictionary must be a new file, as files not listed may use %s\n", strings_file);
+    odb_strings_t *strings = load_strings(strings_file);
+    off_t words = (strings->count + 63)/64;
+    unsigned long long *used = calloc(words, sizeof(long long));
+    off_t *before = malloc(words*sizeof(off_t));
+    odb_reader_t *in = calloc(argc, sizeof(odb_reader_t));
+    off_t *end = calloc(argc, sizeof(off_t));
+    char **tmp = calloc(argc + 1, sizeof(char*));
+    long long *records = NULL;
+    dieif(!used || !before || !in || !end || !tmp, "out of memory\n");
+
+    // mark the strings in use, keeping every file open and share-locked
+    stats_phase(SCAN);
+    for (int i = 0; i < argc; i++) {
+        dieif(!strcmp(argv[i], "-"), "streamed inputs cannot be compacted\n");
+        int e = odb_open(&in[i], argv[i]);
+        dieif(e, "error reading %s: %s\n", argv[i], odb_strerror(e));
+        dieif(!in[i].seekable, "%s is not a file\n", argv[i]);
+        odb_header_t *h = &in[i].header;
+        records = realloc(records, ODB_BATCH*in[i].record_size);
+        dieif(!records, "out of memory\n");
+        size_t n;
+        while (n = read_batch(&in[i], records, ODB_BATCH, argv[i])) {
+            for (int j = 0; j < h->field_count; j++) {
+                if (!compacted_field(&h->field_specs[j])) continue;
+                for (long long *x = records + j; x < records + n*h->field_count; x += h->field_count) {
+                    dieif(*x < 0 || *x >= strings->count, "invalid string index in %s: %lld\n", argv[i], *x);
+                    used[*x >> 6] |= 1ULL << (*x & 63);
+                }
+            }
+        }
+        end[i] = in[i].data_offset + in[i].records*in[i].record_size;
+    }
+
+    // sorted runs are merged into reads of their target, so are compacted with it
+    struct stat *files = malloc(argc*sizeof(struct stat));
+    dieif(!files, "out of memory\n");
+    for (int i = 0; i < argc; i++)
+        dieif(fstat(fileno(in[i].file), &files[i]), "stat error for %s: %s\n", argv[i], errstr);
+    for (int i = 0; i < argc; i++) {
+        char *fields, **runs;
+        int n, e = odb_runs_list(argv[i], &fields, &runs, &n);
+        if (e == ODB_EIO && errno == ENOENT) continue;
+        dieif(e, "error reading runs of %s: %s\n", argv[i], odb_strerror(e));
+        for (int j = 0; j < n; j++) {
+            struct stat st;
+            int k = 0;
+            dieif(stat(runs[j], &st), "stat error for %s: %s\n", runs[j], errstr);
+            while (k < argc && (files[k].st_dev != st.st_dev || files[k].st_ino != st.st_ino)) k++;
+            dieif(k == argc, "run %s of %s must be compacted with it\n", runs[j], argv[i]);
+        }
+        odb_runs_free(fields, runs, n);
+    }
+    free(files);
+
+    stats_phase(OUTPUT);
+    char *target = compact_arg;
+    dieif(asprintf(&tmp[argc], "%s.XXXXXX", target) < 0, "out of memory\n");
+    int fd = mkstemp(tmp[argc]);
+    FILE *out = fd < 0 ? NULL : fdopen(fd, "w+");
+    dieif(!out, "error creating %s: %s\n", tmp[argc], errstr);
+    odb_strings_writer_t w;
+    int e = odb_strings_writer_init(&w, out);
+    off_t count = 0;
+    for (off_t i = 0; !e && i < words; i++) {
+        before[i] = count;
+        count += __builtin_popcountll(used[i]);
+        for (unsigned long long b = used[i]; !e && b; b &= b - 1) {
+            const char *str = index_to_string(strings, 64*i + __builtin_ctzll(b));
+            e = odb_strings_add(&w, str, strlen(str));
+        }
+    }
+    if (!e) e = odb_strings_finish(&w);
+    dieif(e == ODB_EEMPTY, "no strings are used by the files\n");
+    dieif(e, "error writing %s: %s\n", tmp[argc], odb_strerror(e));
+    dieif(fchmod(fd, 0644) || fflush(out) || fsync(fd) || fclose(out),
+          "error writing %s: %s\n", tmp[argc], errstr);
+
+    // copies of the files with their string fields remapped go next to them,
+    // and those fields name the new dictionary, so readers need no -s; names
+    // take up the same space whatever they hold, so the records don't move
+    stats_phase(COPY);
+    for (int i = 0; i < argc; i++) {
+        struct stat fs;
+        odb_header_t *h = &in[i].header, stamped = *h;
+        dieif(fstat(fileno(in[i].file), &fs), "stat error for %s: %s\n", argv[i], errstr);
+        dieif(asprintf(&tmp[i], "%s.XXXXXX", argv[i]) < 0, "out of memory\n");
+        fd = mkstemp(tmp[i]);
+        out = fd < 0 ? NULL : fdopen(fd, "w");
+        dieif(!out, "error creating %s: %s\n", tmp[i], errstr);
+        stamped.field_specs = malloc(h->field_count*sizeof(odb_field_spec_t));
+        dieif(!stamped.field_specs, "out of memory\n");
+        memcpy(stamped.field_specs, h->field_specs, h->field_count*sizeof(odb_field_spec_t));
+        for (int j = 0; j < h->field_count; j++)
+            if (compacted_field(&h->field_specs[j]))
+                dieif(odb_field_set_dictionary(&stamped.field_specs[j], target),
+                      "field name and dictionary path too long: %s\n", h->field_specs[j].name);
+        dieif(odb_write_header(out, &stamped), "error writing %s: %s\n", tmp[i], errstr);
+        free(stamped.field_specs);
+        dieif(fseeko(in[i].file, in[i].data_offset, SEEK_SET), "seek error for %s: %s\n", argv[i], errstr);
+        in[i].records = 0;
+        records = realloc(records, ODB_BATCH*in[i].record_size);
+        size_t n;
+        while (n = read_batch(&in[i], records, ODB_BATCH, argv[i])) {
+            for (int j = 0; j < h->field_count; j++)
+                if (compacted_field(&h->field_specs[j]))
+                    for (long long *x = records + j; x < records + n*h->field_count; x += h->field_count)
+                        *x = compacted(*x);
+            fwriten(records, in[i].record_size, n, out);
+            perf.records_out += n;
+        }
+        // footers only hold sort orders, which are unchanged
+        copy_bytes(&in[i], argv[i], end[i], fs.st_size, out);
+        dieif(fchmod(fd, fs.st_mode & 07777) || fflush(out) || fsync(fd) || fclose(out),
+              "error writing %s: %s\n", tmp[i], errstr);
+    }
+
+    // once all are written, the new dictionary, which nothing reads yet, is
+    // renamed into place before the files that name it
+    stats_phase(OTHER);
+    dieif(rename(tmp[argc], target), "error renaming %s: %s\n", tmp[argc], errstr);
+    sync_dir(target);
+    for (int i = 0; i < argc; i++) {
+        dieif(rename(tmp[i], argv[i]), "error renaming %s: %s\n", tmp[i], errstr);
+        sync_dir(argv[i]);
+        dieif(odb_close(&in[i]), "error closing %s: %s\n", argv[i], errstr);
+    }
+    printf("%s\n", target);
+    for (int i = 0; i <= argc; i++) free(tmp[i]);
+    free(tmp);
+    free(end);
+    free(in);
+    free(records);
+    free(before);
+    free(used);
 }
 
 pid_t fork_child(int redirect_stderr) {
@@ -658,6 +1443,7 @@ pid_t fork_child(int redirect_stderr) {
 }
 
 void wait_child() {
+    stats_report();
     dieif(fflush(stdout), "fflush error: %s\n", errstr);
     dieif(fflush(stderr), "fflush error: %s\n", errstr);
     dieif(fclose(stdout), "close failed: %s\n", errstr);
@@ -672,225 +1458,1717 @@ size_t strcnt(char *str, char c) {
     return n;
 }
 
-char *timelikefmt(field_type_t t) {
+char *timelikefmt(odb_type_t t) {
     switch (t) {
-        case TIMESTAMP: return timestamp_fmt;
-        case DATE:      return date_fmt;
+        case ODB_TIMESTAMP: return timestamp_fmt;
+        case ODB_DATE:      return date_fmt;
     }
-    die("type %s is not time-like\n", typestr(t));
+    die("type %s is not time-like\n", odb_type_name(t));
 }
 
-void type_as_float(field_type_t type, field_spec_t *specs, size_t n) {
-    for (int i = 0; i < n; i++)
-        if (specs[i].type == type) specs[i].type = FLOAT;
+// the value of a CSV field, which has to be all of it
+long long parse_csv_value(odb_type_t type, char *field, size_t len) {
+    char *p = field;
+    double v;
+    switch (type) {
+        case ODB_INTEGER: {
+            long long i = parse_ll(&p);
+            dieif(p != field + len, "invalid integer: %s\n", field);
+            return i;
+        }
+        case ODB_FLOAT: {
+            v = parse_d(&p);
+            break;
+        }
+        case ODB_TIMESTAMP:
+        case ODB_DATE: {
+            struct tm st = {0};
+            p = strptime(field, timelikefmt(type), &st);
+            dieif(!p, "invalid timestamp: %s\n", field);
+            v = (double) timegm(&st);
+            break;
+        }
+        default:
+            die("encoding type %s not yet implemented\n", odb_type_name(type));
+    }
+    dieif(p != field + len, "invalid %s: %s\n", odb_type_name(type), field);
+    return reinterpret(long long,v);
 }
 
-#define pipe_to_print(cmd) ((cmd) == ENCODE && !extract || \
-                            (cmd) == CAT || cmd == PASTE || \
-                            (cmd) == SORT && !quiet)
-
-int main(int argc, char **argv) {
-    parse_opts(&argc,&argv);
-    dieif(argc < 1, "usage: %s\n", usage);
-
-    cmd_t cmd = parse_cmd(argv[0]);
-    argv++; argc--;
+void type_as_float(odb_type_t type, odb_field_spec_t *specs, size_t n) {
+    for (int i = 0; i < n; i++)
+        if (specs[i].type == type) specs[i].type = ODB_FLOAT;
+}
 
-    int is_tty = tty < 0 ? 0 : tty || isatty(fileno(stdout));
-    if (is_tty && pipe_to_print(cmd) && !fork_child(0)) {
-        argc = 0;
-        cmd = PRINT;
+cut_t *parse_cuts(odb_header_t h, char *fields, int *n) {
+    cut_t *cut;
+    if (!fields) {
+        *n = h.field_count;
+        cut = malloc(*n*sizeof(cut_t));
+        for (int i = 0; i < h.field_count; i++) {
+            cut[i].field_spec = h.field_specs[i];
+            cut[i].from = i;
+        }
+        return cut;
     }
-    if (!argc) {
-        argc = 1;
-        argv[0] = "-";
+    *n = strcnt(fields, ',') + 1;
+    cut = malloc(*n*sizeof(cut_t));
+    for (int i = 0; i < *n; i++) {
+        char *comma = strchr(fields, ',');
+        if (comma) *comma = '\0';
+        cut_spec_t c = parse_cut_spec(fields);
+        cut[i].from = odb_field_index(&h, c.from_name);
+        dieif(cut[i].from == -1, "invalid field cut: %s\n", fields);
+        odb_field_spec_t *from = &h.field_specs[cut[i].from];
+        memcpy(cut[i].field_spec.name, c.to_name, ODB_NAME_SIZE);
+        cut[i].field_spec.type = c.to_type != ODB_UNSPECIFIED ? c.to_type : from->type;
+        // renamed string fields keep their dictionary
+        dieif(cut[i].field_spec.type == ODB_STRING &&
+              odb_field_set_dictionary(&cut[i].field_spec, odb_field_dictionary(from)),
+              "field name and dictionary too long: %s\n", fields);
+        fields = comma + 1;
     }
-    if (cmd == PRINT) {
-        cmd = DECODE;
-        codec = TABLE;
+    return cut;
+}
+
+typedef struct {
+    odb_header_t h;
+    char *pre, *inter, *post;
+    char *integer_format, *float_format, *string_format, *time_format;
+    odb_strings_t **strings;
+    int *widths;
+    char *row;
+    size_t row_size;
+} decoder_t;
+
+void decode_init(decoder_t *d, odb_header_t h) {
+    d->h.field_count = h.field_count;
+    d->h.field_specs = malloc(h.field_count*sizeof(odb_field_spec_t));
+    memcpy(d->h.field_specs, h.field_specs, h.field_count*sizeof(odb_field_spec_t));
+    d->strings = header_strings(h);
+    d->widths = calloc(h.field_count, sizeof(int));
+    for (int j = 0; j < h.field_count; j++)
+        if (codec == TABLE && d->strings[j]) d->widths[j] = d->strings[j]->maxlen;
+
+    if (!timestamp_fmt)
+        type_as_float(ODB_TIMESTAMP, d->h.field_specs, h.field_count);
+    if (!date_fmt)
+        type_as_float(ODB_DATE, d->h.field_specs, h.field_count);
+    dieif(binary && codec != PSQL, "binary output requires PostgreSQL mode (-P)\n");
+
+    switch (codec) {
+        case DELIMITED:
+        case PSQL: {
+            d->pre = print_line_numbers ? "%lld" : "";
+            d->inter = delim;
+            d->post = "\n";
+            d->integer_format = "%lld";
+            asprintf(&d->float_format, "%%.6%c", float_format_char);
+            d->string_format = "%*s";
+            d->time_format = "%s";
+            break;
+        }
+        case CSV: {
+            d->pre = print_line_numbers ? "%lld%s" : "";
+            d->inter = delim;
+            d->post = "\n";
+            d->integer_format = "%lld";
+            asprintf(&d->float_format, "%%.6%c", float_format_char);
+            break;
+        }
+        case TABLE: {
+            d->pre = print_line_numbers ? "%8lld:    " : " ";
+            d->inter = " ";
+            d->post = "\n";
+            d->integer_format = "%20lld";
+            asprintf(&d->float_format, "%%20.6%c", float_format_char);
+            d->string_format = "%-*s";
+            d->time_format = "%20s";
+            break;
+        }
+        case ARROW: break;
+        case MYSQL: die("MySQL decoding not yet supported\n");
+        default: die("unsupported codec\n");
     }
+}
 
-    switch (cmd) {
+// PGCOPY binary rows: big-endian field count, then length-prefixed values;
+// timestamps are microseconds and dates days since 2000-01-01
+#define PG_EPOCH 946684800LL
 
-        case STRINGS: {
-            off_t strings_off, offsets_off, reverse_off, cmph_off, maxlen = 0;
+char *put_be(char *p, unsigned long long v, int bytes) {
+    while (bytes--) *p++ = v >> 8*bytes;
+    return p;
+}
 
-            FILE *strings = fopen(strings_file, "w+");
-            dieif(!strings, "error opening %s: %s\n", strings_file, errstr);
-            strings_off = ftello(strings);
+// arrow streams carry the schema themselves, so each input has its own;
+// their strings are all looked up in strings_file, loaded on first use
+long long arrow_intern(void *ctx, const char *str, size_t len) {
+    odb_strings_t **strings = ctx;
+    if (!extract && !*strings) *strings = load_strings(strings_file);
+    if (!extract) return string_to_index(*strings, (char*) str, len);
+    fwriten(str, 1, len, stdout);
+    putchar(string_end);
+    return 0;
+}
 
-            off_t n = 0;
-            off_t allocated = 4096;
-            off_t *offsets = malloc(allocated*sizeof(off_t));
+void encode_arrow(int argc, char **argv) {
+    FILE *file;
+    odb_header_t h = {0};
+    odb_writer_t out;
+    odb_strings_t *strings = NULL;
+    long long *records = NULL;
+    for (int i = 0; file = fopenr_arg(argc, argv, i, 0); i++) {
+        arrow_reader_t r;
+        int e = arrow_reader_init(&r, file, arrow_intern, &strings);
+        dieif(e, "error reading %s: %s\n", argv[i], odb_strerror(e));
+        if (!records) {
+            h.field_count = r.header.field_count;
+            h.field_specs = malloc(h.field_count*sizeof(odb_field_spec_t));
+            memcpy(h.field_specs, r.header.field_specs, h.field_count*sizeof(odb_field_spec_t));
+            records = malloc(ODB_BATCH*odb_record_size(&h));
+            if (!extract) {
+                stats_phase(HEADER);
+                open_output(&out, stdout, h.field_count, h.field_specs);
+            }
+            stats_phase(PARSE);
+        }
+        dieif(!odb_header_equal(&h, &r.header), "field spec mismatch: %s\n", argv[i]);
+        size_t n;
+        while (!(e = arrow_read_batch(&r, records, ODB_BATCH, &n)) && n) {
+            perf.records_in += n;
+            if (!extract) write_batch(&out, records, n);
+        }
+        dieif(e, "error reading %s: %s\n", argv[i], odb_strerror(e));
+        arrow_reader_free(&r);
+        dieif(fclose(file), "error closing %s: %s\n", argv[i], errstr);
+    }
+    if (records && !extract) close_output(&out, NULL, 0);
+}
 
-            FILE *file;
-            char *last = NULL;
-            for (int i = 0; file = fopenr_arg(argc, argv, i, 0); i++) {
-                size_t length;
-                char *line, *buffer = NULL;
-                while (line = get_line(file, &buffer, &length)) {
-                    char *nl = strchr(line, '\n');
-                    if (nl) *nl = '\0';
-                    dieif(last && !strcmp(last, line), "strings not unique: %s\n", last);
-                    free(last); last = strdup(line);
-                    if (allocated <= n) {
-                        allocated *= 2;
-                        offsets = realloc(offsets, allocated*sizeof(off_t));
+void decode_binary(decoder_t *d, long long *records, size_t n) {
+    odb_header_t h = d->h;
+    for (long long *record = records; record < records + n*h.field_count; record += h.field_count) {
+        size_t size = 2 + 12*h.field_count;
+        for (int j = 0; j < h.field_count; j++)
+            if (h.field_specs[j].type == ODB_STRING)
+                size += strlen(index_to_string(d->strings[j], record[j]));
+        if (d->row_size < size) d->row = realloc(d->row, d->row_size = 2*size);
+        char *p = put_be(d->row, h.field_count, 2);
+        for (int j = 0; j < h.field_count; j++) {
+            switch (h.field_specs[j].type) {
+                case ODB_INTEGER:
+                case ODB_FLOAT: {
+                    p = put_be(p, 8, 4);
+                    p = put_be(p, record[j], 8);
+                    break;
+                }
+                case ODB_STRING: {
+                    const char *str = index_to_string(d->strings[j], record[j]);
+                    size_t len = strlen(str);
+                    p = put_be(p, len, 4);
+                    memcpy(p, str, len);
+                    p += len;
+                    break;
+                }
+                // times that are NaN, infinite or out of range are NULL
+                case ODB_TIMESTAMP: {
+                    double us = round((reinterpret(double,record[j]) - PG_EPOCH)*1e6);
+                    if (!(fabs(us) < 0x1p63)) {
+                        p = put_be(p, -1, 4);
+                        break;
                     }
-                    offsets[n++] = ftello(strings);
-                    off_t len = strlen(line);
-                    if (maxlen < len) maxlen = len;
-                    fwrite1(line, len+1, strings);
+                    p = put_be(p, 8, 4);
+                    p = put_be(p, (long long) us, 8);
+                    break;
+                }
+                case ODB_DATE: {
+                    double days = floor((reinterpret(double,record[j]) - PG_EPOCH)/86400);
+                    if (!(fabs(days) <= INT32_MAX)) {
+                        p = put_be(p, -1, 4);
+                        break;
+                    }
+                    p = put_be(p, 4, 4);
+                    p = put_be(p, (long long) days, 4);
+                    break;
                 }
-                dieif(fclose(file), "error closing %s: %s\n", argv[i], errstr);
-            }
-            dieif(!n, "no strings provided\n");
-            offsets = realloc(offsets, n*sizeof(off_t));
-
-            // write out the table of offsets
-            ff_align(strings, sizeof(off_t));
-            offsets_off = ftello(strings);
-            fwriten(offsets, sizeof(off_t), n, strings);
-
-            // mmap the written strings data for reading
-            char *data = mmap(
-                NULL,
-                ftello(strings),
-                PROT_READ,
-                MAP_PRIVATE,
-                fileno(strings),
-                0
-            );
-            dieif(data == MAP_FAILED, "mmap failed for %s: %s\n", strings_file, errstr);
-
-            // generate a minimal perfect hash for strings
-            cmph_state_t state = {offsets, 0, data};
-            cmph_io_adapter_t adapter;
-            adapter.data = (void*)&state;
-            adapter.nkeys = n;
-            adapter.read = key_read;
-            adapter.rewind = key_rewind;
-            adapter.dispose = key_dispose;
-
-            // TODO: cmph segfaults on some binary data.
-            cmph_config_t *config = cmph_config_new(&adapter);
-            cmph_config_set_algo(config, CMPH_CHD);
-            cmph_t *hash = cmph_new(config);
-            dieif(!hash, "error generating hash\n");
-            cmph_config_destroy(config);
-
-            off_t *reverse = offsets;
-            offsets = (off_t*)(data + offsets_off);
-            for (int i = 0; i < n; i++) {
-                char *str = data + offsets[i];
-                cmph_uint32 h = cmph_search(hash, str, strlen(str));
-                reverse[h] = i;
             }
-
-            // write out reverse map of offsets
-            ff_align(strings, sizeof(off_t));
-            reverse_off = ftello(strings);
-            fwriten(reverse, sizeof(off_t), n, strings);
-
-            // write out cmph structure
-            ff_align(strings, sizeof(off_t));
-            cmph_off = ftello(strings);
-            cmph_dump(hash, strings);
-
-            // write n and table of offsets
-            ff_align(strings, sizeof(off_t));
-            fwrite1(&maxlen, sizeof(off_t), strings);
-            fwrite1(&cmph_off, sizeof(off_t), strings);
-            fwrite1(&reverse_off, sizeof(off_t), strings);
-            fwrite1(&offsets_off, sizeof(off_t), strings);
-            fwrite1(&strings_off, sizeof(off_t), strings);
-            fwrite1(&n, sizeof(off_t), strings);
-
-            dieif(fclose(strings), "error closing %s: %s\n", strings_file, errstr);
-            return 0;
         }
+        fwriten(d->row, 1, p - d->row, stdout);
+        perf.records_out++;
+    }
+}
 
-        case ENCODE: {
-            long long n;
-            field_spec_t *specs;
+void decode_header(decoder_t *d) {
+    odb_header_t h = d->h;
+    switch (codec) {
+        case DELIMITED:
+        case CSV:
+        case ARROW: break;
+        case TABLE: {
+            if (print_line_numbers)
+                for (int k = 0; k < 12; k++) putchar(' ');
+
+            int string_fields = 0, string_width = 0;
+            for (int j = 0; j < h.field_count; j++) {
+                char *name = h.field_specs[j].name;
+                size_t len = strlen(name);
+                switch (h.field_specs[j].type) {
+                    case ODB_INTEGER:
+                    case ODB_TIMESTAMP:
+                    case ODB_DATE: {
+                        int space = 21 - strlen(name);
+                        for (int k = 0; k < space; k++) putchar(' ');
+                        fwriten(name, 1, len, stdout);
+                        break;
+                    }
+                    case ODB_FLOAT: {
+                        int space = 21 - strlen(name);
+                        for (int k = 0; k < space-7; k++) putchar(' ');
+                        fwriten(name, 1, len, stdout);
+                        if (j < h.field_count-1)
+                            for (int k = 0; k < 7; k++) putchar(' ');
+                        break;
+                    }
+                    case ODB_STRING: {
+                        int space = d->widths[j] + 1 - strlen(name);
+                        string_width += d->widths[j] + 1;
+                        putchar(' ');
+                        fwriten(name, 1, len, stdout);
+                        if (j < h.field_count-1)
+                            for (int k = 0; k < space-1; k++) putchar(' ');
+                        string_fields++;
+                        break;
+                    }
+                    default:
+                        die("unsupported type: %s (%d)\n",
+                            odb_type_name(h.field_specs[j].type),
+                            h.field_specs[j].type)
+                }
+            }
+            putchar('\n');
+
+            int dashes = 21*(h.field_count-string_fields)+string_width+1;
+            if (print_line_numbers) dashes += 12;
+            for (int j = 0; j < dashes; j++) putchar('-');
+            putchar('\n');
+            break;
+        }
+        case PSQL: {
+            printf("create table \"%s\" (\n", table_name);
+            for (int j = 0; j < h.field_count; j++) {
+                printf("  \"%s\" %s%s\n",
+                       h.field_specs[j].name,
+                       psql_types[h.field_specs[j].type],
+                       j < h.field_count-1 ? "," : "");
+            }
+            printf(");\n");
+            if (!binary) {
+                printf("copy %s from stdin;\n", table_name);
+                break;
+            }
+            printf("copy %s from stdin with (format binary);\n", table_name);
+            fwriten("PGCOPY\n\377\r\n\0\0\0\0\0\0\0\0\0", 1, 19, stdout);
+            break;
+        }
+        default: die("unsupported codec\n");
+    }
+}
+
+// format records as text on out, numbering lines from *line; returns the bytes written
+long long decode_records(decoder_t *d, FILE *out, long long *line, long long *records, size_t n) {
+    odb_header_t h = d->h;
+    long long bytes = 0;
+    for (long long *record = records; record < records + n*h.field_count; record += h.field_count) {
+        if (*d->pre) bytes += fprintf(out, d->pre, (*line)++, delim);
+        for (int j = 0; j < h.field_count; j++) {
+            switch (h.field_specs[j].type) {
+                case ODB_INTEGER: {
+                    bytes += fprintf(out, d->integer_format, record[j]);
+                    break;
+                }
+                case ODB_FLOAT: {
+                    bytes += fprintf(out, d->float_format, reinterpret(double,record[j]));
+                    break;
+                }
+                case ODB_STRING: {
+                    const char *str = index_to_string(d->strings[j], record[j]);
+                    if (codec == CSV) bytes += csv_write_field(out, str, strlen(str), delim[0]);
+                    else bytes += fprintf(out, d->string_format, d->widths[j], str);
+                    break;
+                }
+                case ODB_TIMESTAMP:
+                case ODB_DATE: {
+                    double dt = reinterpret(double,record[j]);
+                    time_t tt = (time_t) round(dt);
+                    struct tm st;
+                    gmtime_r(&tt, &st);
+                    char buffer[256];
+                    char *fmt = timelikefmt(h.field_specs[j].type);
+                    strftime(buffer, sizeof(buffer)-1, fmt, &st);
+                    if (codec == CSV) bytes += csv_write_field(out, buffer, strlen(buffer), delim[0]);
+                    else bytes += fprintf(out, d->time_format, buffer);
+                }
+            }
+            if (j < h.field_count-1) bytes += fprintf(out, "%s", d->inter);
+        }
+        bytes += fprintf(out, "%s", d->post);
+    }
+    return bytes;
+}
+
+void exec_pager() {
+    switch (codec) {
+        case DELIMITED:
+        case TABLE:
+        case CSV:   execlp("less",  "less",  NULL); break;
+        case PSQL:  execlp("psql",  "psql",  NULL); break;
+        case MYSQL: execlp("mysql", "mysql", NULL); break;
+        default: die("unsupported codec\n");
+    }
+    die("exec failed: %s\n", errstr);
+}
+
+// record-batch operators: each stage consumes records of schema h and
+// pushes its output to the next stage, the last one writes to stdout
+
+typedef struct stage stage_t;
+
+struct stage {
+    odb_header_t h;
+    void (*push)(stage_t *s, long long *records, size_t n);
+    void (*finish)(stage_t *s);
+    void (*flush)(stage_t *s);
+    stage_t *next;
+    cut_t *cut;
+    int n;
+    range_t range;
+    long long count, index, emitted;
+    long long *buffer;
+    size_t size, allocated;
+    odb_sort_t sort;
+    odb_writer_t out;
+    decoder_t decoder;
+    void *state;
+};
+
+#define push_next(s,records,n) (s)->next->push((s)->next, records, n)
+
+void finish_next(stage_t *s) {
+    if (s->next) s->next->finish(s->next);
+}
+
+// pushes out buffered records without ending the stream
+void flush_next(stage_t *s) {
+    if (s->next) s->next->flush(s->next);
+    else dieif(fflush(stdout), "write error: %s\n", errstr);
+}
+
+stage_t *new_stage(odb_header_t h) {
+    stage_t *s = calloc(1, sizeof(stage_t));
+    s->h = h;
+    s->finish = finish_next;
+    s->flush = flush_next;
+    return s;
+}
+
+void cut_push(stage_t *s, long long *records, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        long long *record = records + i*s->h.field_count;
+        for (int k = 0; k < s->n; k++)
+            s->buffer[s->size*s->n + k] = record[s->cut[k].from];
+        if (++s->size == ODB_BATCH) {
+            push_next(s, s->buffer, s->size);
+            s->size = 0;
+        }
+    }
+}
+
+void cut_flush(stage_t *s) {
+    if (s->size) push_next(s, s->buffer, s->size);
+    s->size = 0;
+    flush_next(s);
+}
+
+void cut_finish(stage_t *s) {
+    if (s->size) push_next(s, s->buffer, s->size);
+    s->size = 0;
+    finish_next(s);
+}
+
+// projects, renames and retypes fields; the output schema is in *out
+stage_t *cut_stage(odb_header_t h, char *fields, odb_header_t *out) {
+    stage_t *s = new_stage(h);
+    s->cut = parse_cuts(h, fields, &s->n);
+    s->buffer = malloc(ODB_BATCH*s->n*sizeof(long long));
+    s->push = cut_push;
+    s->flush = cut_flush;
+    s->finish = cut_finish;
+    out->field_count = s->n;
+    out->field_specs = malloc(s->n*sizeof(odb_field_spec_t));
+    for (int i = 0; i < s->n; i++) out->field_specs[i] = s->cut[i].field_spec;
+    return s;
+}
+
+void slice_push(stage_t *s, long long *records, size_t n) {
+    range_t r = s->range;
+    for (size_t i = 0; i < n && s->emitted < s->count; i++, s->index++) {
+        off_t x = s->index + 1;
+        if (x < r.start || x > r.stop || (x - r.start) % r.step) continue;
+        push_next(s, records + i*s->h.field_count, 1);
+        s->emitted++;
+    }
+}
+
+// range slicing of a stream, for cat stages that are not reading files
+stage_t *slice_stage(odb_header_t h, range_t r, long long count) {
+    dieif(r.start < 0 && r.start != -1 || r.stop  < 0 && r.stop  != -1,
+          "negative range offsets cannot be used with streamed inputs\n");
+    dieif(r.step < 0,
+          "negative range strides cannot be used with streamed inputs\n");
+    if (r.start == -1) r.start = LLONG_MAX;
+    if (r.stop  == -1) r.stop = LLONG_MAX;
+    stage_t *s = new_stage(h);
+    s->range = r;
+    s->count = count;
+    s->push = slice_push;
+    return s;
+}
+
+void sort_push(stage_t *s, long long *records, size_t n) {
+    if (s->allocated < s->size + n) {
+        s->allocated = 2*(s->size + n);
+        s->buffer = realloc(s->buffer, s->allocated*s->h.field_count*sizeof(long long));
+        dieif(!s->buffer, "out of memory sorting %zu records\n", s->size + n);
+    }
+    memcpy(s->buffer + s->size*s->h.field_count, records, n*s->h.field_count*sizeof(long long));
+    s->size += n;
+}
+
+void sort_finish(stage_t *s) {
+    phase_t p = perf.phase;
+    stats_phase(SMOOTHSORT);
+    odb_sort_records(&s->sort, s->buffer, s->size);
+    perf.comparisons += s->sort.comparisons;
+    perf.swaps += s->sort.swaps;
+    stats_phase(p);
+    for (size_t i = 0; i < s->size; i += ODB_BATCH)
+        push_next(s, s->buffer + i*s->h.field_count, MIN(ODB_BATCH, s->size - i));
+    free(s->buffer);
+    s->buffer = NULL;
+    finish_next(s);
+}
+
+// collects the whole stream in memory and emits it sorted
+stage_t *sort_stage(odb_header_t h, char *fields) {
+    stage_t *s = new_stage(h);
+    int e = odb_sort_init(&s->sort, &h, fields);
+    dieif(e, "invalid field: %s\n", fields);
+    s->push = sort_push;
+    s->finish = sort_finish;
+    return s;
+}
+
+void write_push(stage_t *s, long long *records, size_t n) {
+    write_batch(&s->out, records, n);
+}
+
+void write_finish(stage_t *s) {
+    close_output(&s->out, NULL, 0);
+    finish_next(s);
+}
+
+stage_t *write_stage(odb_header_t h) {
+    stage_t *s = new_stage(h);
+    open_output(&s->out, stdout, h.field_count, h.field_specs);
+    s->push = write_push;
+    s->finish = write_finish;
+    return s;
+}
+
+void decode_push(stage_t *s, long long *records, size_t n) {
+    perf.bytes_out += decode_records(&s->decoder, stdout, &line_number, records, n);
+    perf.records_out += n;
+}
+
+void binary_push(stage_t *s, long long *records, size_t n) {
+    decode_binary(&s->decoder, records, n);
+}
+
+void binary_finish(stage_t *s) {
+    fwriten("\377\377", 1, 2, stdout);
+    finish_next(s);
+}
+
+void arrow_push(stage_t *s, long long *records, size_t n) {
+    int e = arrow_write_batch(s->state, records, n);
+    dieif(e, "write error: %s\n", odb_strerror(e));
+    perf.records_out += n;
+}
+
+void arrow_finish(stage_t *s) {
+    int e = arrow_writer_finish(s->state);
+    dieif(e, "write error: %s\n", odb_strerror(e));
+    finish_next(s);
+}
+
+stage_t *decode_stage(odb_header_t h, int pager) {
+    stage_t *s = new_stage(h);
+    decode_init(&s->decoder, h);
+    if (pager && !fork_child(1)) exec_pager();
+    decode_header(&s->decoder);
+    s->push = decode_push;
+    if (binary) {
+        s->push = binary_push;
+        s->finish = binary_finish;
+    }
+    if (codec == ARROW) {
+        s->state = malloc(sizeof(arrow_writer_t));
+        int e = arrow_writer_init(s->state, stdout, &h, (const odb_strings_t *const *) s->decoder.strings);
+        dieif(e, "write error: %s\n", odb_strerror(e));
+        s->push = arrow_push;
+        s->finish = arrow_finish;
+    }
+    return s;
+}
+
+// feed the records of an input selected by range and count into stage s
+void slice_input(odb_reader_t *in, char *name, range_t r, long long count, stage_t *s) {
+    if (in->seekable) {
+        if (r.start < 0 || r.stop < 0) {
+            off_t end = odb_record_count(in) + 1;
+            dieif(end <= 0, "stat error for %s: %s\n", name, errstr);
+            if (r.start < 0) r.start += end;
+            if (r.stop  < 0) r.stop  += end;
+            if (r.start < 0) r.start = 1;
+        }
+    } else {
+        dieif(r.start < 0 && r.start != -1 || r.stop  < 0 && r.stop  != -1,
+              "negative range offsets cannot be used with streamed inputs\n");
+        dieif(r.step < 0,
+              "negative range strides cannot be used with streamed inputs\n");
+        if (r.start == -1) return;
+        if (r.stop  == -1) r.stop = LLONG_MAX;
+    }
+    long long *records = malloc(ODB_BATCH*in->record_size);
+    odb_skip(in, r.start-1);
+    if (r.step == 1) {
+        long long left = MIN(count, r.stop - r.start + 1);
+        size_t n;
+        if (left > ODB_BATCH) read_ahead(in, name, 1, left);
+        while (left > 0 && (n = read_batch(in, records, MIN(ODB_BATCH, left), name))) {
+            s->push(s, records, n);
+            left -= n;
+        }
+        dieif(odb_reader_readahead_stop(in), "seek error for %s: %s\n", name, errstr);
+    } else {
+        for (long long j = 0; j < count; j++) {
+            off_t x = r.start + j*r.step;
+            if (r.step < 0 ? x < r.stop : x > r.stop) break;
+            if (!read_batch(in, records, 1, name)) break;
+            s->push(s, records, 1);
+            odb_skip(in, r.step-1);
+        }
+    }
+    free(records);
+}
+
+// feed the records appended to an input after its first end records into
+// stage s as they are written, waking on inotify events until the file is
+// removed; a record is only read once it is complete, so partial records
+// of a writer are picked up from the same offset on a later event
+void follow_input(odb_reader_t *in, char *name, off_t end, stage_t *s) {
+    int fd = inotify_init1(IN_CLOEXEC);
+    dieif(fd < 0 || inotify_add_watch(fd, name, IN_MODIFY | IN_ATTRIB) < 0,
+          "error watching %s: %s\n", name, errstr);
+    long long *records = malloc(ODB_BATCH*in->record_size);
+    char events[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        struct stat fs;
+        dieif(fstat(fileno(in->file), &fs), "stat error for %s: %s\n", name, errstr);
+        off_t size = (fs.st_size - in->data_offset)/in->record_size;
+        dieif(size < end, "%s was truncated\n", name);
+        if (size > end) {
+            dieif(fseeko(in->file, in->data_offset + end*in->record_size, SEEK_SET),
+                  "seek error for %s: %s\n", name, errstr);
+            while (end < size) {
+                size_t n = read_batch(in, records, MIN(ODB_BATCH, size - end), name);
+                dieif(!n, "%s was truncated\n", name);
+                s->push(s, records, n);
+                end += n;
+            }
+            s->flush(s);
+        }
+        if (!fs.st_nlink) break;
+        ssize_t n = read(fd, events, sizeof(events));
+        dieif(n <= 0 && errno != EINTR, "error watching %s: %s\n", name, errstr);
+    }
+    free(records);
+    close(fd);
+}
+
+void run_inputs(int argc, char **argv, range_t r, long long count, stage_t *s) {
+    odb_reader_t *in;
+    for (int i = 0; in = open_input(argc, argv, i, 0); i++) {
+        slice_input(in, argv[i], r, count, s);
+        close_input(in, argv[i]);
+    }
+    s->finish(s);
+}
+
+// encode a key value given on the command line
+long long parse_key(odb_field_spec_t *spec, char *str) {
+    odb_type_t type = spec->type;
+    char *p = str;
+    switch (type) {
+        case ODB_INTEGER: {
+            long long v = parse_ll(&p);
+            dieif(*p, "invalid integer: %s\n", str);
+            return v;
+        }
+        case ODB_STRING: {
+            return odb_string_to_index(field_strings(spec), str, strlen(str));
+        }
+        case ODB_TIMESTAMP:
+        case ODB_DATE: {
+            if (timelikefmt(type)) {
+                struct tm st = {0};
+                p = strptime(str, timelikefmt(type), &st);
+                dieif(!p || *p, "invalid %s: %s\n", odb_type_name(type), str);
+                double v = (double) timegm(&st);
+                return reinterpret(long long,v);
+            }
+        }
+        case ODB_FLOAT: {
+            double v = parse_d(&p);
+            dieif(*p, "invalid float: %s\n", str);
+            return reinterpret(long long,v);
+        }
+    }
+    die("unsupported type: %s\n", odb_type_name(type));
+}
+
+// the comma-separated values of -k for the leading fields of an index
+long long *parse_keys(odb_index_t *x, char *values, int *n) {
+    *n = strcnt(values, ',') + 1;
+    dieif(*n > x->sort.n, "more key values than index fields: %s\n", values);
+    long long *key = malloc(*n*sizeof(long long));
+    char *copy = strdup(values), *p = copy;
+    for (int k = 0; k < *n; k++) {
+        char *comma = strchr(p, ',');
+        if (comma) *comma = '\0';
+        key[k] = parse_key(&x->sort.field_specs[abs(x->sort.order[k])-1], p);
+        p = comma + 1;
+    }
+    free(copy);
+    return key;
+}
+
+int key_lt(odb_type_t type, long long a, long long b) {
+    return odb_floatlike(type) ? reinterpret(double,a) < reinterpret(double,b) : a < b;
+}
+
+unsigned long long hash_key(long long *record, odb_sort_t *keys) {
+    unsigned long long h = 0;
+    for (int k = 0; k < keys->n; k++)
+        h = hash64(h ^ record[abs(keys->order[k])-1]);
+    return h;
+}
+
+// the partition of a record: a hash of its keys, or the range of its first
+// key between splitters
+int partition_of(long long *record, odb_sort_t *keys, long long *splits, int n) {
+    if (!splits) return hash_key(record, keys) % n;
+    int field = abs(keys->order[0])-1;
+    odb_type_t type = keys->field_specs[field].type;
+    int lo = 0, hi = n - 1;
+    while (lo < hi) {
+        int mid = (lo + hi)/2;
+        if (key_lt(type, record[field], splits[mid])) hi = mid; else lo = mid + 1;
+    }
+    return lo;
+}
+
+// partitions are written through stdio buffers of this size
+#define PARTITION_BUFFER (1 << 20)
+
+// the output path of partition k: the pattern's one %d is replaced by k and
+// %% by a percent sign; it is not a printf format, so nothing else may follow %
+char *partition_path(const char *pattern, int k) {
+    char number[16];
+    int len = snprintf(number, sizeof(number), "%d", k), numbers = 0;
+    char *path = malloc(strlen(pattern) + len + 1), *p = path;
+    dieif(!path, "out of memory\n");
+    for (const char *c = pattern; *c; c++) {
+        if (*c != '%') {
+            *p++ = *c;
+        } else if (*++c == '%') {
+            *p++ = '%';
+        } else {
+            dieif(*c != 'd' || numbers++, "output pattern needs one %%d, and %%%% for a %%: %s\n", pattern);
+            memcpy(p, number, len);
+            p += len;
+        }
+    }
+    dieif(!numbers, "output pattern needs one %%d, and %%%% for a %%: %s\n", pattern);
+    *p = '\0';
+    return path;
+}
+
+// bloom files: a header, the specs of the key fields, the absolute path of
+// the file the keys came from (checked against its size and mtime before using it
+// for exact matches), then the blocks at a 64-byte aligned offset
+
+#define BLOOM_BITS_PER_KEY 10
+
+typedef struct {
+    char magic[8];
+    long long blocks, keys, key_count;
+    long long source_size, source_mtime, source_mtime_nsec;
+    long long source_len;
+} bloom_header_t;
+
+static const char bloom_magic[8] = "ODBbloom";
+
+typedef struct {
+    bloom_t filter;
+    odb_sort_t keys;
+    odb_field_spec_t *specs;
+    char *source;
+    struct stat stamp;
+} bloom_file_t;
+
+size_t bloom_offset(long long key_count, long long source_len) {
+    size_t size = sizeof(bloom_header_t) + key_count*sizeof(odb_field_spec_t) + source_len;
+    return (size + 63) & ~63;
+}
+
+// the hashes of the keys of all inputs, for sizing a filter before filling it
+unsigned long long *key_hashes(odb_reader_t *in, char *name, odb_sort_t *keys, size_t *n) {
+    size_t allocated = ODB_BATCH, m;
+    unsigned long long *hashes = malloc(allocated*sizeof(unsigned long long));
+    long long *records = malloc(ODB_BATCH*in->record_size);
+    *n = 0;
+    while (m = read_batch(in, records, ODB_BATCH, name)) {
+        if (*n + m > allocated) {
+            hashes = realloc(hashes, (allocated *= 2)*sizeof(unsigned long long));
+            dieif(!hashes, "out of memory hashing keys of %s\n", name);
+        }
+        for (size_t j = 0; j < m; j++)
+            hashes[(*n)++] = hash_key(records + j*keys->field_count, keys);
+    }
+    free(records);
+    return hashes;
+}
+
+void write_bloom(FILE *out, bloom_t *b, long long n, odb_header_t h, odb_sort_t *keys, char *source) {
+    bloom_header_t bh = {0};
+    struct stat fs = {0};
+    memcpy(bh.magic, bloom_magic, sizeof(bh.magic));
+    bh.blocks = b->blocks;
+    bh.keys = n;
+    bh.key_count = keys->n;
+    source = source ? realpath(source, NULL) : NULL;
+    if (source && !stat(source, &fs)) {
+        bh.source_len = strlen(source) + 1;
+        bh.source_size = fs.st_size;
+        bh.source_mtime = fs.st_mtim.tv_sec;
+        bh.source_mtime_nsec = fs.st_mtim.tv_nsec;
+    }
+    size_t offset = bloom_offset(bh.key_count, bh.source_len);
+    fwriten(&bh, sizeof(bh), 1, out);
+    for (int k = 0; k < keys->n; k++)
+        fwriten(&h.field_specs[abs(keys->order[k])-1], sizeof(odb_field_spec_t), 1, out);
+    if (bh.source_len) fwriten(source, 1, bh.source_len, out);
+    for (size_t pad = ftello(out); pad < offset; pad++) putc(0, out);
+    fwriten(b->bits, 64, b->blocks, out);
+    free(source);
+}
+
+int read_bloom(char *path, bloom_file_t *bf) {
+    bloom_header_t bh;
+    FILE *file = fopen(path, "r");
+    dieif(!file, "error opening %s: %s\n", path, errstr);
+    if (fread(&bh, sizeof(bh), 1, file) != 1 || memcmp(bh.magic, bloom_magic, sizeof(bh.magic))) {
+        fclose(file);
+        return 0;
+    }
+    bf->keys.n = bh.key_count;
+    bf->specs = malloc(bh.key_count*sizeof(odb_field_spec_t));
+    bf->source = bh.source_len ? malloc(bh.source_len) : NULL;
+    bf->filter.blocks = bh.blocks;
+    dieif(posix_memalign((void**) &bf->filter.bits, 64, bh.blocks*64),
+          "out of memory reading %s\n", path);
+    dieif(fread(bf->specs, sizeof(odb_field_spec_t), bh.key_count, file) != bh.key_count ||
+          bh.source_len && fread(bf->source, 1, bh.source_len, file) != bh.source_len ||
+          fseeko(file, bloom_offset(bh.key_count, bh.source_len), SEEK_SET) ||
+          fread(bf->filter.bits, 64, bh.blocks, file) != bh.blocks,
+          "invalid bloom filter: %s\n", path);
+    fclose(file);
+    bf->stamp.st_size = bh.source_size;
+    bf->stamp.st_mtim.tv_sec = bh.source_mtime;
+    bf->stamp.st_mtim.tv_nsec = bh.source_mtime_nsec;
+    return 1;
+}
+
+int same_stamp(struct stat *a, struct stat *b) {
+    return a->st_size == b->st_size && a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+           a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+// the key fields of a filter, as a field list of the file it was made from
+char *bloom_fields(bloom_file_t *bf) {
+    size_t size = 0;
+    for (int k = 0; k < bf->keys.n; k++) size += strlen(bf->specs[k].name) + 1;
+    char *fields = malloc(size + 1), *p = fields;
+    for (int k = 0; k < bf->keys.n; k++) p += sprintf(p, k ? ",%s" : "%s", bf->specs[k].name);
+    return fields;
+}
+
+// the sidecar filter of data on fields a,b is data.a,b.bloom
+char *bloom_path(char *name, char *fields) {
+    char *path;
+    dieif(asprintf(&path, "%s.%s.bloom", name, fields) < 0, "out of memory\n");
+    return path;
+}
+
+// exact sets of key tuples, open addressed by key hash
+typedef struct {
+    int k;
+    size_t mask;
+    long long *tuples;
+    char *used;
+} key_set_t;
+
+long long *key_slot(key_set_t *set, long long *record, odb_sort_t *keys, unsigned long long h, int add) {
+    for (size_t i = h & set->mask;; i = (i + 1) & set->mask) {
+        long long *tuple = set->tuples + i*set->k;
+        if (!set->used[i]) {
+            if (!add) return NULL;
+            set->used[i] = 1;
+            for (int k = 0; k < set->k; k++) tuple[k] = record[abs(keys->order[k])-1];
+            return tuple;
+        }
+        int same = 1;
+        for (int k = 0; k < set->k && same; k++) same = tuple[k] == record[abs(keys->order[k])-1];
+        if (same) return tuple;
+    }
+}
+
+// read the keys of source into an exact set and, unless it has one, a filter
+void load_keys(char *source, char *fields, bloom_file_t *bf, key_set_t *set) {
+    odb_reader_t in;
+    int e = odb_open(&in, source);
+    dieif(e, "error opening %s: %s\n", source, odb_strerror(e));
+    odb_sort_t keys;
+    e = odb_sort_init(&keys, &in.header, fields);
+    dieif(e, "invalid field: %s\n", fields);
+    if (!bf->filter.bits) {
+        bf->keys = keys;
+        bf->specs = malloc(keys.n*sizeof(odb_field_spec_t));
+        for (int k = 0; k < keys.n; k++) bf->specs[k] = in.header.field_specs[abs(keys.order[k])-1];
+    }
+    dieif(keys.n != bf->keys.n, "key fields of %s don't match its bloom filter\n", source);
+    for (int k = 0; k < keys.n; k++)
+        dieif(in.header.field_specs[abs(keys.order[k])-1].type != bf->specs[k].type,
+              "key fields of %s don't match its bloom filter\n", source);
+
+    size_t n;
+    unsigned long long *hashes = key_hashes(&in, source, &keys, &n);
+    if (!bf->filter.bits) {
+        dieif(bloom_init(&bf->filter, n, BLOOM_BITS_PER_KEY), "out of memory for bloom filter\n");
+        for (size_t j = 0; j < n; j++) bloom_add(&bf->filter, hashes[j]);
+    }
+    size_t size = 2;
+    while (size < 2*n) size *= 2;
+    set->k = keys.n;
+    set->mask = size - 1;
+    set->tuples = malloc(size*keys.n*sizeof(long long));
+    set->used = calloc(size, 1);
+    dieif(!set->tuples || !set->used, "out of memory for keys of %s\n", source);
+    dieif(fseeko(in.file, in.data_offset, SEEK_SET), "seek error for %s: %s\n", source, errstr);
+    long long *records = malloc(ODB_BATCH*in.record_size);
+    size_t m, j = 0;
+    while (m = read_batch(&in, records, ODB_BATCH, source))
+        for (size_t i = 0; i < m; i++, j++)
+            key_slot(set, records + i*in.header.field_count, &keys, hashes[j], 1);
+    free(records);
+    free(hashes);
+    odb_close(&in);
+}
+
+typedef struct {
+    bloom_file_t bloom;
+    key_set_t keys;
+} semijoin_t;
+
+void semijoin_push(stage_t *s, long long *records, size_t n) {
+    semijoin_t *j = s->state;
+    unsigned long long h[ODB_BATCH];
+    // hash and prefetch the whole batch before probing, so the cache
+    // misses of the probes overlap
+    for (size_t i = 0; i < n; i++) {
+        h[i] = hash_key(records + i*s->h.field_count, &s->sort);
+        __builtin_prefetch(bloom_block(&j->bloom.filter, h[i]));
+    }
+    size_t m = 0;
+    for (size_t i = 0; i < n; i++) {
+        long long *record = records + i*s->h.field_count;
+        if (!bloom_contains(&j->bloom.filter, h[i])) continue;
+        if (j->keys.used && !key_slot(&j->keys, record, &s->sort, h[i], 0)) continue;
+        memcpy(s->buffer + m++*s->h.field_count, record, s->h.field_count*sizeof(long long));
+    }
+    if (m) push_next(s, s->buffer, m);
+}
+
+int off_cmp(const void *a, const void *b) {
+    off_t x = *(off_t*)a, y = *(off_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+// k distinct sorted record ids out of n
+off_t *sample_ids(off_t n, off_t k) {
+    off_t *ids = malloc(k*sizeof(off_t)), m = 0;
+    dieif(!ids, "out of memory sampling %lld records\n", (long long) k);
+    if (2*k > n) {
+        // selection sampling: one pass over all ids
+        for (off_t t = 0; m < k; t++)
+            if ((n - t)*drand48() < k - m) ids[m++] = t;
+        return ids;
+    }
+    while (m < k) {
+        while (m < k) ids[m++] = (off_t) (drand48()*n);
+        qsort(ids, m, sizeof(off_t), off_cmp);
+        off_t u = 1;
+        for (off_t j = 1; j < m; j++)
+            if (ids[j] != ids[u-1]) ids[u++] = ids[j];
+        m = u;
+    }
+    return ids;
+}
+
+// sample seekable inputs by reading randomly chosen records with pread
+void sample_files(int argc, char **argv, long long k, stage_t *s) {
+    odb_reader_t *in;
+    off_t total = 0;
+    for (int i = 0; in = open_input(argc, argv, i, 0); i++) {
+        off_t n = odb_record_count(in);
+        dieif(n < 0, "stat error for %s: %s\n", argv[i], errstr);
+        total += n;
+    }
+    if (k > total) k = total;
+    off_t *ids = sample_ids(total, k), *batch = malloc(ODB_BATCH*sizeof(off_t));
+    long long *records = NULL;
+    off_t base = 0, j = 0;
+    for (int i = 0; in = open_input(argc, argv, i, 0); i++) {
+        off_t end = base + odb_record_count(in);
+        records = realloc(records, ODB_BATCH*in->record_size);
+        while (j < k && ids[j] < end) {
+            size_t n = 0;
+            for (; n < ODB_BATCH && j < k && ids[j] < end; j++) batch[n++] = ids[j] - base;
+            int e = odb_read_at(in, batch, n, records);
+            dieif(e, "error reading %s: %s\n", argv[i], odb_strerror(e));
+            perf.records_in += n;
+            perf.bytes_in += n*in->record_size;
+            s->push(s, records, n);
+        }
+        base = end;
+        close_input(in, argv[i]);
+    }
+    free(ids);
+    free(batch);
+    free(records);
+    s->finish(s);
+}
+
+// reservoir sampling with geometric skips (Li's algorithm L)
+void sample_streams(int argc, char **argv, long long k, stage_t *s) {
+    odb_reader_t *in;
+    long long fc = s->h.field_count, seen = 0, next = 0;
+    long long *records = malloc(ODB_BATCH*fc*sizeof(long long));
+    // the reservoir grows as records come, so a large k costs nothing on a short stream
+    long long allocated = MIN(k, ODB_BATCH);
+    long long *reservoir = malloc(allocated*fc*sizeof(long long));
+    dieif(!records || !reservoir, "out of memory sampling %lld records\n", k);
+    double w = 0;
+    for (int i = 0; in = open_input(argc, argv, i, 0); i++) {
+        size_t n;
+        while (n = read_batch(in, records, ODB_BATCH, argv[i])) {
+            for (size_t j = 0; j < n;) {
+                if (seen < k) {
+                    if (seen == allocated) {
+                        allocated = MIN(2*allocated, k);
+                        reservoir = realloc(reservoir, allocated*fc*sizeof(long long));
+                        dieif(!reservoir, "out of memory sampling %lld records\n", k);
+                    }
+                    memcpy(reservoir + seen*fc, records + j*fc, fc*sizeof(long long));
+                    j++;
+                    if (++seen < k) continue;
+                    w = exp(log(1 - drand48())/k);
+                } else {
+                    if (next - seen >= n - j) {
+                        seen += n - j;
+                        break;
+                    }
+                    j += next - seen;
+                    memcpy(reservoir + (long long) (drand48()*k)*fc, records + j*fc, fc*sizeof(long long));
+                    j++;
+                    seen = next + 1;
+                    w *= exp(log(1 - drand48())/k);
+                }
+                double skip = floor(log(1 - drand48())/log1p(-w));
+                next = seen + (skip < LLONG_MAX/2 ? (long long) skip : LLONG_MAX/2);
+            }
+        }
+        close_input(in, argv[i]);
+    }
+    for (long long j = 0; j < MIN(seen, k); j += ODB_BATCH)
+        s->push(s, reservoir + j*fc, MIN(ODB_BATCH, MIN(seen, k) - j));
+    free(records);
+    free(reservoir);
+    s->finish(s);
+}
+
+typedef struct {
+    const long long *records;
+    size_t n;
+    odb_profile_t profile;
+    int error;
+} scan_t;
+
+void *scan_thread(void *arg) {
+    scan_t *t = arg;
+    long long fc = t->profile.field_count;
+    for (size_t i = 0; !t->error && i < t->n; i += ODB_BATCH)
+        t->error = odb_profile_add(&t->profile, t->records + i*fc, MIN(ODB_BATCH, t->n - i));
+    return NULL;
+}
+
+void default_jobs() {
+    if (!jobs) jobs = MAX(1, sysconf(_SC_NPROCESSORS_ONLN));
+}
+
+// compressed text is decompressed by threads running ahead of the parser;
+// inputs are read one at a time, so they can share one stdio buffer, which
+// setvbuf needs to be given for its size to count
+FILE *decompressed(FILE *file, const char *name) {
+    static char *buffer = NULL;
+    int format, e = decompress_open(&file, jobs, &format);
+    dieif(e == ODB_EUNSUPPORTED, "%s is zstd compressed: rebuild odb with make ZSTD=1\n", name);
+    dieif(e, "error reading %s: %s\n", name, odb_strerror(e));
+    if (format != DECOMPRESS_NONE) {
+        dieif(!buffer && !(buffer = malloc(DECOMPRESS_CHUNK)), "out of memory\n");
+        setvbuf(file, buffer, _IOFBF, DECOMPRESS_CHUNK);
+    }
+    return file;
+}
+
+// map the n records of a seekable input for sequential reading
+char *map_records(odb_reader_t *in, char *name, off_t n, size_t *size) {
+    *size = in->data_offset + n*in->record_size;
+    char *map = mmap(NULL, *size, PROT_READ, MAP_SHARED, fileno(in->file), 0);
+    dieif(map == MAP_FAILED, "mmap failed for %s: %s\n", name, errstr);
+    madvise(map, *size, MADV_SEQUENTIAL);
+    return map;
+}
+
+// profile a seekable input by splitting its mapped records between threads
+void profile_file(odb_reader_t *in, char *name, odb_profile_t *p) {
+    off_t n = odb_record_count(in);
+    dieif(n < 0, "stat error for %s: %s\n", name, errstr);
+    if (!n) return;
+    size_t size;
+    char *map = map_records(in, name, n, &size);
+
+    int t = MIN(jobs, n);
+    scan_t *scans = calloc(t, sizeof(scan_t));
+    pthread_t *threads = calloc(t, sizeof(pthread_t));
+    for (int i = 0; i < t; i++) {
+        off_t from = i*n/t, to = (i+1)*n/t;
+        scans[i].records = (long long*) (map + in->data_offset) + from*in->header.field_count;
+        scans[i].n = to - from;
+        int e = odb_profile_init(&scans[i].profile, &in->header, fields_arg);
+        dieif(e, "invalid field: %s\n", fields_arg);
+        e = pthread_create(&threads[i], NULL, scan_thread, &scans[i]);
+        dieif(e, "error starting thread: %s\n", strerror(e));
+    }
+    for (int i = 0; i < t; i++) {
+        pthread_join(threads[i], NULL);
+        int e = scans[i].error ? scans[i].error : odb_profile_merge(p, &scans[i].profile);
+        dieif(e, "error profiling %s: %s\n", name, odb_strerror(e));
+        odb_profile_free(&scans[i].profile);
+    }
+    free(scans);
+    free(threads);
+    munmap(map, size);
+    perf.records_in += n;
+    perf.bytes_in += n*in->record_size;
+}
+
+// decoding of mapped inputs: workers format chunks of records into memory
+// in any order, within a window of chunks, and they are written in order
+
+#define DECODE_CHUNK 16384
+
+typedef struct {
+    decoder_t *d;
+    long long *records;
+    off_t n, chunks, next, written;
+    int window;
+    long long line;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct {
+        char *text;
+        size_t size;
+        int done;
+    } *slots;
+} decode_job_t;
+
+void *decode_thread(void *arg) {
+    decode_job_t *job = arg;
+    long long fc = job->d->h.field_count;
+    pthread_mutex_lock(&job->lock);
+    for (;;) {
+        while (job->next < job->chunks && job->next >= job->written + job->window)
+            pthread_cond_wait(&job->cond, &job->lock);
+        if (job->next >= job->chunks) break;
+        off_t c = job->next++;
+        pthread_mutex_unlock(&job->lock);
+
+        char *text;
+        size_t size;
+        FILE *out = open_memstream(&text, &size);
+        dieif(!out, "out of memory decoding records\n");
+        long long line = job->line + c*DECODE_CHUNK;
+        off_t n = MIN(DECODE_CHUNK, job->n - c*DECODE_CHUNK);
+        decode_records(job->d, out, &line, job->records + c*DECODE_CHUNK*fc, n);
+        dieif(fclose(out), "out of memory decoding records\n");
+
+        pthread_mutex_lock(&job->lock);
+        int k = c % job->window;
+        job->slots[k].text = text;
+        job->slots[k].size = size;
+        job->slots[k].done = 1;
+        pthread_cond_broadcast(&job->cond);
+    }
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+
+void decode_file(odb_reader_t *in, char *name, decoder_t *d) {
+    off_t n = odb_record_count(in);
+    dieif(n < 0, "stat error for %s: %s\n", name, errstr);
+    if (!n) return;
+    size_t size;
+    char *map = map_records(in, name, n, &size);
+
+    decode_job_t job = {0};
+    job.d = d;
+    job.records = (long long*) (map + in->data_offset);
+    job.n = n;
+    job.chunks = (n + DECODE_CHUNK - 1)/DECODE_CHUNK;
+    job.window = 2*jobs;
+    job.line = line_number;
+    job.slots = calloc(job.window, sizeof(*job.slots));
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.cond, NULL);
+    int t = MIN(jobs, job.chunks);
+    pthread_t *threads = calloc(t, sizeof(pthread_t));
+    for (int i = 0; i < t; i++) {
+        int e = pthread_create(&threads[i], NULL, decode_thread, &job);
+        dieif(e, "error starting thread: %s\n", strerror(e));
+    }
+    for (off_t c = 0; c < job.chunks; c++) {
+        int k = c % job.window;
+        pthread_mutex_lock(&job.lock);
+        while (!job.slots[k].done) pthread_cond_wait(&job.cond, &job.lock);
+        pthread_mutex_unlock(&job.lock);
+        fwriten(job.slots[k].text, 1, job.slots[k].size, stdout);
+        free(job.slots[k].text);
+        pthread_mutex_lock(&job.lock);
+        job.slots[k].done = 0;
+        job.written++;
+        pthread_cond_broadcast(&job.cond);
+        pthread_mutex_unlock(&job.lock);
+    }
+    for (int i = 0; i < t; i++) pthread_join(threads[i], NULL);
+    free(threads);
+    free(job.slots);
+    munmap(map, size);
+    line_number += n;
+    perf.records_in += n;
+    perf.bytes_in += n*in->record_size;
+    perf.records_out += n;
+}
+
+// format a profiled value of a field as text
+char *format_value(char *buffer, size_t size, odb_type_t type, double v) {
+    if (isnan(v)) {
+        buffer[0] = '\0';
+    } else if (type == ODB_INTEGER) {
+        snprintf(buffer, size, "%lld", (long long) v);
+    } else if ((type == ODB_TIMESTAMP || type == ODB_DATE) && timelikefmt(type)) {
+        time_t tt = (time_t) round(v);
+        struct tm st;
+        gmtime_r(&tt, &st);
+        strftime(buffer, size, timelikefmt(type), &st);
+    } else {
+        char fmt[8];
+        snprintf(fmt, sizeof(fmt), "%%.6%c", float_format_char);
+        snprintf(buffer, size, fmt, v);
+    }
+    return buffer;
+}
+
+static double quantiles[] = { 0.25, 0.5, 0.75, 0.99 };
+
+void print_profile(odb_header_t h, odb_profile_t *p) {
+    char *names[] = { "field", "type", "count", "min", "max", "mean", "stddev",
+                      "distinct", "p25", "p50", "p75", "p99" };
+    for (int k = 0; k < sizeof(names)/sizeof(*names); k++)
+        printf("%s%s", k ? delim : "", names[k]);
+    putchar('\n');
+    for (int i = 0; i < p->n; i++) {
+        odb_column_profile_t *c = &p->columns[i];
+        odb_type_t type = c->type;
+        char buffer[256];
+        printf("%s%s%s%s%lld", h.field_specs[c->field].name, delim,
+               odb_type_name(type), delim, c->count);
+        if (type == ODB_STRING) {
+            if (c->count) {
+                odb_strings_t *strings = field_strings(&h.field_specs[c->field]);
+                printf("%s%s", delim, index_to_string(strings, c->imin));
+                printf("%s%s", delim, index_to_string(strings, c->imax));
+            } else {
+                printf("%s%s", delim, delim);
+            }
+            printf("%s%s", delim, delim);
+        } else {
+            double stddev = c->count > 1 ? sqrt(c->m2/(c->count - 1)) : c->count ? 0 : NAN;
+            double mean = c->count ? c->mean : NAN;
+            if (type == ODB_INTEGER) {
+                if (c->count) printf("%s%lld%s%lld", delim, c->imin, delim, c->imax);
+                else printf("%s%s", delim, delim);
+                type = ODB_FLOAT;
+            } else {
+                printf("%s%s", delim, format_value(buffer, sizeof(buffer), type, c->count ? c->min : NAN));
+                printf("%s%s", delim, format_value(buffer, sizeof(buffer), type, c->count ? c->max : NAN));
+            }
+            printf("%s%s", delim, format_value(buffer, sizeof(buffer), type, mean));
+            printf("%s%s", delim, format_value(buffer, sizeof(buffer), ODB_FLOAT, stddev));
+            type = c->type;
+        }
+        printf("%s%.0f", delim, odb_profile_distinct(c));
+        for (int k = 0; k < sizeof(quantiles)/sizeof(*quantiles); k++)
+            printf("%s%s", delim, format_value(buffer, sizeof(buffer), type, odb_profile_quantile(c, quantiles[k])));
+        putchar('\n');
+    }
+}
+
+// split a pipeline like 'cat f -f a,b | sort -f a | decode' into words
+char **split_pipeline(int argc, char **argv, int *n) {
+    size_t len = 0;
+    for (int i = 0; i < argc; i++) len += strlen(argv[i]) + 1;
+    char **words = calloc(len + 1, sizeof(char*));
+    char *buffer = malloc(2*len + 1), *p = buffer;
+    *n = 0;
+    for (int i = 0; i < argc; i++) {
+        for (char *c = argv[i]; *c;) {
+            if (isspace(*c)) { c++; continue; }
+            words[(*n)++] = p;
+            if (*c == '|') {
+                *p++ = *c++;
+            } else {
+                char quote = 0;
+                for (; *c && (quote || !isspace(*c) && *c != '|'); c++) {
+                    if (quote ? *c == quote : *c == '\'' || *c == '"')
+                        quote = quote ? 0 : *c;
+                    else
+                        *p++ = *c;
+                }
+                dieif(quote, "unterminated quote in pipeline: %s\n", argv[i]);
+            }
+            *p++ = '\0';
+        }
+    }
+    return words;
+}
+
+#define pipe_to_print(cmd) ((cmd) == ENCODE && !extract || \
+                            (cmd) == CAT || cmd == PASTE || \
+                            (cmd) == SAMPLE || (cmd) == LOOKUP || \
+                            (cmd) == SEMIJOIN || \
+                            (cmd) == SORT && !quiet)
+
+// a request to serve is a connection that sends the client's working
+// directory and command line as strings ended by NULs, with its stdin, stdout
+// and stderr attached, and then shuts down writing; the command runs in a
+// forked copy of the server, which shares the dictionaries it has loaded and
+// replies with the exit status in one byte. Clients that can't pass
+// descriptors get the output and errors on the socket instead, and no status.
+// Only dictionaries stay mapped in the server: data files are opened by each
+// request, as their locks and headers must be current, and stay in the page cache
+static int served = 0;
+static int served_socket = -1;
+static pid_t served_pid;
+
+int servable(cmd_t cmd) {
+    return cmd == CAT || cmd == DECODE || cmd == PRINT || cmd == PASTE || cmd == LOOKUP ||
+           cmd == SAMPLE || cmd == STATS || cmd == SEMIJOIN || cmd == RUN || cmd == HELP;
+}
+
+struct sockaddr_un socket_address(const char *path) {
+    struct sockaddr_un addr = {AF_UNIX};
+    dieif(strlen(path) >= sizeof(addr.sun_path), "socket path too long: %s\n", path);
+    strcpy(addr.sun_path, path);
+    return addr;
+}
+
+// runs on exit of the served command, but not of a print process it forked
+void send_status(int status, void *arg) {
+    if (served_socket < 0 || getpid() != served_pid) return;
+    fflush(stdout);
+    fflush(stderr);
+    unsigned char c = status;
+    if (write(served_socket, &c, 1) != 1) return;
+}
+
+int main(int argc, char **argv);
+
+void serve_request(int c) {
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    char *msg = NULL;
+    size_t size = 0, allocated = 0;
+    int fds[3], nfds = 0;
+    for (;;) {
+        if (size == allocated) {
+            allocated = allocated ? 2*allocated : 4096;
+            dieif(!(msg = realloc(msg, allocated)), "out of memory\n");
+        }
+        union {
+            char buf[CMSG_SPACE(3*sizeof(int))];
+            struct cmsghdr align;
+        } control;
+        struct iovec iov = {msg + size, allocated - size};
+        struct msghdr m = {.msg_iov = &iov, .msg_iovlen = 1,
+                           .msg_control = control.buf, .msg_controllen = sizeof(control.buf)};
+        ssize_t n = recvmsg(c, &m, MSG_CMSG_CLOEXEC);
+        if (n < 0 && errno == EINTR) continue;
+        dieif(n < 0, "error reading request: %s\n", errstr);
+        for (struct cmsghdr *h = CMSG_FIRSTHDR(&m); h; h = CMSG_NXTHDR(&m, h)) {
+            if (h->cmsg_level != SOL_SOCKET || h->cmsg_type != SCM_RIGHTS) continue;
+            int k = (h->cmsg_len - CMSG_LEN(0))/sizeof(int);
+            dieif(nfds || k != 3, "request must pass stdin, stdout and stderr\n");
+            memcpy(fds, CMSG_DATA(h), sizeof(fds));
+            nfds = k;
+        }
+        if (!n) break;
+        size += n;
+    }
+    // connections that send nothing only check that the server is up
+    if (!size) exit(0);
+    dieif(msg[size-1], "incomplete request\n");
+
+    int argc = 0;
+    for (size_t i = 0; i < size; i++) argc += !msg[i];
+    char **argv = calloc(argc + 1, sizeof(char*));
+    dieif(!argv, "out of memory\n");
+    argv[0] = "odb";
+    char *p = msg + strlen(msg) + 1;
+    for (int i = 1; i < argc; i++, p += strlen(p) + 1) argv[i] = p;
+
+    if (nfds) {
+        for (int i = 0; i < 3; i++) {
+            dieif(dup2(fds[i], i) == -1, "dup2 failed: %s\n", errstr);
+            close(fds[i]);
+        }
+        served_socket = c;
+    } else {
+        int null = open("/dev/null", O_RDONLY);
+        dieif(null < 0 || dup2(null, 0) == -1 || dup2(c, 1) == -1 || dup2(c, 2) == -1,
+              "error redirecting request: %s\n", errstr);
+        close(null);
+        close(c);
+    }
+    dieif(chdir(msg), "error changing to %s: %s\n", msg, errstr);
+    served = 1;
+    served_pid = getpid();
+    on_exit(send_status, NULL);
+    optind = 0;
+    exit(main(argc, argv));
+}
+
+void stop_serving(int sig) {
+    unlink(socket_arg);
+    _exit(0);
+}
+
+// run requests in forked processes, up to -j at a time
+void serve(int argc, char **argv) {
+    dieif(!socket_arg, "use -U to give the socket to serve on\n");
+    // the dictionaries named, or strings.idx if there is one, stay loaded
+    if (argc == 1 && !strcmp(argv[0], "-")) {
+        if (!access(strings_file, R_OK)) load_strings(strings_file);
+    } else {
+        for (int i = 0; i < argc; i++) load_strings(argv[i]);
+    }
+
+    struct sockaddr_un addr = socket_address(socket_arg);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    dieif(fd < 0, "socket failed: %s\n", errstr);
+    // a socket left behind by a server that is gone is replaced
+    if (connect(fd, (struct sockaddr*) &addr, sizeof(addr))) {
+        dieif(errno == ECONNREFUSED && unlink(socket_arg),
+              "error removing %s: %s\n", socket_arg, errstr);
+    } else {
+        die("already serving on %s\n", socket_arg);
+    }
+    close(fd);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    dieif(fd < 0 || bind(fd, (struct sockaddr*) &addr, sizeof(addr)) || listen(fd, SOMAXCONN),
+          "error serving on %s: %s\n", socket_arg, errstr);
+    signal(SIGINT, stop_serving);
+    signal(SIGTERM, stop_serving);
+
+    default_jobs();
+    long long running = 0;
+    for (;;) {
+        while (running && waitpid(-1, NULL, running < jobs ? WNOHANG : 0) > 0) running--;
+        int c = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+        if (c < 0 && (errno == EINTR || errno == ECONNABORTED)) continue;
+        dieif(c < 0, "error accepting on %s: %s\n", socket_arg, errstr);
+        refresh_strings();
+        pid_t pid = fork();
+        if (!pid) {
+            close(fd);
+            serve_request(c);
+        }
+        if (pid < 0) warn("fork failed: %s\n", errstr) else running++;
+        close(c);
+    }
+}
+
+// send the command line to the server on socket_arg, which runs it on our
+// standard streams
+int request(char **args) {
+    struct sockaddr_un addr = socket_address(socket_arg);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    dieif(fd < 0 || connect(fd, (struct sockaddr*) &addr, sizeof(addr)),
+          "error connecting to %s: %s\n", socket_arg, errstr);
+
+    char *cwd = getcwd(NULL, 0);
+    dieif(!cwd, "getcwd failed: %s\n", errstr);
+    size_t size = strlen(cwd) + 1;
+    for (char **a = args; *a; a++) size += strlen(*a) + 1;
+    char *msg = malloc(size), *p = msg;
+    dieif(!msg, "out of memory\n");
+    p = stpcpy(p, cwd) + 1;
+    for (char **a = args; *a; a++) p = stpcpy(p, *a) + 1;
+
+    int fds[3] = {0, 1, 2};
+    union {
+        char buf[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {msg, size};
+    struct msghdr m = {.msg_iov = &iov, .msg_iovlen = 1,
+                       .msg_control = control.buf, .msg_controllen = sizeof(control.buf)};
+    struct cmsghdr *h = CMSG_FIRSTHDR(&m);
+    h->cmsg_level = SOL_SOCKET;
+    h->cmsg_type = SCM_RIGHTS;
+    h->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(h), fds, sizeof(fds));
+    ssize_t n = sendmsg(fd, &m, MSG_NOSIGNAL);
+    for (size_t sent = 0; n > 0 && (sent += n) < size; )
+        n = send(fd, msg + sent, size - sent, MSG_NOSIGNAL);
+    dieif(n < 0 || shutdown(fd, SHUT_WR), "error sending to %s: %s\n", socket_arg, errstr);
+
+    unsigned char status;
+    while ((n = read(fd, &status, 1)) < 0 && errno == EINTR);
+    dieif(n != 1, "%s closed the connection\n", socket_arg);
+    return status;
+}
+
+int main(int argc, char **argv) {
+    // getopt reorders argv, and requests send it as given
+    char **args = malloc((argc + 1)*sizeof(char*));
+    dieif(!args, "out of memory\n");
+    memcpy(args, argv, (argc + 1)*sizeof(char*));
+    parse_opts(&argc,&argv);
+    dieif(argc < 1, "usage: %s\n", usage);
+
+    cmd_t cmd = parse_cmd(argv[0]);
+    if (socket_arg && cmd != SERVE && !served) return request(args + 1);
+    dieif(served && !servable(cmd), "%s cannot be served\n", argv[0]);
+    free(args);
+    stats_init(argv[0]);
+    argv++; argc--;
+
+    int is_tty = tty < 0 ? 0 : tty || isatty(fileno(stdout));
+    if (is_tty && pipe_to_print(cmd) && !fork_child(0)) {
+        argc = 0;
+        cmd = PRINT;
+        perf = (typeof(perf)){0};
+        stats_init("print");
+    }
+    if (!argc) {
+        argc = 1;
+        argv[0] = "-";
+    }
+    if (cmd == PRINT) {
+        cmd = DECODE;
+        codec = TABLE;
+    }
+
+    switch (cmd) {
+
+        case STRINGS: {
+            if (compact) {
+                compact_strings(argc, argv);
+                return 0;
+            }
+            default_jobs();
+            build_strings(argc, argv);
+            return 0;
+        }
+
+        case ENCODE: {
+            long long n;
+            odb_field_spec_t *specs;
+
+            if (codec == ARROW) {
+                encode_arrow(argc, argv);
+                if (is_tty) wait_child();
+                return 0;
+            }
 
             switch (codec) {
-                case DELIMITED: {
+                case DELIMITED:
+                case CSV: {
                     dieif(!fields_arg, "use -f to provide a field schema\n");
                     n = strcnt(fields_arg, ',') + 1;
-                    specs = malloc(n*sizeof(field_spec_t));
-                    string_fields = 0;
+                    specs = malloc(n*sizeof(odb_field_spec_t));
                     for (int i = 0; i < n; i++) {
                         char *comma = strchr(fields_arg, ',');
                         if (comma) *comma = '\0';
                         specs[i] = parse_field_spec(fields_arg);
-                        if (specs[i].type == STRING) string_fields++;
                         fields_arg = comma + 1;
                     }
                     break;
                 }
                 case TABLE: die("formated table encoding not supported\n");
-                case CSV:   die("CSV encoding not yet supported (try -d, instead)\n");
                 case PSQL:  die("PostgreSQL encoding not yet supported\n");
                 case MYSQL: die("MySQL encoding not yet supported\n");
                 default: die("unsupported codec\n");
             }
 
+            // extraction is of the strings of one dictionary: the fields
+            // naming -s, or if none do, the fields naming no dictionary
+            int *extracted = calloc(n, sizeof(int)), own = 0;
+            for (int j = 0; j < n; j++) {
+                const char *path = odb_field_dictionary(&specs[j]);
+                extracted[j] = path && !strcmp(path, strings_file);
+                own |= extracted[j];
+            }
+            for (int j = 0; j < n; j++)
+                if (!own && specs[j].type == ODB_STRING && !odb_field_dictionary(&specs[j])) extracted[j] = 1;
+
+            odb_writer_t out;
+            odb_strings_t **strings = NULL;
+            probes_t probes;
             if (!extract) {
-                write_header(stdout, n, specs);
-                if (string_fields) load_strings();
+                stats_phase(HEADER);
+                open_output(&out, stdout, n, specs);
+                odb_header_t h = {n, specs};
+                strings = header_strings(h);
+                probes_init(&probes, n);
             }
+            stats_phase(PARSE);
 
-            if (!timestamp_fmt) type_as_float(TIMESTAMP, specs, n);
-            if (!date_fmt) type_as_float(DATE, specs, n);
+            if (!timestamp_fmt) type_as_float(ODB_TIMESTAMP, specs, n);
+            if (!date_fmt) type_as_float(ODB_DATE, specs, n);
 
+            // rows are encoded in batches, so their strings are looked up together
             FILE *file;
+            long long *records = malloc(ODB_BATCH*n*sizeof(long long));
+            size_t rows = 0;
+            default_jobs();
             for (int i = 0; file = fopenr_arg(argc, argv, i, 0); i++) {
+                file = decompressed(file, argv[i]);
+                if (codec == CSV) {
+                    csv_reader_t csv;
+                    int e = csv_reader_init(&csv, file, delim[0]);
+                    dieif(e, "error reading %s: %s\n", argv[i], odb_strerror(e));
+                    while (!(e = csv_read_record(&csv)) && csv.n) {
+                        long long *record = records + rows*n;
+                        perf.records_in++;
+                        dieif(csv.n != n, "expected %lld fields, found %zu: %s\n", n, csv.n, csv.fields[0]);
+                        for (int j = 0; j < n; j++) {
+                            perf.bytes_in += csv.lens[j] + 1;
+                            if (specs[j].type != ODB_STRING)
+                                record[j] = parse_csv_value(specs[j].type, csv.fields[j], csv.lens[j]);
+                            else if (!extract)
+                                probe_string(&probes, j, rows, csv.fields[j], csv.lens[j]);
+                            else if (extracted[j]) {
+                                fwriten(csv.fields[j], 1, csv.lens[j], stdout);
+                                putchar(string_end);
+                            }
+                        }
+                        if (!extract) rows = encode_row(&probes, strings, n, records, rows, &out);
+                    }
+                    dieif(e, "error reading %s: %s\n", argv[i], odb_strerror(e));
+                    csv_reader_free(&csv);
+                    dieif(fclose(file), "error closing %s: %s\n", argv[i], errstr);
+                    continue;
+                }
                 size_t length;
                 char *line, *buffer = NULL;
                 while (line = get_line(file, &buffer, &length)) {
+                    long long *record = records + rows*n;
+                    perf.records_in++;
+                    perf.bytes_in += length;
                     for (int j = 0; j < n; j++) {
                         switch (specs[j].type) {
-                            case INTEGER: {
-                                long long v = parse_ll(&line);
-                                if (!extract) fwrite1(&v, sizeof(v), stdout);
+                            case ODB_INTEGER: {
+                                record[j] = parse_ll(&line);
                                 break;
                             }
-                            case FLOAT: {
+                            case ODB_FLOAT: {
                                 double v = parse_d(&line);
-                                if (!extract) fwrite1(&v, sizeof(v), stdout);
+                                record[j] = reinterpret(long long,v);
                                 break;
                             }
-                            case STRING: {
+                            case ODB_STRING: {
                                 off_t len = buffer+length-line-1;
                                 if (j < n-1) {
                                     char *end = memchr(line, delim[0], len);
                                     dieif(!end, "tab expected after: %s\n", ltrunc(buffer));
                                     len = end-line;
                                 }
-                                if (extract) {
+                                if (extract && extracted[j]) {
                                     fwriten(line, 1, len, stdout);
-                                    putchar('\n');
-                                } else {
-                                    long long v = string_to_index(line, len);
-                                    fwrite1(&v, sizeof(v), stdout);
+                                    putchar(string_end);
+                                } else if (!extract) {
+                                    probe_string(&probes, j, rows, line, len);
                                 }
                                 line += len;
                                 break;
                             }
-                            case TIMESTAMP:
-                            case DATE: {
+                            case ODB_TIMESTAMP:
+                            case ODB_DATE: {
                                 struct tm st;
                                 char *fmt = timelikefmt(specs[j].type);
                                 char *p = strptime(line, fmt, &st);
                                 dieif(!p, "invalid timestamp: %s\n", ltrunc(buffer));
                                 double v = (double) timegm(&st);
-                                if (!extract) fwrite1(&v, sizeof(v), stdout);
+                                record[j] = reinterpret(long long,v);
                                 line = p;
                                 break;
                             }
                             default:
-                                die("encoding type %s not yet implemented\n", typestr(specs[j].type));
+                                die("encoding type %s not yet implemented\n", odb_type_name(specs[j].type));
                         }
                         if (j < n-1) {
                             if (line[0] != delim[0]) {
@@ -903,429 +3181,726 @@ int main(int argc, char **argv) {
                                   "end of line expected: %s\n", ltrunc(buffer));
                         }
                     }
+                    if (!extract) rows = encode_row(&probes, strings, n, records, rows, &out);
                 }
                 dieif(fclose(file), "error closing %s: %s\n", argv[i], errstr);
             }
+            if (!extract) {
+                lookup_strings(&probes, strings, n, records, rows);
+                write_batch(&out, records, rows);
+                close_output(&out, NULL, 0);
+            }
             if (is_tty) wait_child();
             return 0;
         }
 
         case DECODE: {
-            h = read_headers(argc, argv, 0);
-            h_size = header_size(h);
-            if (string_fields) load_strings();
+            stats_phase(HEADER);
+            odb_header_t h = read_headers(argc, argv, 0);
+            stage_t *s = decode_stage(h, is_tty);
+            stats_phase(OUTPUT);
+            default_jobs();
+            odb_reader_t *in;
+            for (int i = 0; in = open_input(argc, argv, i, 0); i++) {
+                // plain files are formatted in parallel
+                if (jobs > 1 && in->seekable && !in->buffer && !binary && codec != ARROW)
+                    decode_file(in, argv[i], &s->decoder);
+                else
+                    slice_input(in, argv[i], make_range(1,1,-1), LLONG_MAX, s);
+                close_input(in, argv[i]);
+            }
+            s->finish(s);
+            if (is_tty) wait_child();
+            return 0;
+        }
+
+        case CAT: {
+            stats_phase(HEADER);
+            odb_header_t h = read_headers(argc, argv, 0);
+            stage_t *s;
+            if (fields_arg) {
+                odb_header_t out;
+                s = cut_stage(h, fields_arg, &out);
+                s->next = write_stage(out);
+            } else {
+                s = write_stage(h);
+            }
+            stats_phase(OUTPUT);
+            if (follow) {
+                // the range selects among the records present at the start,
+                // then every record appended later is output
+                dieif(argc != 1 || !strcmp(argv[0], "-"), "usage: odb cat --follow <file>\n");
+                odb_reader_t *in = open_input(argc, argv, 0, 0);
+                dieif(!in->seekable || in->runs || in->buffer || in->header.footer,
+                      "%s cannot be followed\n", argv[0]);
+                off_t end = odb_record_count(in);
+                dieif(end < 0, "stat error for %s: %s\n", argv[0], errstr);
+                if (range.start < 0) range.start = MAX(range.start + end + 1, 1);
+                if (range.stop < 0) range.stop += end + 1;
+                if (range.step > 0) range.stop = MIN(range.stop, end);
+                else range.start = MIN(range.start, end);
+                slice_input(in, argv[0], range, count, s);
+                s->flush(s);
+                follow_input(in, argv[0], end, s);
+                close_input(in, argv[0]);
+                s->finish(s);
+            } else {
+                run_inputs(argc, argv, range, count, s);
+            }
+            if (is_tty) wait_child();
+            return 0;
+        }
+
+        case PASTE: {
+            odb_reader_t *r;
+            long long field_count = 0;
+            odb_field_spec_t *specs = NULL;
+            stats_phase(HEADER);
+            for (int i = 0; r = open_input(argc, argv, i, 0); i++) {
+                specs = realloc(specs, (field_count + r->header.field_count)*sizeof(odb_field_spec_t));
+                memcpy(specs + field_count, r->header.field_specs, r->header.field_count*sizeof(odb_field_spec_t));
+                field_count += r->header.field_count;
+                read_ahead(r, argv[i], argc, -1);
+            }
+            odb_writer_t out;
+            open_output(&out, stdout, field_count, specs);
+            stats_phase(OUTPUT);
+            long long *record = malloc(ODB_BATCH*field_count*sizeof(long long));
+            long long *part = malloc(ODB_BATCH*field_count*sizeof(long long));
+            for (;;) {
+                size_t n = 0;
+                long long offset = 0;
+                for (int i = 0; r = open_input(argc, argv, i, 0); i++) {
+                    long long fc = r->header.field_count;
+                    size_t m = read_batch(r, part, i ? n : ODB_BATCH, argv[i]);
+                    if (!i) n = m;
+                    dieif(m != n, "unequal records in inputs\n");
+                    for (size_t k = 0; k < n; k++)
+                        memcpy(record + k*field_count + offset, part + k*fc, fc*sizeof(long long));
+                    offset += fc;
+                }
+                if (!n) break;
+                write_batch(&out, record, n);
+            }
+            for (int i = 0; r = open_input(argc, argv, i, 0); i++) {
+                dieif(read_batch(r, part, 1, argv[i]), "unequal records in inputs\n");
+                close_input(r, argv[i]);
+            }
+            close_output(&out, NULL, 0);
+            if (is_tty) wait_child();
+            return 0;
+        }
 
-            if (!timestamp_fmt)
-                type_as_float(TIMESTAMP, h.field_specs, h.field_count);
-            if (!date_fmt)
-                type_as_float(DATE, h.field_specs, h.field_count);
+        case SORT: {
+            stats_phase(HEADER);
+            // indexed inputs are merged in index order and left alone
+            if (index_arg) {
+                dieif(fields_arg, "use either -f or -I to give the sort order\n");
+                fields_arg = index_arg;
+            }
+            odb_header_t h = read_headers(argc, argv, !index_arg && !cow);
 
-            char *pre, *inter, *post;
-            char *integer_format, *float_format, *string_format, *time_format;
+            odb_sort_t s;
+            int e = odb_sort_init(&s, &h, fields_arg);
+            dieif(e, "invalid field: %s\n", fields_arg);
 
-            switch (codec) {
-                case DELIMITED:
-                case PSQL: {
-                    pre = print_line_numbers ? "%lld" : "";
-                    inter = delim;
-                    post = "\n";
-                    integer_format = "%lld";
-                    asprintf(&float_format, "%%.6%c", float_format_char);
-                    string_format = "%s";
-                    time_format = "%s";
-                    break;
+            FILE *file;
+            for (int i = 0; !index_arg && (file = fopenr_arg(argc, argv, i, !cow)); i++) {
+                if (sorted_by(&inputs[i], argv[i], &s)) {
+                    dieif(!cow && flock(fileno(file), LOCK_SH),
+                          "error downgrading lock on %s: %s\n", argv[i], errstr);
+                    continue;
                 }
-                case TABLE: {
-                    pre = print_line_numbers ? "%8lld:    " : " ";
-                    inter = " ";
-                    post = "\n";
-                    integer_format = "%20lld";
-                    asprintf(&float_format, "%%20.6%c", float_format_char);
-                    asprintf(&string_format, "%%-%ds", string_maxlen);
-                    time_format = "%20s";
-                    break;
+                if (cow && seekable(file)) {
+                    FILE *tmp = sort_copy(&inputs[i], argv[i], &s);
+                    dieif(dup2(fileno(tmp), fileno(file)) == -1, "dup2 failed: %s\n", errstr);
+                    file = files[i] = inputs[i].file = tmp;
+                    continue;
                 }
-                case CSV:   die("CSV decoding not yet supported (try -d, instead)\n");
-                case MYSQL: die("MySQL decoding not yet supported\n");
-                default: die("unsupported codec\n");
+                if (!seekable(file)) {
+                    stats_phase(COPY);
+                    FILE *tmp = sort_stream(&inputs[i], argv[i], &s);
+                    stats_phase(OTHER);
+                    if (!tmp) continue;
+                    dieif(dup2(fileno(tmp), fileno(file)) == -1, "dup2 failed: %s\n", errstr);
+                    file = files[i] = inputs[i].file = tmp;
+                }
+                stats_phase(SMOOTHSORT);
+                e = odb_sort_file(&s, fileno(file));
+                dieif(e, "error sorting %s: %s\n", argv[i], odb_strerror(e));
+                stats_phase(OTHER);
+                dieif(flock(fileno(file), LOCK_SH),
+                      "error downgrading lock on %s: %s\n", argv[i], errstr);
             }
+            fields_arg = NULL;
+            if (quiet) return 0;
 
-            if (is_tty && !fork_child(1)) {
-                switch (codec) {
-                    case DELIMITED:
-                    case TABLE:
-                    case CSV:   execlp("less",  "less",  NULL); break;
-                    case PSQL:  execlp("psql",  "psql",  NULL); break;
-                    case MYSQL: execlp("mysql", "mysql", NULL); break;
-                    default: die("unsupported codec\n");
-                }
-                die("exec failed: %s\n", errstr);
+            stats_phase(MERGE);
+            odb_writer_t out;
+            open_output(&out, stdout, h.field_count, h.field_specs);
+            for (int i = 0; open_input(argc, argv, i, 0); i++);
+            int failed;
+            e = odb_merge(&s, inputs, argc, &out, &failed);
+            dieif(failed >= 0, "error reading %s: %s\n", argv[failed], odb_strerror(e));
+            dieif(e, "write error: %s\n", odb_strerror(e));
+            odb_section_t sort = sort_section(&s);
+            close_output(&out, &sort, 1);
+            free((void*) sort.data);
+            perf.comparisons = s.comparisons;
+            perf.swaps = s.swaps;
+            perf.records_in = perf.records_out = out.records;
+            perf.bytes_in += out.records*odb_record_size(&h);
+            perf.bytes_out += out.records*odb_record_size(&h);
+            for (int i = 0; i < argc; i++) close_input(&inputs[i], argv[i]);
+            if (is_tty) wait_child();
+            return 0;
+        }
+
+        case INDEX: {
+            dieif(!fields_arg, "use -f to give the fields to index on\n");
+            dieif(index_arg, "indexes cannot be read while indexing\n");
+            odb_reader_t *r;
+            for (int i = 0; r = open_input(argc, argv, i, 0); i++) {
+                dieif(!r->seekable, "indexes cannot be made for streamed inputs\n");
+                odb_sort_t s;
+                int e = odb_sort_init(&s, &r->header, fields_arg);
+                dieif(e, "invalid field: %s\n", fields_arg);
+                char *path = index_path(argv[i], fields_arg);
+                FILE *out = fopen(path, "w");
+                dieif(!out, "error opening %s: %s\n", path, errstr);
+                stats_phase(SMOOTHSORT);
+                e = odb_index_write(out, &s, fileno(r->file));
+                dieif(e, "error writing %s: %s\n", path, odb_strerror(e));
+                stats_phase(OTHER);
+                perf.comparisons += s.comparisons;
+                perf.swaps += s.swaps;
+                perf.records_in += odb_record_count(r);
+                dieif(fclose(out), "error closing %s: %s\n", path, errstr);
+                odb_sort_free(&s);
+                free(path);
+                close_input(r, argv[i]);
             }
+            return 0;
+        }
 
-            switch (codec) {
-                case DELIMITED: break;
-                case TABLE: {
-                    if (print_line_numbers)
-                        for (int k = 0; k < 12; k++) putchar(' ');
-
-                    for (int j = 0; j < h.field_count; j++) {
-                        char *name = h.field_specs[j].name;
-                        size_t len = strlen(name);
-                        switch (h.field_specs[j].type) {
-                            case INTEGER:
-                            case TIMESTAMP:
-                            case DATE: {
-                                int space = 21 - strlen(name);
-                                for (int k = 0; k < space; k++) putchar(' ');
-                                fwriten(name, 1, len, stdout);
-                                break;
-                            }
-                            case FLOAT: {
-                                int space = 21 - strlen(name);
-                                for (int k = 0; k < space-7; k++) putchar(' ');
-                                fwriten(name, 1, len, stdout);
-                                if (j < h.field_count-1)
-                                    for (int k = 0; k < 7; k++) putchar(' ');
-                                break;
-                            }
-                            case STRING: {
-                                int space = string_maxlen + 1 - strlen(name);
-                                putchar(' ');
-                                fwriten(name, 1, len, stdout);
-                                if (j < h.field_count-1)
-                                    for (int k = 0; k < space-1; k++) putchar(' ');
-                                break;
-                            }
-                            default:
-                                die("unsupported type: %s (%d)\n",
-                                    typestr(h.field_specs[j].type),
-                                    h.field_specs[j].type)
-                        }
-                    }
-                    putchar('\n');
+        case LOOKUP: {
+            dieif(!index_arg, "use -I to give the index to look keys up in\n");
+            dieif(!key_arg, "use -k to give the key to look up\n");
+            stats_phase(HEADER);
+            odb_header_t h = read_headers(argc, argv, 0);
+            int keys;
+            long long *key = parse_keys(&indexes[0], key_arg, &keys);
+            stage_t *s;
+            if (fields_arg) {
+                odb_header_t out;
+                s = cut_stage(h, fields_arg, &out);
+                s->next = write_stage(out);
+            } else {
+                s = write_stage(h);
+            }
+            stats_phase(OUTPUT);
+            odb_reader_t *in;
+            for (int i = 0; in = open_input(argc, argv, i, 0); i++) {
+                long long lo, hi;
+                int e = odb_index_bound(&indexes[i], key, keys, 0, &lo);
+                if (!e) e = odb_index_bound(&indexes[i], key, keys, 1, &hi);
+                dieif(e, "error looking up %s: %s\n", argv[i], odb_strerror(e));
+                slice_input(in, argv[i], make_range(lo+1, 1, hi), count, s);
+                close_input(in, argv[i]);
+            }
+            s->finish(s);
+            if (is_tty) wait_child();
+            return 0;
+        }
 
-                    int dashes = 21*(h.field_count-string_fields)+(string_maxlen+1)*string_fields+1;
-                    if (print_line_numbers) dashes += 12;
-                    for (int j = 0; j < dashes; j++) putchar('-');
-                    putchar('\n');
-                    break;
-                }
-                case PSQL: {
-                    printf("create table \"%s\" (\n", table_name);
-                    for (int j = 0; j < h.field_count; j++) {
-                        printf("  \"%s\" %s%s\n",
-                               h.field_specs[j].name,
-                               psql_types[h.field_specs[j].type],
-                               j < h.field_count-1 ? "," : "");
+        case APPEND: {
+            dieif(!fields_arg, "use -f to give the fields runs are sorted by\n");
+            char *target = argv[0];
+            dieif(!strcmp(target, "-"), "usage: odb append -f <fields> <file> [<input> ...]\n");
+            argv++; argc--;
+            if (!argc) {
+                argc = 1;
+                argv[0] = "-";
+            }
+            stats_phase(HEADER);
+            odb_header_t h = read_headers(argc, argv, 0);
+            odb_sort_t s;
+            int e = odb_sort_init(&s, &h, fields_arg);
+            dieif(e, "invalid field: %s\n", fields_arg);
+
+            // the target starts out as an empty file with the schema of its
+            // runs, linked into place once its header is complete
+            char *tmp;
+            dieif(asprintf(&tmp, "%s.XXXXXX", target) < 0, "out of memory\n");
+            int fd = mkstemp(tmp);
+            dieif(fd < 0, "error creating %s: %s\n", tmp, errstr);
+            FILE *t = fdopen(fd, "w");
+            dieif(!t || odb_write_header(t, &h) || fchmod(fd, 0644) || fclose(t),
+                  "error writing %s: %s\n", tmp, errstr);
+            int created = !link(tmp, target);
+            dieif(!created && errno != EEXIST, "error creating %s: %s\n", target, errstr);
+            unlink(tmp);
+            free(tmp);
+            if (!created) {
+                odb_reader_t t;
+                e = odb_open(&t, target);
+                dieif(e, "error reading %s: %s\n", target, odb_strerror(e));
+                dieif(!odb_header_equal(&h, &t.header), "field spec mismatch: %s\n", target);
+                // readers merge runs into the target, so it must be in their order too
+                long long *first = malloc(t.record_size);
+                dieif(!first, "out of memory\n");
+                dieif(read_batch(&t, first, 1, target) && !sorted_by(&t, target, &s),
+                      "%s is not sorted by %s\n", target, fields_arg);
+                free(first);
+                odb_close(&t);
+            }
+
+            stats_phase(COPY);
+            long long *records = NULL;
+            size_t n = 0, allocated = 0, m;
+            odb_reader_t *in;
+            for (int i = 0; in = open_input(argc, argv, i, 0); i++) {
+                do {
+                    if (allocated < n + ODB_BATCH) {
+                        allocated = 2*(n + ODB_BATCH);
+                        records = realloc(records, allocated*in->record_size);
+                        dieif(!records, "out of memory reading %zu records\n", n);
                     }
-                    printf(");\n");
-                    printf("copy %s from stdin;\n", table_name);
-                    break;
-                }
-                default: die("unsupported codec\n");
+                    n += m = read_batch(in, records + n*h.field_count, ODB_BATCH, argv[i]);
+                } while (m);
+                close_input(in, argv[i]);
             }
+            if (!n) return 0;
+            stats_phase(SMOOTHSORT);
+            odb_sort_records(&s, records, n);
+            perf.comparisons = s.comparisons;
+            perf.swaps = s.swaps;
 
+            stats_phase(OUTPUT);
             FILE *file;
-            long long *record = malloc(h.field_count*sizeof(long long));
-            for (int i = 0; file = fopenr_arg(argc, argv, i, 0); i++) {
-                for (;;) {
-                    int r = fread(record, sizeof(long long), h.field_count, file);
-                    if (!r && feof(file)) break;
-                    dieif(r < h.field_count,
-                          "unexpected eof %s: %s\n", argv[i], errstr);
-                    if (*pre) printf(pre, line_number++, delim);
-                    for (int j = 0; j < h.field_count; j++) {
-                        switch (h.field_specs[j].type) {
-                            case INTEGER: {
-                                printf(integer_format, record[j]);
-                                break;
-                            }
-                            case FLOAT: {
-                                printf(float_format, reinterpret(double,record[j]));
-                                break;
-                            }
-                            case STRING: {
-                                printf(string_format, index_to_string(record[j]));
-                                break;
-                            }
-                            case TIMESTAMP:
-                            case DATE: {
-                                double dt = reinterpret(double,record[j]);
-                                time_t tt = (time_t) round(dt);
-                                struct tm st;
-                                gmtime_r(&tt, &st);
-                                char buffer[256];
-                                char *fmt = timelikefmt(h.field_specs[j].type);
-                                strftime(buffer, sizeof(buffer)-1, fmt, &st);
-                                printf(time_format, buffer);
-                            }
-                        }
-                        if (j < h.field_count-1) printf("%s", inter);
-                    }
-                    printf("%s", post);
+            char *path;
+            e = odb_run_create(target, &file, &path);
+            dieif(e, "error creating run for %s: %s\n", target, odb_strerror(e));
+            odb_writer_t out;
+            open_output(&out, file, h.field_count, h.field_specs);
+            write_batch(&out, records, n);
+            close_output(&out, NULL, 0);
+            dieif(fflush(file) || fsync(fileno(file)) || fclose(file),
+                  "error writing %s: %s\n", path, errstr);
+            e = odb_runs_update(target, fields_arg, NULL, 0, path);
+            if (e) unlink(path);
+            dieif(e == ODB_EMISMATCH, "the runs of %s are sorted by other fields\n", target);
+            dieif(e, "error adding run to %s: %s\n", target, odb_strerror(e));
+            return 0;
+        }
+
+        case COMPACT: {
+            dieif(argc != 1 || !strcmp(argv[0], "-"), "usage: odb compact <file>\n");
+            char *target = argv[0], *missing = NULL;
+            for (;;) {
+                char *fields, **runs;
+                int n;
+                int e = odb_runs_list(target, &fields, &runs, &n);
+                if (e == ODB_EIO && errno == ENOENT) return 0;
+                dieif(e, "error reading runs of %s: %s\n", target, odb_strerror(e));
+
+                int *tier = malloc(n*sizeof(int)), k = 0;
+                dieif(!tier, "out of memory\n");
+                int t = full_tier(runs, n, tier);
+                if (t < 0) return 0;
+                char **merged = malloc(n*sizeof(char*));
+                odb_reader_t *in = calloc(n, sizeof(odb_reader_t));
+                dieif(!merged || !in, "out of memory\n");
+                int lost = -1;
+                for (int i = 0; i < n && lost < 0; i++) if (tier[i] < 0) lost = i;
+                for (int i = 0; i < n && lost < 0; i++) {
+                    if (tier[i] != t) continue;
+                    merged[k] = runs[i];
+                    e = odb_open(&in[k], runs[i]);
+                    if (e == ODB_EIO && errno == ENOENT) lost = i;
+                    else dieif(e, "error reading %s: %s\n", runs[i], odb_strerror(e));
+                    k += !e;
                 }
-                dieif(fclose(file), "error closing %s: %s\n", argv[i], errstr);
+                // a run compacted meanwhile is gone from the list once it is
+                // read again, and one that is still listed has been lost
+                if (lost >= 0) {
+                    dieif(missing && !strcmp(missing, runs[lost]), "run %s of %s is missing\n", runs[lost], target);
+                    free(missing);
+                    missing = strdup(runs[lost]);
+                    dieif(!missing, "out of memory\n");
+                    e = ODB_EIO;
+                }
+
+                if (!e) {
+                    stats_phase(MERGE);
+                    odb_sort_t s;
+                    e = odb_sort_init(&s, &in[0].header, fields);
+                    dieif(e, "invalid field: %s\n", fields);
+                    FILE *file;
+                    char *path;
+                    e = odb_run_create(target, &file, &path);
+                    dieif(e, "error creating run for %s: %s\n", target, odb_strerror(e));
+                    odb_writer_t out;
+                    open_output(&out, file, in[0].header.field_count, in[0].header.field_specs);
+                    int failed;
+                    e = odb_merge(&s, in, k, &out, &failed);
+                    dieif(failed >= 0, "error reading %s: %s\n", merged[failed], odb_strerror(e));
+                    dieif(e, "error writing %s: %s\n", path, odb_strerror(e));
+                    close_output(&out, NULL, 0);
+                    dieif(fflush(file) || fsync(fileno(file)) || fclose(file),
+                          "error writing %s: %s\n", path, errstr);
+                    perf.records_in += out.records;
+                    perf.records_out += out.records;
+                    perf.comparisons += s.comparisons;
+                    stats_phase(OTHER);
+                    e = odb_runs_update(target, fields, merged, k, path);
+                    if (e) unlink(path);
+                    dieif(e && e != ODB_ESTALE, "error updating runs of %s: %s\n", target, odb_strerror(e));
+                    odb_sort_free(&s);
+                    free(path);
+                }
+                for (int i = 0; i < k; i++) odb_close(&in[i]);
+                free(in);
+                free(merged);
+                free(tier);
+                odb_runs_free(fields, runs, n);
             }
-            if (is_tty) wait_child();
-            return 0;
         }
 
-        case CAT: {
+        case PARTITION: {
+            dieif(argc < 2, "usage: odb partition -f <fields> [-n <n> | -p <splits>] <input> ... <pattern>\n");
+            char *pattern = argv[--argc];
+            free(partition_path(pattern, 0));
+            dieif(!fields_arg, "use -f to give the fields to partition by\n");
+            stats_phase(HEADER);
+            odb_header_t h = read_headers(argc, argv, 0);
+            odb_sort_t keys;
+            int e = odb_sort_init(&keys, &h, fields_arg);
+            dieif(e, "invalid field: %s\n", fields_arg);
+
+            long long *splits = NULL;
             int n;
-            cut_t *cut;
-            h = read_headers(argc, argv, 0);
-            h_size = header_size(h);
-        slice:
-            if (!fields_arg) {
-                n = h.field_count;
-                cut = malloc(n*sizeof(cut_t));
-                for (int i = 0; i < h.field_count; i++) {
-                    cut[i].field_spec = h.field_specs[i];
-                    cut[i].from = i;
+            if (splits_arg) {
+                odb_type_t type = h.field_specs[abs(keys.order[0])-1].type;
+                n = strcnt(splits_arg, ',') + 2;
+                splits = malloc((n - 1)*sizeof(long long));
+                char *copy = strdup(splits_arg), *p = copy;
+                dieif(!splits || !copy, "out of memory\n");
+                for (int k = 0; k < n - 1; k++) {
+                    char *comma = strchr(p, ',');
+                    if (comma) *comma = '\0';
+                    splits[k] = parse_key(&h.field_specs[abs(keys.order[0])-1], p);
+                    dieif(type == ODB_STRING && splits[k] < 0, "unknown string: %s\n", p);
+                    dieif(k && !key_lt(type, splits[k-1], splits[k]), "splits out of order: %s\n", splits_arg);
+                    p = comma + 1;
                 }
+                free(copy);
+                dieif(count != LLONG_MAX && count != n,
+                      "%d splits make %d partitions, not %lld\n", n - 1, n, count);
             } else {
-                n = strcnt(fields_arg, ',') + 1;
-                cut = malloc(n*sizeof(cut_t));
-                for (int i = 0; i < n; i++) {
-                    char *comma = strchr(fields_arg, ',');
-                    if (comma) *comma = '\0';
-                    cut_spec_t c = parse_cut_spec(fields_arg);
-                    cut[i].from = -1;
-                    for (int j = 0; j < h.field_count; j++) {
-                        if (!strcmp(c.from_name, h.field_specs[j].name)) {
-                            cut[i].from = j;
-                            memcpy(cut[i].field_spec.name, c.to_name, name_size);
-                            cut[i].field_spec.type = c.to_type != UNSPECIFIED ?
-                                c.to_type : h.field_specs[j].type;
-                            break;
+                dieif(count == LLONG_MAX, "use -n to give the number of partitions\n");
+                dieif(count < 1 || count > INT_MAX, "invalid number of partitions: %lld\n", count);
+                n = count;
+            }
+
+            // every partition gets a batch of records and a large stdio buffer,
+            // which has to be given to setvbuf for its size to count
+            odb_writer_t *out = calloc(n, sizeof(odb_writer_t));
+            long long *batches = malloc((size_t) n*ODB_BATCH*h.field_count*sizeof(long long));
+            size_t *filled = calloc(n, sizeof(size_t));
+            char **buffers = calloc(n, sizeof(char*));
+            dieif(!out || !batches || !filled || !buffers, "out of memory for %d partitions\n", n);
+            for (int k = 0; k < n; k++) {
+                char *path = partition_path(pattern, k);
+                FILE *file = fopen(path, "w");
+                dieif(!file, "error opening %s: %s\n", path, errstr);
+                dieif(!(buffers[k] = malloc(PARTITION_BUFFER)), "out of memory for %d partitions\n", n);
+                setvbuf(file, buffers[k], _IOFBF, PARTITION_BUFFER);
+                open_output(&out[k], file, h.field_count, h.field_specs);
+                free(path);
+            }
+
+            stats_phase(OUTPUT);
+            long long *records = malloc(ODB_BATCH*h.field_count*sizeof(long long));
+            odb_reader_t *in;
+            for (int i = 0; in = open_input(argc, argv, i, 0); i++) {
+                size_t m;
+                while (m = read_batch(in, records, ODB_BATCH, argv[i])) {
+                    for (size_t j = 0; j < m; j++) {
+                        long long *record = records + j*h.field_count;
+                        int k = partition_of(record, &keys, splits, n);
+                        long long *batch = batches + (size_t) k*ODB_BATCH*h.field_count;
+                        memcpy(batch + filled[k]*h.field_count, record, in->record_size);
+                        if (++filled[k] == ODB_BATCH) {
+                            write_batch(&out[k], batch, filled[k]);
+                            filled[k] = 0;
                         }
                     }
-                    dieif(cut[i].from == -1, "invalid field cut: %s\n", fields_arg);
-                    fields_arg = comma + 1;
                 }
+                close_input(in, argv[i]);
+            }
+            for (int k = 0; k < n; k++) {
+                write_batch(&out[k], batches + (size_t) k*ODB_BATCH*h.field_count, filled[k]);
+                close_output(&out[k], NULL, 0);
+                dieif(fclose(out[k].file), "error closing partition %d: %s\n", k, errstr);
+                free(buffers[k]);
             }
+            return 0;
+        }
 
-            field_spec_t *specs = malloc(n*sizeof(field_spec_t));
-            for (int i = 0; i < n; i++) specs[i] = cut[i].field_spec;
-            write_header(stdout, n, specs);
-            free(specs);
+        case BLOOM: {
+            dieif(!fields_arg, "use -f to give the key fields\n");
+            stats_phase(HEADER);
+            odb_header_t h = read_headers(argc, argv, 0);
+            odb_sort_t keys;
+            int e = odb_sort_init(&keys, &h, fields_arg);
+            dieif(e, "invalid field: %s\n", fields_arg);
+
+            stats_phase(PARSE);
+            unsigned long long *hashes = NULL;
+            size_t n = 0;
+            odb_reader_t *in;
+            for (int i = 0; in = open_input(argc, argv, i, 0); i++) {
+                size_t m;
+                unsigned long long *more = key_hashes(in, argv[i], &keys, &m);
+                hashes = realloc(hashes, (n + m)*sizeof(unsigned long long));
+                memcpy(hashes + n, more, m*sizeof(unsigned long long));
+                n += m;
+                free(more);
+                close_input(in, argv[i]);
+            }
+            bloom_t b;
+            dieif(bloom_init(&b, n, BLOOM_BITS_PER_KEY), "out of memory for bloom filter\n");
+            for (size_t j = 0; j < n; j++) bloom_add(&b, hashes[j]);
+
+            // a single named file gets a sidecar unless the filter is redirected
+            stats_phase(OUTPUT);
+            char *source = argc == 1 && strcmp(argv[0], "-") ? argv[0] : NULL;
+            FILE *out = stdout;
+            char *path = "stdout";
+            if (is_tty) {
+                dieif(!source, "redirect the bloom filter of several inputs to a file\n");
+                path = bloom_path(source, fields_arg);
+                out = fopen(path, "w");
+                dieif(!out, "error opening %s: %s\n", path, errstr);
+            }
+            write_bloom(out, &b, n, h, &keys, source);
+            dieif(out == stdout ? fflush(out) : fclose(out), "error writing %s: %s\n", path, errstr);
+            return 0;
+        }
 
-            FILE *file;
-            long long *record = malloc(h.field_count*sizeof(long long));
-            for (int i = 0; file = fopenr_arg(argc, argv, i, 0); i++) {
-                const int is_seekable = seekable(file);
-                range_t r = range;
-                if (is_seekable) {
-                    if (r.start < 0 || r.stop < 0) {
-                        struct stat fs;
-                        dieif(fstat(fileno(file), &fs), "stat error for %s: %s\n", argv[i], errstr);
-                        off_t end = (fs.st_size - h_size)/(h.field_count*sizeof(long long)) + 1;
-                        if (r.start < 0) r.start += end;
-                        if (r.stop  < 0) r.stop  += end;
-                        if (r.start < 0) r.start = 1;
-                    }
-                    off_t ff = (r.start-1)*h.field_count*sizeof(long long);
-                    fseeko(file, ff, SEEK_CUR);
+        case SEMIJOIN: {
+            dieif(!fields_arg, "use -f to give the key fields\n");
+            dieif(!bloom_arg, "use --bloom to give the keys to join with\n");
+            stats_phase(HEADER);
+            odb_header_t h = read_headers(argc, argv, 0);
+
+            // --bloom names a filter, which checks keys exactly against the file
+            // it was made from if that is still there (or alone, if allowed by
+            // --approximate), or a file of keys, whose sidecar filter is used
+            // if it is up to date
+            stats_phase(LOAD_STRINGS);
+            semijoin_t *j = calloc(1, sizeof(semijoin_t));
+            bloom_file_t *bf = &j->bloom;
+            char *source = bloom_arg, *keys = fields_arg;
+            struct stat fs;
+            if (read_bloom(bloom_arg, bf)) {
+                keys = bloom_fields(bf);
+                if (bf->source && !stat(bf->source, &fs) && !access(bf->source, R_OK)) {
+                    source = bf->source;
+                    dieif(!same_stamp(&bf->stamp, &fs),
+                          "%s has changed since its bloom filter %s was made\n", source, bloom_arg);
                 } else {
-                    dieif(r.start < 0 && r.start != -1 || r.stop  < 0 && r.stop  != -1,
-                          "negative range offsets cannot be used with streamed inputs\n");
-                    dieif(r.step < 0,
-                          "negative range strides cannot be used with streamed inputs\n");
-                    if (r.start == -1) break;
-                    if (r.stop  == -1) r.stop = LLONG_MAX;
-
-                    for (int k = 0; k < r.start-1; k++) {
-                        int r = fread(record, sizeof(long long), h.field_count, file);
-                        if (!r && feof(file)) break;
-                        dieif(r < h.field_count,
-                              "unexpected eof %s: %s\n", argv[i], errstr);
-                    }
+                    dieif(!approximate, "can't check keys exactly against %s, the source of %s; "
+                          "use --approximate to rely on the filter alone\n",
+                          bf->source ? bf->source : "stdin", bloom_arg);
+                    source = NULL;
                 }
-                for (long long j = 0; j < count; j++) {
-                    off_t x = r.start + j*r.step;
-                    if (r.step < 0 ? x < r.stop : x > r.stop) break;
-
-                    int rn = fread(record, sizeof(long long), h.field_count, file);
-                    if (!rn && feof(file)) break;
-                    dieif(rn < h.field_count,
-                          "unexpected eof %s: %s\n", argv[i], errstr);
-                    for (int k = 0; k < n; k++)
-                        fwrite1(record + cut[k].from, sizeof(long long), stdout);
-
-                    if (is_seekable) {
-                        off_t ff = (r.step-1)*h.field_count*sizeof(long long);
-                        fseeko(file, ff, SEEK_CUR);
-                    } else {
-                        for (int k = 0; k < r.step-1; k++) {
-                            int r = fread(record, sizeof(long long), h.field_count, file);
-                            if (!r && feof(file)) break;
-                            dieif(r < h.field_count,
-                                  "unexpected eof %s: %s\n", argv[i], errstr);
-                        }
-                    }
+            } else {
+                char *path = bloom_path(bloom_arg, fields_arg);
+                dieif(stat(bloom_arg, &fs), "error opening %s: %s\n", bloom_arg, errstr);
+                if (!access(path, R_OK) && read_bloom(path, bf) && !same_stamp(&bf->stamp, &fs)) {
+                    bloom_free(&bf->filter);
+                    free(bf->specs);
                 }
-                dieif(fclose(file), "error closing %s: %s\n", argv[i], errstr);
+                free(path);
             }
+            if (source) load_keys(source, keys, bf, &j->keys);
+
+            stage_t *s = new_stage(h);
+            int e = odb_sort_init(&s->sort, &h, fields_arg);
+            dieif(e, "invalid field: %s\n", fields_arg);
+            dieif(s->sort.n != bf->keys.n, "key fields don't match the bloom filter\n");
+            for (int k = 0; k < s->sort.n; k++)
+                dieif(h.field_specs[abs(s->sort.order[k])-1].type != bf->specs[k].type,
+                      "key fields don't match the bloom filter\n");
+            s->state = j;
+            s->buffer = malloc(ODB_BATCH*odb_record_size(&h));
+            s->push = semijoin_push;
+            s->next = write_stage(h);
+
+            stats_phase(OUTPUT);
+            run_inputs(argc, argv, range, count, s);
             if (is_tty) wait_child();
             return 0;
         }
 
-        case PASTE: {
-            FILE *file;
-            header_t ht = {0, NULL};
-            int max_field_count = 0;
-            int *field_counts = malloc(argc*sizeof(int));
-            for (int i = 0; file = fopenr_arg(argc, argv, i, 0); i++) {
-                header_t hi = read_header(file);
-                ht.field_specs = realloc(
-                    ht.field_specs,
-                    (ht.field_count + hi.field_count)*sizeof(field_spec_t)
-                );
-                memcpy(
-                    ht.field_specs + ht.field_count,
-                    hi.field_specs, hi.field_count*sizeof(field_spec_t)
-                );
-                ht.field_count += hi.field_count;
-                field_counts[i] = hi.field_count;
-                if (max_field_count < hi.field_count)
-                    max_field_count = hi.field_count;
-                free_header(hi);
-            }
-            write_header(stdout, ht.field_count, ht.field_specs);
-            long long *record = malloc(max_field_count*sizeof(long long));
-            for (;;) {
-                int done = 0;
-                for (int i = 0; file = fopenr_arg(argc, argv, i, 0); i++) {
-                    int r = fread(record, sizeof(long long), field_counts[i], file);
-                    if (!r && feof(file)) {
-                        done++;
-                        dieif(fclose(file), "error closing %s: %s\n", argv[i], errstr);
-                        continue;
-                    };
-                    dieif(r < field_counts[i],
-                          "unexpected eof %s: %s\n", argv[i], errstr);
-                    fwriten(record, sizeof(long long), field_counts[i], stdout);
-                }
-                dieif(done && done < argc, "unequal records in inputs\n");
-                if (done) break;
+        case SAMPLE: {
+            dieif(count == LLONG_MAX, "use -n to give a sample size\n");
+            dieif(count < 1, "invalid sample size: %lld\n", count);
+            stats_phase(HEADER);
+            odb_header_t h = read_headers(argc, argv, 0);
+            int streamed = 0;
+            odb_reader_t *in;
+            for (int i = 0; in = open_input(argc, argv, i, 0); i++)
+                if (!in->seekable) streamed = 1;
+            srand48(seed < 0 ? time(NULL) ^ getpid() : seed);
+            stage_t *s;
+            if (fields_arg) {
+                odb_header_t out;
+                s = cut_stage(h, fields_arg, &out);
+                s->next = write_stage(out);
+            } else {
+                s = write_stage(h);
             }
+            stats_phase(OUTPUT);
+            if (streamed)
+                sample_streams(argc, argv, count, s);
+            else
+                sample_files(argc, argv, count, s);
             if (is_tty) wait_child();
             return 0;
         }
 
-        case SORT: {
-            h = read_headers(argc, argv, 1);
-            h_size = header_size(h);
-
-            if (!fields_arg) {
-                sort_n = h.field_count;
-                sort_order = malloc(sort_n*sizeof(int));
-                for (int i = 0; i < h.field_count; i++) sort_order[i] = i+1;
-            } else {
-                sort_n = strcnt(fields_arg, ',') + 1;
-                sort_order = calloc(sort_n, sizeof(int));
-                for (int i = 0; i < sort_n; i++) {
-                    int sign = 1;
-                    if (fields_arg[0] == '-') {
-                        fields_arg++;
-                        sign = -1;
-                    } else if (fields_arg[0] == '+') {
-                        fields_arg++;
+        case STATS: {
+            stats_phase(HEADER);
+            odb_header_t h = read_headers(argc, argv, 0);
+            odb_profile_t p;
+            int e = odb_profile_init(&p, &h, fields_arg);
+            dieif(e, "invalid field: %s\n", fields_arg);
+            default_jobs();
+
+            stats_phase(SCAN);
+            odb_reader_t *in;
+            long long *records = malloc(ODB_BATCH*h.field_count*sizeof(long long));
+            for (int i = 0; in = open_input(argc, argv, i, 0); i++) {
+                if (in->seekable) {
+                    profile_file(in, argv[i], &p);
+                } else {
+                    size_t n;
+                    while (n = read_batch(in, records, ODB_BATCH, argv[i])) {
+                        int e = odb_profile_add(&p, records, n);
+                        dieif(e, "error profiling %s: %s\n", argv[i], odb_strerror(e));
                     }
-                    char *comma = strchr(fields_arg, ',');
-                    if (comma) *comma = '\0';
-                    for (int j = 0; j < h.field_count; j++)
-                        if (!strcmp(fields_arg, h.field_specs[j].name))
-                            sort_order[i] = sign*(j+1);
-                    dieif(!sort_order[i], "invalid field: %s\n", fields_arg);
-                    fields_arg = comma + 1;
                 }
+                close_input(in, argv[i]);
             }
+            free(records);
 
-            FILE *file;
-            for (int i = 0; file = fopenr_arg(argc, argv, i, 1); i++) {
-                if (!seekable(file)) {
-                    FILE *tmp = tmpfile();
-                    write_header(tmp, h.field_count, h.field_specs);
-                    long long *record = malloc(h.field_count*sizeof(long long));
-                    for (;;) {
-                        int r = fread(record, sizeof(long long), h.field_count, file);
-                        if (!r && feof(file)) break;
-                        dieif(r < h.field_count,
-                              "unexpected eof %s: %s\n", argv[i], errstr);
-                        fwriten(record, sizeof(long long), h.field_count, tmp);
+            stats_phase(OUTPUT);
+            print_profile(h, &p);
+            odb_profile_free(&p);
+            return 0;
+        }
+
+        case RUN: {
+            int n, stages = 0, decoded = 0;
+            char **words = split_pipeline(argc, argv, &n);
+            stage_t *first = NULL, *last = NULL;
+            odb_header_t h;
+            int in_argc;
+            char **in_argv;
+            range_t in_range = make_range(1,1,-1);
+            long long in_count = LLONG_MAX;
+
+            for (int i = 0; i <= n; i++) {
+                int j = i;
+                while (j < n && strcmp(words[j], "|")) j++;
+                dieif(j == i, "empty stage in pipeline\n");
+                dieif(decoded, "decode must be the last stage of a pipeline\n");
+
+                int stage_argc = j - i + 1;
+                char **stage_argv = calloc(stage_argc + 1, sizeof(char*));
+                stage_argv[0] = "odb";
+                memcpy(stage_argv + 1, words + i, (j - i)*sizeof(char*));
+                fields_arg = NULL;
+                range = make_range(1,1,-1);
+                count = LLONG_MAX;
+                optind = 0;
+                parse_opts(&stage_argc, &stage_argv);
+                dieif(stage_argc < 1, "empty stage in pipeline\n");
+                cmd_t stage_cmd = parse_cmd(stage_argv[0]);
+                char *stage_name = stage_argv[0];
+                stage_argv++; stage_argc--;
+
+                if (!stages++) {
+                    if (!stage_argc) {
+                        stage_argc = 1;
+                        stage_argv[0] = "-";
                     }
-                    free(record);
-                    dieif(fseeko(tmp, h_size, SEEK_SET), "seek error: %s", errstr);
-                    dieif(dup2(fileno(tmp), fileno(file)) == -1, "dup2 failed: %s\n", errstr);
-                    file = files[i] = tmp;
+                    stats_phase(HEADER);
+                    h = read_headers(stage_argc, stage_argv, 0);
+                    in_argc = stage_argc;
+                    in_argv = stage_argv;
+                    if (stage_cmd == CAT) {
+                        in_range = range;
+                        in_count = count;
+                        range = make_range(1,1,-1);
+                        count = LLONG_MAX;
+                    }
+                } else {
+                    dieif(stage_argc, "only the first stage of a pipeline reads files: %s\n",
+                          stage_argv[0]);
                 }
-                struct stat fs;
-                dieif(fstat(fileno(file), &fs), "stat error for %s: %s\n", argv[i], errstr);
-
-                char *mapped = mmap(
-                    NULL,
-                    fs.st_size,
-                    PROT_READ | PROT_WRITE,
-                    MAP_SHARED,
-                    fileno(file),
-                    0
-                );
-                dieif(mapped == MAP_FAILED, "mmap failed for %s: %s\n", argv[i], errstr);
-                dieif(memcmp(mapped, &preamble, sizeof(preamble_t)), "invalid odb file\n");
-
-                long long *data = (long long*)(mapped + h_size);
-                size_t n = (fs.st_size-h_size)/(h.field_count*sizeof(long long));
-                su_smoothsort(data, 0, n, lt_records, swap_records);
-
-                dieif(munmap(mapped, fs.st_size),
-                      "munmap failed for %s: %s\n", argv[i], errstr);
-                dieif(flock(fileno(file), LOCK_SH),
-                      "error downgrading lock on %s: %s\n", argv[i], errstr);
-            }
-            fields_arg = NULL;
-            if (quiet) return 0;
 
-            write_header(stdout, h.field_count, h.field_specs);
-            long long *records = malloc(argc*h.field_count*sizeof(long long));
-            int *done = calloc(argc, sizeof(int));
-            int donecount = 0;
-            for (int i = 0; file = fopenr_arg(argc, argv, i, 0); i++) {
-                int r = fread(records + i*h.field_count,
-                              sizeof(long long), h.field_count, file);
-                if (!r && feof(file)) {
-                    done[i] = 1;
-                    donecount++;
-                    dieif(fclose(file), "error closing %s: %s\n", argv[i], errstr);
-                    break;
+                stage_t *s = NULL, *tail = NULL;
+                switch (stage_cmd) {
+                    case CAT: {
+                        if (range.start != 1 || range.step != 1 || range.stop != -1 || count != LLONG_MAX)
+                            s = tail = slice_stage(h, range, count);
+                        if (fields_arg) {
+                            odb_header_t out;
+                            stage_t *c = cut_stage(h, fields_arg, &out);
+                            if (tail) tail->next = c; else s = c;
+                            tail = c;
+                            h = out;
+                        }
+                        break;
+                    }
+                    case SORT:
+                        s = tail = sort_stage(h, fields_arg);
+                        break;
+                    case PRINT:
+                        codec = TABLE;
+                    case DECODE:
+                        dieif(j < n, "decode must be the last stage of a pipeline\n");
+                        s = tail = decode_stage(h, is_tty);
+                        decoded = 1;
+                        break;
+                    default:
+                        die("%s cannot be used in a pipeline\n", stage_name);
                 }
-                dieif(r < h.field_count,
-                      "unexpected eof %s: %s\n", argv[i], errstr);
-            }
-            while (donecount < argc) {
-                int min = -1;
-                for (int i = 0; i < argc; i++)
-                    if (!done[i] && (min < 0 || lt_records(records, i, min)))
-                        min = i;
-                dieif(min < 0, "unexpected merge error\n");
-                fwriten(records + min*h.field_count,
-                        sizeof(long long), h.field_count, stdout);
-
-                int r = fread(records + min*h.field_count,
-                              sizeof(long long), h.field_count, files[min]);
-                if (!r && feof(files[min])) {
-                    done[min] = 1;
-                    donecount++;
-                    dieif(fclose(files[min]), "error closing %s: %s\n", argv[min], errstr);
-                } else {
-                    dieif(r < h.field_count,
-                          "unexpected eof %s: %s\n", argv[min], errstr);
+                if (s) {
+                    if (last) last->next = s; else first = s;
+                    last = tail;
                 }
+                i = j;
             }
+            if (!decoded) {
+                if (is_tty) codec = TABLE;
+                stage_t *s = is_tty ? decode_stage(h, 1) : write_stage(h);
+                if (last) last->next = s; else first = s;
+            }
+            stats_phase(OUTPUT);
+            run_inputs(in_argc, in_argv, in_range, in_count, first);
             if (is_tty) wait_child();
             return 0;
         }
 
+        case SERVE:
+            serve(argc, argv);
+            return 0;
+
         case HELP:
             printf("%s\n\ncommands:\n%s\noptions:\n%s\n", usage, cmdstr, optstr);
             return 0;
@@ -0,0 +1,251 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "readahead.h"
+
+// O_DIRECT needs offsets, lengths and buffers aligned to the logical block size
+#define DIRECT_ALIGN 4096
+
+typedef struct {
+    unsigned char *data;
+    off_t offset;
+    size_t length;
+    ssize_t result;
+    int pending;
+    struct iovec iov;
+} buffer_t;
+
+// an io_uring set up by hand, as liburing may not be installed
+typedef struct {
+    int fd;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;
+    size_t sq_size, cq_size, sqes_size;
+} ring_t;
+
+// buffers[head] holds pos, and the others the reads after it in turn
+struct readahead {
+    int fd, direct, depth, head;
+    off_t pos, next, end;
+    size_t size;
+    buffer_t *buffers;
+    ring_t *ring;
+};
+
+static void ring_free(ring_t *r) {
+    if (r->sqes) munmap(r->sqes, r->sqes_size);
+    if (r->cq_map && r->cq_map != r->sq_map) munmap(r->cq_map, r->cq_size);
+    if (r->sq_map) munmap(r->sq_map, r->sq_size);
+    close(r->fd);
+    free(r);
+}
+
+static void *ring_map(ring_t *r, size_t size, off_t what) {
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, what);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+static ring_t *ring_open(unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring_t *r = calloc(1, sizeof(ring_t));
+    if (!r) return NULL;
+    if ((r->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0) {
+        free(r);
+        return NULL;
+    }
+    r->sq_size = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    r->cq_size = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    r->sqes_size = p.sq_entries*sizeof(struct io_uring_sqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) r->sq_size = r->cq_size = MAX(r->sq_size, r->cq_size);
+    if (!(r->sq_map = ring_map(r, r->sq_size, IORING_OFF_SQ_RING)) ||
+        !(r->cq_map = p.features & IORING_FEAT_SINGLE_MMAP ? r->sq_map : ring_map(r, r->cq_size, IORING_OFF_CQ_RING)) ||
+        !(r->sqes = ring_map(r, r->sqes_size, IORING_OFF_SQES))) {
+        ring_free(r);
+        return NULL;
+    }
+    char *sq = r->sq_map, *cq = r->cq_map;
+    r->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*)(sq + p.sq_off.array);
+    r->cq_head = (unsigned*)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    return r;
+}
+
+static int ring_submit(ring_t *r, int fd, buffer_t *b, unsigned long long tag) {
+    unsigned tail = *r->sq_tail, index = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->off = b->offset;
+    sqe->addr = (unsigned long) &b->iov;
+    sqe->len = 1;
+    sqe->user_data = tag;
+    r->sq_array[index] = index;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    int n;
+    while ((n = syscall(__NR_io_uring_enter, r->fd, 1, 0, 0, NULL, 0)) < 0 && errno == EINTR);
+    return n == 1 ? 0 : -1;
+}
+
+// reap completions until b's has come
+static int ring_wait(readahead_t *a, buffer_t *b) {
+    ring_t *r = a->ring;
+    while (b->pending) {
+        unsigned head = *r->cq_head;
+        if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+            if (syscall(__NR_io_uring_enter, r->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+                errno != EINTR) return -1;
+            continue;
+        }
+        struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+        buffer_t *done = &a->buffers[cqe->user_data];
+        done->result = cqe->res;
+        done->pending = 0;
+        __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+static void start(readahead_t *a, buffer_t *b) {
+    b->offset = a->next;
+    b->length = a->next < a->end ? MIN(a->size, a->end - a->next) : 0;
+    if (a->direct) b->length = (b->length + DIRECT_ALIGN - 1) & ~(size_t) (DIRECT_ALIGN - 1);
+    a->next += b->length;
+    b->result = 0;
+    b->iov.iov_base = b->data;
+    b->iov.iov_len = b->length;
+    b->pending = b->length > 0;
+    if (b->pending && a->ring && ring_submit(a->ring, a->fd, b, b - a->buffers)) {
+        b->pending = 0;
+        b->result = -errno;
+    }
+}
+
+// without a ring, reads are made when they are needed
+static int finish(readahead_t *a, buffer_t *b) {
+    if (b->pending && !a->ring) {
+        b->result = pread(a->fd, b->data, b->length, b->offset);
+        if (b->result < 0) b->result = -errno;
+        b->pending = 0;
+    }
+    if (b->pending && ring_wait(a, b)) return -1;
+    // short reads before the end are completed with pread
+    while (b->result >= 0 && b->result < b->length && b->offset + b->result < a->end) {
+        ssize_t n = pread(a->fd, b->data + b->result, b->length - b->result, b->offset + b->result);
+        if (n < 0) b->result = -errno;
+        if (n <= 0) break;
+        b->result += n;
+    }
+    if (b->result >= 0) return 0;
+    errno = -b->result;
+    return -1;
+}
+
+ssize_t readahead_read(readahead_t *a, void *buf, size_t n) {
+    size_t got = 0;
+    while (got < n && a->pos < a->end) {
+        buffer_t *b = &a->buffers[a->head];
+        if (finish(a, b)) return -1;
+        off_t end = MIN(b->offset + b->result, a->end);
+        if (a->pos < end) {
+            size_t k = MIN(n - got, end - a->pos);
+            memcpy((char*) buf + got, b->data + (a->pos - b->offset), k);
+            got += k;
+            a->pos += k;
+        } else {
+            // the file ended early
+            if (b->result < b->length || !b->length) break;
+            start(a, b);
+            a->head = (a->head + 1) % a->depth;
+        }
+    }
+    return got;
+}
+
+int readahead_seek(readahead_t *a, off_t pos) {
+    if (pos < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    buffer_t *b = &a->buffers[a->head];
+    if (!b->pending && b->result > 0 && b->offset <= pos && pos < b->offset + b->result) {
+        a->pos = pos;
+        return 0;
+    }
+    for (int i = 0; i < a->depth; i++) finish(a, &a->buffers[i]);
+    a->pos = pos;
+    a->next = a->direct ? pos & ~(off_t) (DIRECT_ALIGN - 1) : pos;
+    a->head = 0;
+    for (int i = 0; i < a->depth; i++) start(a, &a->buffers[i]);
+    return 0;
+}
+
+off_t readahead_tell(const readahead_t *a) {
+    return a->pos;
+}
+
+void readahead_close(readahead_t *a) {
+    for (int i = 0; i < a->depth; i++) {
+        finish(a, &a->buffers[i]);
+        free(a->buffers[i].data);
+    }
+    if (a->ring) ring_free(a->ring);
+    if (a->fd >= 0) close(a->fd);
+    free(a->buffers);
+    free(a);
+}
+
+readahead_t *readahead_open(int fd, off_t start, off_t end, size_t size, int depth, int direct) {
+    readahead_t *a = calloc(1, sizeof(readahead_t));
+    if (!a) return NULL;
+    a->fd = -1;
+    // the file gets a descriptor of its own, so O_DIRECT doesn't affect others
+    if (direct) {
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+        a->fd = open(path, O_RDONLY | O_DIRECT | O_CLOEXEC);
+        a->direct = a->fd >= 0;
+    }
+    if (a->fd < 0) a->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    a->size = (size + DIRECT_ALIGN - 1) & ~(size_t) (DIRECT_ALIGN - 1);
+    a->depth = depth;
+    a->end = end;
+    a->buffers = calloc(depth, sizeof(buffer_t));
+    if (a->fd < 0 || !a->buffers) goto fail;
+    for (int i = 0; i < depth; i++)
+        if (posix_memalign((void**) &a->buffers[i].data, DIRECT_ALIGN, a->size)) goto fail;
+    // filesystems that take O_DIRECT opens may still refuse the reads
+    if (a->direct && pread(a->fd, a->buffers[0].data, DIRECT_ALIGN, 0) < 0) {
+        close(a->fd);
+        a->direct = 0;
+        if ((a->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) < 0) goto fail;
+    }
+    a->ring = ring_open(depth);
+    readahead_seek(a, start);
+    return a;
+fail:
+    if (a->buffers)
+        for (int i = 0; i < depth; i++) free(a->buffers[i].data);
+    if (a->fd >= 0) close(a->fd);
+    free(a->buffers);
+    free(a);
+    return NULL;
+}
@@ -0,0 +1,19 @@
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include <sys/types.h>
+
+// sequential reads of a byte range of a file, with depth reads of size bytes
+// kept in flight through io_uring, or made with pread when it is missing
+
+typedef struct readahead readahead_t;
+
+// direct bypasses the page cache with O_DIRECT where the filesystem allows
+readahead_t *readahead_open(int fd, off_t start, off_t end, size_t size, int depth, int direct);
+// copies up to n bytes, fewer only at the end; -1 with errno set on errors
+ssize_t readahead_read(readahead_t *a, void *buf, size_t n);
+int readahead_seek(readahead_t *a, off_t pos);
+off_t readahead_tell(const readahead_t *a);
+void readahead_close(readahead_t *a);
+
+#endif
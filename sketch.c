@@ -0,0 +1,229 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "sketch.h"
+
+#define HLL_M (1 << HLL_BITS)
+
+// splitmix64 finalizer, so clustered values like string indexes spread out
+unsigned long long hash64(unsigned long long x) {
+    x ^= x >> 30; x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27; x *= 0x94d049bb133111ebULL;
+    return x ^ x >> 31;
+}
+
+void hll_init(hll_t *h) {
+    memset(h->reg, 0, sizeof(h->reg));
+}
+
+void hll_add(hll_t *h, unsigned long long v) {
+    unsigned long long x = hash64(v);
+    unsigned i = x >> (64 - HLL_BITS);
+    x = x << HLL_BITS | 1ULL << (HLL_BITS - 1);
+    unsigned char rank = __builtin_clzll(x) + 1;
+    if (rank > h->reg[i]) h->reg[i] = rank;
+}
+
+void hll_merge(hll_t *a, const hll_t *b) {
+    for (int i = 0; i < HLL_M; i++)
+        if (b->reg[i] > a->reg[i]) a->reg[i] = b->reg[i];
+}
+
+double hll_count(const hll_t *h) {
+    double sum = 0;
+    int zeros = 0;
+    for (int i = 0; i < HLL_M; i++) {
+        sum += ldexp(1, -h->reg[i]);
+        zeros += !h->reg[i];
+    }
+    double e = 0.7213/(1 + 1.079/HLL_M)*HLL_M*HLL_M/sum;
+    // linear counting is more accurate while many registers are empty
+    if (e <= 2.5*HLL_M && zeros) e = HLL_M*log((double) HLL_M/zeros);
+    return e;
+}
+
+void kll_init(kll_t *s, int k) {
+    memset(s, 0, sizeof(*s));
+    s->k = k;
+    s->seed = 0x9e3779b97f4a7c15ULL;
+}
+
+void kll_free(kll_t *s) {
+    for (int h = 0; h < s->slots; h++) free(s->items[h]);
+    free(s->items);
+    free(s->size);
+    free(s->allocated);
+    memset(s, 0, sizeof(*s));
+}
+
+// lower levels get geometrically smaller capacities
+static size_t capacity(int k, int levels, int h) {
+    size_t c = ceil(k*pow(2.0/3, levels - 1 - h));
+    return c < 8 ? 8 : c;
+}
+
+// make room for level h to hold n items, without changing what it holds
+static int reserve(kll_t *s, int h, size_t n) {
+    if (h >= s->slots) {
+        double **items = realloc(s->items, (h + 1)*sizeof(double*));
+        if (items) s->items = items;
+        size_t *size = realloc(s->size, (h + 1)*sizeof(size_t));
+        if (size) s->size = size;
+        size_t *allocated = realloc(s->allocated, (h + 1)*sizeof(size_t));
+        if (allocated) s->allocated = allocated;
+        if (!items || !size || !allocated) return -1;
+        for (; s->slots <= h; s->slots++) {
+            s->items[s->slots] = NULL;
+            s->size[s->slots] = s->allocated[s->slots] = 0;
+        }
+    }
+    if (n > s->allocated[h]) {
+        size_t allocated = s->allocated[h] ? 2*s->allocated[h] : 8;
+        if (allocated < n) allocated = n;
+        double *items = realloc(s->items[h], allocated*sizeof(double));
+        if (!items) return -1;
+        s->items[h] = items;
+        s->allocated[h] = allocated;
+    }
+    return 0;
+}
+
+// make room for adding extra[h] items to each level and then, if compacting,
+// for compaction, so that neither can fail; a full level of n items always
+// promotes n/2 of them, whichever they are, so the sizes it leads to are
+// known in advance. Levels beyond the first 64 would take 2^64 items
+static int prepare(kll_t *s, const size_t *extra, int extra_levels, int compacting) {
+    int levels = s->levels > extra_levels ? s->levels : extra_levels;
+    size_t size[levels + 64];
+    for (int h = 0; h < levels; h++) {
+        size[h] = (h < s->levels ? s->size[h] : 0) + (h < extra_levels ? extra[h] : 0);
+        if (reserve(s, h, size[h])) return -1;
+    }
+    for (int h = 0; compacting && h < levels; h++) {
+        if (size[h] < capacity(s->k, levels, h)) continue;
+        if (h + 1 == levels) size[levels++] = 0;
+        size[h + 1] += size[h]/2;
+        if (reserve(s, h + 1, size[h + 1])) return -1;
+        size[h] &= 1;
+    }
+    return 0;
+}
+
+static void push(kll_t *s, int h, double v) {
+    if (h == s->levels) s->levels++;
+    s->items[h][s->size[h]++] = v;
+}
+
+static int double_cmp(const void *a, const void *b) {
+    double x = *(double*)a, y = *(double*)b;
+    return x < y ? -1 : x > y;
+}
+
+static unsigned long long next_random(kll_t *s) {
+    return s->seed = s->seed*6364136223846793005ULL + 1442695040888963407ULL;
+}
+
+// sort every full level and promote a random half of it to the next one; of
+// an odd number of items, a random one stays behind rather than the largest,
+// which would bias the sketch upwards. prepare has made room for it all
+static void compact(kll_t *s) {
+    for (int h = 0; h < s->levels; h++) {
+        size_t n = s->size[h];
+        if (n < capacity(s->k, s->levels, h)) continue;
+        double *items = s->items[h], kept = 0;
+        qsort(items, n, sizeof(double), double_cmp);
+        if (n & 1) {
+            size_t r = (next_random(s) >> 32)*n >> 32;
+            kept = items[r];
+            memmove(items + r, items + r + 1, (n - r - 1)*sizeof(double));
+            n--;
+        }
+        for (size_t i = next_random(s) >> 63; i < n; i += 2) push(s, h + 1, items[i]);
+        items[0] = kept;
+        s->size[h] &= 1;
+    }
+}
+
+int kll_add(kll_t *s, double v) {
+    size_t one = 1;
+    int compacting = (s->levels ? s->size[0] : 0) + 1 >= capacity(s->k, s->levels ? s->levels : 1, 0);
+    if (prepare(s, &one, 1, compacting)) return -1;
+    push(s, 0, v);
+    s->n++;
+    if (compacting) compact(s);
+    return 0;
+}
+
+int kll_merge(kll_t *a, const kll_t *b) {
+    if (prepare(a, b->size, b->levels, 1)) return -1;
+    if (a->levels < b->levels) a->levels = b->levels;
+    for (int h = 0; h < b->levels; h++)
+        for (size_t i = 0; i < b->size[h]; i++) push(a, h, b->items[h][i]);
+    a->n += b->n;
+    compact(a);
+    return 0;
+}
+
+typedef struct {
+    double v;
+    unsigned long long w;
+} weighted_t;
+
+static int weighted_cmp(const void *a, const void *b) {
+    return double_cmp(&((weighted_t*)a)->v, &((weighted_t*)b)->v);
+}
+
+double kll_quantile(const kll_t *s, double q) {
+    size_t n = 0;
+    for (int h = 0; h < s->levels; h++) n += s->size[h];
+    if (!n) return NAN;
+    weighted_t *all = malloc(n*sizeof(weighted_t));
+    if (!all) return NAN;
+    unsigned long long total = 0;
+    n = 0;
+    for (int h = 0; h < s->levels; h++) {
+        for (size_t i = 0; i < s->size[h]; i++) {
+            all[n].v = s->items[h][i];
+            all[n++].w = 1ULL << h;
+            total += 1ULL << h;
+        }
+    }
+    qsort(all, n, sizeof(weighted_t), weighted_cmp);
+    unsigned long long seen = 0;
+    size_t i;
+    for (i = 0; i < n - 1; i++)
+        if ((seen += all[i].w) >= q*total) break;
+    double v = all[i].v;
+    free(all);
+    return v;
+}
+
+// blocks are addressed by the high half of a key hash, bits by a rehash
+int bloom_init(bloom_t *b, unsigned long long keys, int bits_per_key) {
+    b->blocks = (keys*bits_per_key + 511)/512;
+    if (!b->blocks) b->blocks = 1;
+    if (b->blocks >> 32) return -1;
+    if (posix_memalign((void**) &b->bits, 64, b->blocks*64)) return -1;
+    memset(b->bits, 0, b->blocks*64);
+    return 0;
+}
+
+void bloom_free(bloom_t *b) {
+    free(b->bits);
+    b->bits = NULL;
+}
+
+void bloom_add(bloom_t *b, unsigned long long h) {
+    unsigned long long *block = bloom_block(b, h), g = hash64(h);
+    for (int i = 0; i < BLOOM_K; i++, g >>= 9)
+        block[(g & 511) >> 6] |= 1ULL << (g & 63);
+}
+
+int bloom_contains(const bloom_t *b, unsigned long long h) {
+    const unsigned long long *block = bloom_block(b, h);
+    unsigned long long g = hash64(h);
+    for (int i = 0; i < BLOOM_K; i++, g >>= 9)
+        if (!(block[(g & 511) >> 6] & 1ULL << (g & 63))) return 0;
+    return 1;
+}
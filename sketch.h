@@ -0,0 +1,52 @@
+#ifndef SKETCH_H
+#define SKETCH_H
+
+// mergeable summaries of value streams, for single-pass column profiles
+
+unsigned long long hash64(unsigned long long x);
+
+// hyperloglog distinct counts of raw 64-bit values
+#define HLL_BITS 14
+
+typedef struct {
+    unsigned char reg[1 << HLL_BITS];
+} hll_t;
+
+void hll_init(hll_t *h);
+void hll_add(hll_t *h, unsigned long long v);
+void hll_merge(hll_t *a, const hll_t *b);
+double hll_count(const hll_t *h);
+
+// kll quantile sketch: level h holds items of weight 2^h, in slots that may
+// run ahead of the levels in use; adding and merging fail with -1 when out of
+// memory, leaving the sketch unchanged, and quantiles are then NAN
+typedef struct {
+    int k, levels, slots;
+    double **items;
+    size_t *size, *allocated;
+    unsigned long long n, seed;
+} kll_t;
+
+void kll_init(kll_t *s, int k);
+void kll_free(kll_t *s);
+int kll_add(kll_t *s, double v);
+int kll_merge(kll_t *a, const kll_t *b);
+double kll_quantile(const kll_t *s, double q);
+
+// blocked bloom filters: each key sets BLOOM_K bits of one 64-byte block,
+// so a probe touches a single cache line
+#define BLOOM_K 7
+
+typedef struct {
+    unsigned long long blocks;
+    unsigned long long *bits;
+} bloom_t;
+
+#define bloom_block(b,h) ((b)->bits + 8*((((h) >> 32)*(b)->blocks) >> 32))
+
+int bloom_init(bloom_t *b, unsigned long long keys, int bits_per_key);
+void bloom_free(bloom_t *b);
+void bloom_add(bloom_t *b, unsigned long long h);
+int bloom_contains(const bloom_t *b, unsigned long long h);
+
+#endif